@@ -0,0 +1,190 @@
+#ifndef ASYNCLOG_HPP
+#define ASYNCLOG_HPP 1
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// Logging for the data path.
+//
+// A log call copies the time, the call site and up to 5 numbers into a
+// 64 bytes record in a per-thread ring (one producer, one consumer, no
+// lock).  The background thread formats the records.  A full ring drops
+// the record instead of waiting.  Each call site is limited to a number of
+// records per second, the suppressed ones are counted and reported with
+// the next record of the site.  Raw dumps have a global byte budget.
+//
+//   ASYNC_LOG("Channel: {} energy: {}", ch, energy);
+//   ASYNC_DUMP("Data size: {}", data, size);  // 64 bit words as bits
+constexpr uint32_t kLogMaxArgs = 5;
+
+struct LogSite {
+  LogSite(const char *format, uint32_t maxPerSecond = 0)
+      : format(format), maxPerSecond(maxPerSecond)
+  {
+  }
+  const char *format;
+  uint32_t maxPerSecond;  // 0: AsyncLog default
+  std::atomic<uint64_t> windowStart{0};
+  std::atomic<uint32_t> count{0};
+  std::atomic<uint64_t> suppressed{0};
+};
+
+struct LogRecord {
+  uint64_t timeNs;
+  LogSite *site;
+  uint8_t types[kLogMaxArgs];
+  uint8_t nArgs;
+  uint8_t dump;  // args are raw words
+  uint8_t reserved;
+  uint64_t args[kLogMaxArgs];
+};
+static_assert(sizeof(LogRecord) == 64, "LogRecord layout");
+
+class AsyncLog
+{
+ public:
+  enum ArgType : uint8_t { Int, UInt, Double };
+
+  static AsyncLog &Get();
+  ~AsyncLog();
+
+  // Empty for std::cout
+  void SetOutput(std::string fileName);
+  // Records per second and call site, 0 is no limit
+  void SetRateLimit(uint32_t perSecond) { fRateLimit = perSecond; }
+  // Raw dump bytes per second, over it the whole dump is dropped
+  void SetDumpLimit(uint64_t bytesPerSecond) { fDumpLimit = bytesPerSecond; }
+
+  template <typename... Args>
+  void Write(LogSite &site, Args... args);
+  void Dump(LogSite &site, const uint8_t *data, size_t size);
+
+  // Block until the records written before are formatted
+  void Flush();
+
+  // Lost to full rings or to the dump budget
+  uint64_t GetNDropped() { return fNDropped; }
+
+ private:
+  AsyncLog();
+
+  struct Buffer_t {
+    static constexpr uint64_t kSize = 4096;  // Power of 2
+    std::array<LogRecord, kSize> records;
+    alignas(64) std::atomic<uint64_t> head{0};  // Producer
+    alignas(64) std::atomic<uint64_t> tail{0};  // Consumer
+    std::atomic<bool> retired{false};
+    uint32_t threadId = 0;
+  };
+  // Marks the buffer retired at thread exit
+  struct BufferHolder_t {
+    std::shared_ptr<Buffer_t> buffer;
+    ~BufferHolder_t()
+    {
+      if (buffer) buffer->retired = true;
+    }
+  };
+  Buffer_t &GetBuffer();
+  bool Allow(LogSite &site, uint64_t now);
+  void Push(const LogRecord &record);
+
+  std::mutex fBuffersMutex;
+  std::vector<std::shared_ptr<Buffer_t>> fBuffers;
+  uint32_t fNThreads = 0;
+
+  std::atomic<uint32_t> fRateLimit{1000};
+  std::atomic<uint64_t> fDumpLimit{64 * 1024};
+  std::atomic<uint64_t> fDumpWindowStart{0};
+  std::atomic<uint64_t> fDumpBytes{0};
+  std::atomic<uint64_t> fNDropped{0};
+
+  std::mutex fOutputMutex;
+  std::ofstream fFile;
+  uint64_t fStartSteadyNs = 0;
+  uint64_t fStartSystemNs = 0;
+
+  std::mutex fFlushMutex;
+  std::condition_variable fFlushCondition;
+  uint64_t fFlushRequest = 0;
+  uint64_t fFlushDone = 0;
+  bool fLogFlag = true;
+  std::thread fLogThread;
+  void LogThread();
+  void Format(const LogRecord &record, uint32_t threadId, std::string &out);
+
+  static uint64_t NowNs()
+  {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+  }
+  template <typename T>
+  static void Pack(LogRecord &record, T value);
+};
+
+template <typename T>
+void AsyncLog::Pack(LogRecord &record, T value)
+{
+  if (record.nArgs >= kLogMaxArgs) {
+    return;
+  }
+  auto &arg = record.args[record.nArgs];
+  auto &type = record.types[record.nArgs];
+  if constexpr (std::is_floating_point_v<T>) {
+    double d = value;
+    std::memcpy(&arg, &d, sizeof(d));
+    type = Double;
+  } else if constexpr (std::is_enum_v<T>) {
+    arg = static_cast<uint64_t>(value);
+    type = UInt;
+  } else if constexpr (std::is_signed_v<T>) {
+    arg = static_cast<uint64_t>(static_cast<int64_t>(value));
+    type = Int;
+  } else {
+    arg = static_cast<uint64_t>(value);
+    type = UInt;
+  }
+  record.nArgs++;
+}
+
+template <typename... Args>
+void AsyncLog::Write(LogSite &site, Args... args)
+{
+  static_assert(sizeof...(Args) <= kLogMaxArgs, "Too many log arguments");
+  auto now = NowNs();
+  if (!Allow(site, now)) {
+    return;
+  }
+  LogRecord record;
+  record.timeNs = now;
+  record.site = &site;
+  record.nArgs = 0;
+  record.dump = 0;
+  (Pack(record, args), ...);
+  Push(record);
+}
+
+#define ASYNC_LOG(format, ...)                                  \
+  do {                                                          \
+    static LogSite asyncLogSite(format);                        \
+    AsyncLog::Get().Write(asyncLogSite, ##__VA_ARGS__);         \
+  } while (0)
+
+#define ASYNC_DUMP(format, data, size)                          \
+  do {                                                          \
+    static LogSite asyncLogSite(format);                        \
+    AsyncLog::Get().Dump(asyncLogSite, data, size);             \
+  } while (0)
+
+#endif  // ASYNCLOG_HPP
@@ -0,0 +1,12 @@
+#ifndef CHANNELRANGE_HPP
+#define CHANNELRANGE_HPP 1
+
+#include <cstdint>
+#include <string>
+
+// Channels of the config, filter and calibration files: "0..3" or "5".
+// False when the token is not a channel or an increasing range.
+bool ParseChannelRange(const std::string &token, uint32_t &first,
+                       uint32_t &last);
+
+#endif  // CHANNELRANGE_HPP
@@ -0,0 +1,108 @@
+#ifndef EVENTRING_HPP
+#define EVENTRING_HPP 1
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+#include "PSD2Data.hpp"
+
+// POSIX shared memory ring of decoded batches.
+// One writer (the acquisition), any number of readers with their own cursor.
+// The writer never waits for readers, the oldest slot is overwritten.
+//
+// Layout (version 1), all integers little endian:
+//   offset 0                 EventRingHeader (kEventRingHeaderSize bytes)
+//   offset kEventRingHeaderSize + i * slotSize
+//                            EventRingSlot + payload, i = seq % nSlots
+//
+// A slot is a seqlock.  slot.seq is 2 * seq + 1 while the writer fills batch
+// number seq and 2 * seq + 2 when done.  A reader copies (or uses) the
+// payload and checks slot.seq again, a changed value means it was lapped.
+// The payload is a sequence of PSD2Codec records (see PSD2Codec.hpp).
+constexpr uint64_t kEventRingMagic = 0x474E495232445350;  // "PSD2RING"
+constexpr uint32_t kEventRingVersion = 1;
+constexpr uint64_t kEventRingHeaderSize = 4096;
+
+struct EventRingHeader {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t codecVersion;
+  uint64_t headerSize;
+  uint64_t nSlots;
+  uint64_t slotSize;  // Including EventRingSlot
+  std::atomic<uint64_t> writeSeq;  // Number of published batches
+  std::atomic<uint64_t> droppedEvents;  // Events larger than a slot
+};
+
+struct EventRingSlot {
+  std::atomic<uint64_t> seq;
+  uint64_t payloadSize;
+  uint32_t nEvents;
+  uint32_t reserved;
+  uint64_t publishTimeNs;  // CLOCK_REALTIME
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free,
+              "EventRing needs lock free 64 bit atomics");
+
+class EventRingWriter
+{
+ public:
+  EventRingWriter(std::string name, uint64_t nSlots, uint64_t slotSize);
+  ~EventRingWriter();
+
+  bool IsOpen() { return fHeader != nullptr; }
+
+  // Thread safe, a large batch uses several slots
+  void Publish(const PSD2DataVec_t &events);
+
+ private:
+  std::string fName;
+  void *fMemory = nullptr;
+  size_t fMemorySize = 0;
+  EventRingHeader *fHeader = nullptr;
+  std::mutex fWriteMutex;
+
+  EventRingSlot *GetSlot(uint64_t seq);
+  void Commit(EventRingSlot *slot, uint64_t seq, uint64_t size,
+              uint32_t nEvents);
+};
+
+class EventRingReader
+{
+ public:
+  // fromOldest = false starts at the next published batch
+  EventRingReader(std::string name, bool fromOldest = false);
+  ~EventRingReader();
+
+  bool IsOpen() { return fHeader != nullptr; }
+
+  // Zero copy access.  Returns false when no new batch.  The pointer is in
+  // the shared memory, call IsValid() after using it.
+  bool Next(const uint8_t *&payload, uint64_t &size, uint32_t &nEvents);
+  // True if the last batch from Next() was not overwritten meanwhile
+  bool IsValid();
+
+  // Decode the next batch, false when no new batch
+  bool Read(PSD2DataVec_t &events);
+
+  // Number of batches overwritten before this reader got them
+  uint64_t GetLostBatches() { return fLostBatches; }
+  uint64_t GetDroppedEvents();
+
+ private:
+  void *fMemory = nullptr;
+  size_t fMemorySize = 0;
+  const EventRingHeader *fHeader = nullptr;
+  uint64_t fCursor = 0;
+  uint64_t fLostBatches = 0;
+
+  const EventRingSlot *fCurrentSlot = nullptr;
+  uint64_t fCurrentSeqValue = 0;
+
+  const EventRingSlot *GetSlot(uint64_t seq);
+};
+
+#endif  // EVENTRING_HPP
@@ -0,0 +1,145 @@
+#ifndef EVENTSERVER_HPP
+#define EVENTSERVER_HPP 1
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "PSD2Data.hpp"
+#include "RawData.hpp"
+
+// TCP framing.  Every frame is an EventFrameHeader followed by payloadSize
+// bytes.  Events payload is a sequence of PSD2Codec records, raw payload is
+// the aggregate as 64 bit little endian words.  With kEventFrameLZ4 the
+// payload is LZ4 block compressed, rawSize is the size after decompression.
+// seq increases by one for every frame, a client sees a gap when frames were
+// dropped for it.
+constexpr uint32_t kEventFrameMagic = 0x56453244;  // "D2EV"
+constexpr uint64_t kEventFrameMaxPayload = 256 * 1024 * 1024;
+constexpr uint16_t kEventFrameVersion = 2;  // 2: PSD2Codec version 3
+constexpr uint32_t kEventFrameLZ4 = 0x1;
+
+enum class EventFrameType : uint16_t {
+  Events = 1,
+  Raw = 2,
+};
+
+#pragma pack(push, 1)
+struct EventFrameHeader {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t type;
+  uint32_t flags;
+  uint32_t nEvents;
+  uint64_t seq;
+  uint64_t payloadSize;
+  uint64_t rawSize;
+};
+#pragma pack(pop)
+static_assert(sizeof(EventFrameHeader) == 40, "EventFrameHeader layout");
+
+struct EventClientStats {
+  std::string address;
+  uint64_t sentFrames;
+  uint64_t sentBytes;
+  uint64_t droppedFrames;
+  uint64_t droppedEvents;
+  uint64_t queuedBytes;
+};
+
+class EventServer
+{
+ public:
+  // maxQueueBytes is the send queue limit for each client
+  EventServer(uint16_t port, size_t maxQueueBytes, bool compress = false);
+  ~EventServer();
+
+  bool Start();
+  void Stop();
+
+  // Thread safe, called by the decode or read threads
+  void PublishEvents(const PSD2DataVec_t &events);
+  void PublishRaw(const RawData_t &rawData);
+
+  std::vector<EventClientStats> GetClientStats();
+
+ private:
+  typedef std::shared_ptr<const std::vector<uint8_t>> Frame_t;
+
+  struct Client {
+    int socket = -1;
+    std::string address;
+    std::deque<Frame_t> queue;
+    size_t queuedBytes = 0;
+    bool closed = false;
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::thread thread;
+    std::atomic<uint64_t> sentFrames = 0;
+    std::atomic<uint64_t> sentBytes = 0;
+    std::atomic<uint64_t> droppedFrames = 0;
+    std::atomic<uint64_t> droppedEvents = 0;
+  };
+
+  uint16_t fPort;
+  size_t fMaxQueueBytes;
+  bool fCompress;
+  int fListenSocket = -1;
+  std::atomic<bool> fServerFlag = false;
+  uint64_t fFrameSeq = 0;  // fClientsMutex
+
+  std::thread fAcceptThread;
+  void AcceptThread();
+
+  std::vector<std::shared_ptr<Client>> fClients;
+  std::mutex fClientsMutex;
+  void SendThread(std::shared_ptr<Client> client);
+  void CloseClient(Client &client);
+
+  // The seq is set by Broadcast, in the order the frames are queued
+  std::shared_ptr<std::vector<uint8_t>> MakeFrame(EventFrameType type,
+                                                  uint32_t nEvents,
+                                                  const uint8_t *payload,
+                                                  size_t size);
+  void Broadcast(std::shared_ptr<std::vector<uint8_t>> frame,
+                 uint32_t nEvents);
+};
+
+// Receiving side, used by the event builder and for loopback tests
+class EventClient
+{
+ public:
+  EventClient() {};
+  ~EventClient();
+
+  bool Connect(std::string host, uint16_t port);
+  void Close();
+
+  // Blocking.  payload is decompressed.  False on disconnect or bad frame.
+  bool Receive(EventFrameHeader &header, std::vector<uint8_t> &payload);
+
+  // Receive one Events frame and decode it
+  bool ReceiveEvents(PSD2DataVec_t &events);
+
+  uint64_t GetLostFrames() { return fLostFrames; }
+  // Frames with a seq older than the previous one
+  uint64_t GetReorderedFrames() { return fReorderedFrames; }
+
+ private:
+  int fSocket = -1;
+  uint64_t fNextSeq = 0;
+  bool fFirstFrame = true;
+  uint64_t fLostFrames = 0;
+  uint64_t fReorderedFrames = 0;
+  std::vector<uint8_t> fBuffer;
+
+  bool ReadAll(void *buf, size_t size);
+};
+
+#endif  // EVENTSERVER_HPP
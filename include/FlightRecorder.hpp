@@ -0,0 +1,73 @@
+#ifndef FLIGHTRECORDER_HPP
+#define FLIGHTRECORDER_HPP 1
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "RawData.hpp"
+
+// Keeps the last maxBytes / maxSeconds of raw aggregates in memory and
+// writes them to a file when an anomaly is reported or on request.
+//
+// Recording is one memcpy into a preallocated ring.  A dump swaps the ring
+// with a spare one under the lock and the file is written by the dump
+// thread, so the readout is not blocked by the disk.
+//
+// File: "D2FR" magic (uint32), version (uint32), number of records
+// (uint64), then records of time [ns] (uint64), size [bytes] (uint64) and
+// the aggregate (byte swapped, little endian words).
+class FlightRecorder
+{
+ public:
+  FlightRecorder(size_t maxBytes, double maxSeconds, std::string directory);
+  ~FlightRecorder();
+
+  // Called by the read threads
+  void Record(const RawData_t &rawData);
+
+  // Ask for a dump.  Automatic triggers are limited to one per
+  // minInterval seconds, operator requests are always done.
+  void Trigger(std::string reason, bool automatic = true);
+
+  uint64_t GetNDumps() { return fNDumps; }
+
+ private:
+  struct Record_t {
+    size_t offset;
+    size_t size;
+    uint64_t timeNs;
+  };
+  struct Ring_t {
+    std::vector<uint8_t> buffer;
+    std::deque<Record_t> records;
+    size_t head = 0;
+  };
+
+  size_t fMaxBytes;
+  uint64_t fMaxTimeNs;
+  std::string fDirectory;
+
+  std::mutex fRingMutex;
+  Ring_t fRing;
+  Ring_t fSpare;
+
+  std::chrono::steady_clock::time_point fLastAutoDump;
+  std::string fDumpReason = "";
+  bool fDumpRequest = false;
+  bool fDumpFlag = true;
+  std::mutex fDumpMutex;
+  std::condition_variable fDumpCondition;
+  std::thread fDumpThread;
+  std::atomic<uint64_t> fNDumps = 0;
+  void DumpThread();
+  void WriteRing(const Ring_t &ring, std::string reason);
+};
+
+#endif  // FLIGHTRECORDER_HPP
@@ -0,0 +1,48 @@
+#ifndef LATENCYHISTOGRAM_HPP
+#define LATENCYHISTOGRAM_HPP 1
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+struct LatencyStats_t {
+  uint64_t count = 0;
+  uint64_t p50Ns = 0;  // Upper edge of the bin, up to 12.5 % over
+  uint64_t p90Ns = 0;
+  uint64_t p99Ns = 0;
+  uint64_t p999Ns = 0;
+  uint64_t maxNs = 0;
+};
+
+// Log-linear histogram of latencies in ns: 16 bins of 1 ns, then 8 bins
+// per power of 2.  Filled by many threads without lock, a thread counts
+// its batch in Counts_t first and adds it at once.
+class LatencyHistogram
+{
+ public:
+  static constexpr uint32_t kNBins = 16 + 60 * 8;
+  typedef std::array<uint64_t, kNBins> Counts_t;
+
+  static uint32_t Bin(uint64_t ns)
+  {
+    if (ns < 16) {
+      return ns;
+    }
+    uint32_t exponent = 63 - __builtin_clzll(ns);  // >= 4
+    uint32_t sub = (ns >> (exponent - 3)) & 0x7;
+    return 16 + (exponent - 4) * 8 + sub;
+  }
+  static uint64_t UpperEdge(uint32_t bin);
+
+  // Adds and clears counts, max is the largest latency of the batch
+  void Add(Counts_t &counts, uint64_t max);
+
+  // Since the last reset
+  LatencyStats_t GetStats(bool reset = false);
+
+ private:
+  std::array<std::atomic<uint64_t>, kNBins> fCounts{};
+  std::atomic<uint64_t> fMax = 0;
+};
+
+#endif  // LATENCYHISTOGRAM_HPP
@@ -0,0 +1,183 @@
+#ifndef LISTMODE_HPP
+#define LISTMODE_HPP 1
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "PSD2Data.hpp"
+
+// List mode file, events without waveforms.  Little endian.
+//
+//   ListModeFileHeader      64 bytes
+//   block 0                 nRecords * ListModeRecord
+//   block 1 ...
+//   ListModeBlockIndex[nBlocks]
+//   ListModeFileFooter      32 bytes
+//
+// Events are in decode order, not sorted by time.  The index keeps the
+// min and max time stamp of each block, the reader uses them to find the
+// blocks of a time range.  A file without footer (crash) is not readable.
+constexpr uint32_t kListModeMagic = 0x4D4C3244;        // "D2LM"
+constexpr uint32_t kListModeFooterMagic = 0x454C3244;  // "D2LE"
+constexpr uint32_t kListModeVersion = 1;
+
+#pragma pack(push, 1)
+struct ListModeRecord {
+  uint64_t timeStamp;  // [ns], without fine time
+  uint32_t aggregateCounter;
+  uint16_t fineTimeStamp;  // 1/1024 of timeStep
+  uint16_t energy;
+  uint16_t energyShort;
+  uint16_t flagsLowPriority;
+  uint8_t flagsHighPriority;
+  uint8_t channel;
+  uint8_t boardFail;
+  uint8_t reserved;
+};
+
+struct ListModeFileHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t recordSize;
+  uint32_t blockRecords;
+  double timeStep;  // [ns]
+  uint64_t startTime;  // Unix time [ns] of the file creation
+  uint8_t reserved[32];
+};
+
+struct ListModeBlockIndex {
+  uint64_t offset;
+  uint64_t nRecords;
+  uint64_t minTimeStamp;
+  uint64_t maxTimeStamp;
+};
+
+struct ListModeFileFooter {
+  uint64_t indexOffset;
+  uint64_t nBlocks;
+  uint64_t nRecords;
+  uint32_t magic;
+  uint32_t version;
+};
+#pragma pack(pop)
+static_assert(sizeof(ListModeRecord) == 24, "ListModeRecord layout");
+static_assert(sizeof(ListModeFileHeader) == 64, "ListModeFileHeader layout");
+static_assert(sizeof(ListModeFileFooter) == 32, "ListModeFileFooter layout");
+
+// Called by the decode threads.  Write() packs the events into the current
+// block, full blocks are written by the writer thread.
+class ListModeWriter
+{
+ public:
+  ListModeWriter(std::string fileName, double timeStep,
+                 uint32_t blockRecords = 65536);
+  ~ListModeWriter();
+
+  bool IsOpen() { return fFile.is_open(); }
+
+  void Write(const PSD2DataVec_t &events);
+
+  // Write the last block, the index and the footer
+  void Close();
+
+  uint64_t GetNRecords() { return fNRecords; }
+
+ private:
+  struct Block_t {
+    std::vector<ListModeRecord> records;
+    uint64_t minTimeStamp = UINT64_MAX;
+    uint64_t maxTimeStamp = 0;
+  };
+
+  std::string fFileName;
+  uint32_t fBlockRecords;
+  std::ofstream fFile;
+
+  std::mutex fBlockMutex;
+  Block_t fBlock;
+  uint64_t fNRecords = 0;
+
+  std::mutex fQueueMutex;
+  std::condition_variable fQueueCondition;
+  std::deque<Block_t> fQueue;
+  std::vector<std::vector<ListModeRecord>> fBufferPool;
+  bool fWriteFlag = true;
+  std::thread fWriteThread;
+  void WriteThread();
+  void PushBlock();
+
+  // Used by the writer thread only
+  std::vector<ListModeBlockIndex> fIndex;
+  uint64_t fOffset = 0;
+};
+
+// Read only memory mapping of a list mode file
+class ListModeReader
+{
+ public:
+  ListModeReader(std::string fileName);
+  ~ListModeReader();
+
+  bool IsOpen() { return fMemory != nullptr; }
+
+  double GetTimeStep() { return fHeader->timeStep; }
+  uint64_t GetNRecords() { return fFooter->nRecords; }
+  uint64_t GetNBlocks() { return fFooter->nBlocks; }
+  const ListModeBlockIndex &GetBlockIndex(uint64_t i) { return fIndex[i]; }
+  const ListModeRecord *GetBlock(uint64_t i)
+  {
+    return reinterpret_cast<const ListModeRecord *>(fMemory +
+                                                    fIndex[i].offset);
+  }
+
+  // Blocks [first, last) which can have events in [start, end] [ns].
+  // Binary search on the running max / min of the block time stamps.
+  void FindBlocks(uint64_t start, uint64_t end, uint64_t &first,
+                  uint64_t &last);
+
+  // Calls func(record) for every event in [start, end].  Blocks are
+  // scanned in parallel, func must be thread safe.
+  template <typename F>
+  void ForEach(uint64_t start, uint64_t end, F func)
+  {
+    uint64_t first, last;
+    FindBlocks(start, end, first, last);
+#pragma omp parallel for schedule(dynamic)
+    for (uint64_t i = first; i < last; i++) {
+      auto records = GetBlock(i);
+      auto n = fIndex[i].nRecords;
+      for (uint64_t j = 0; j < n; j++) {
+        auto &record = records[j];
+        if (record.timeStamp >= start && record.timeStamp <= end) {
+          func(record);
+        }
+      }
+    }
+  }
+
+  // Energy histogram of one channel in [start, end], 65536 bins
+  std::vector<uint64_t> EnergySpectrum(uint8_t channel, uint64_t start = 0,
+                                       uint64_t end = UINT64_MAX,
+                                       bool shortGate = false);
+
+ private:
+  const uint8_t *fMemory = nullptr;
+  size_t fMemorySize = 0;
+  const ListModeFileHeader *fHeader = nullptr;
+  const ListModeFileFooter *fFooter = nullptr;
+  const ListModeBlockIndex *fIndex = nullptr;
+
+  // fMaxUntil[i] = max of maxTimeStamp of blocks 0..i
+  // fMinFrom[i] = min of minTimeStamp of blocks i..n-1
+  std::vector<uint64_t> fMaxUntil;
+  std::vector<uint64_t> fMinFrom;
+};
+
+#endif  // LISTMODE_HPP
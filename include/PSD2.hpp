@@ -1,7 +1,11 @@
 #ifndef PSD2_HPP
 #define PSD2_HPP 1
 
+#include <array>
+#include <atomic>
+#include <condition_variable>
 #include <deque>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <nlohmann/json.hpp>
@@ -9,9 +13,22 @@
 #include <thread>
 #include <vector>
 
+#include "EventRing.hpp"
+#include "EventServer.hpp"
+#include "FlightRecorder.hpp"
+#include "ListMode.hpp"
+#include "PSD2Arrow.hpp"
 #include "PSD2Data.hpp"
+#include "PSD2Filter.hpp"
 #include "RawData.hpp"
 #include "RawToPSD2.hpp"
+#include "WaveformMonitor.hpp"
+
+enum class RunState {
+  Idle,
+  Running,
+  Draining,
+};
 
 class PSD2
 {
@@ -21,18 +38,69 @@ class PSD2
 
   bool Initialize();
   bool Configure();
+  // Send only the parameters that differ from the cached parameter tree
+  bool Reconfigure();
   bool StartAcquisition();
   bool StopAcquisition();
 
   bool SendSWTrigger();
 
+  // Write the flight recorder content now
+  void DumpFlightRecorder();
+
+  // Read CalibrationFile again, applied without stopping the run
+  bool ReloadCalibration();
+
+  // Latest waveform per channel for the online display, nullptr when
+  // DisplayChannels is not set.  Kept over reconfiguration.
+  std::shared_ptr<WaveformMonitor> GetWaveformMonitor()
+  {
+    return std::atomic_load(&fWaveformMonitor);
+  }
+
+  // Occupancy and counters of the overflow file, zero when not used
+  SpillStats_t GetSpillStats();
+  // Active decode workers, queue depth and latency of the last period
+  RawToPSD2::ScaleStats_t GetDecodeStats();
+  // Read to consumer latency since the last reset, LatencyReport or
+  // LowLatency in the config
+  LatencyStats_t GetLatencyStats(bool reset = false);
+
   bool CheckStatus();
 
   void LoadConfig(std::string path);
 
   uint64_t GetHandle() { return fHandle; }
+  RunState GetRunState();
 
+  // Events in time order within a batch.  With DecodeThreads > 1 a later
+  // batch can start before the end of the previous one.
   std::unique_ptr<std::vector<std::unique_ptr<PSD2Data_t>>> GetData();
+  std::unique_ptr<PSD2DataVec_t> WaitForData(std::chrono::milliseconds timeout,
+                                             size_t minEvents = 1);
+  // Give the container back for reuse
+  void ReturnData(std::unique_ptr<PSD2DataVec_t> data);
+
+  // Channel subscription, e.g. one analysis thread per detector group.  The
+  // events are grouped by channel.  Once a mask is used, the events of the
+  // channels in no mask are discarded and counted at the stop.
+  std::unique_ptr<PSD2DataVec_t> GetData(const ChannelMask_t &channels);
+  std::unique_ptr<PSD2DataVec_t> WaitForData(std::chrono::milliseconds timeout,
+                                             size_t minEvents,
+                                             const ChannelMask_t &channels);
+
+  // WaitForData exported by the Arrow C Data Interface, e.g. for
+  // pyarrow.RecordBatch._import_from_c.  The caller owns schema and array
+  // and calls their release.  False when nothing came in timeout.
+  bool WaitForArrowBatch(ArrowSchema *schema, ArrowArray *array,
+                         std::chrono::milliseconds timeout,
+                         size_t minEvents = 1, bool withWaveform = true);
+
+  // Push style consumer.  The callback is called from a dispatcher thread
+  // with the ready batch.  It may take the ownership, otherwise the container
+  // is reused after the callback returns.  Set it before StartAcquisition.
+  typedef std::function<void(std::unique_ptr<PSD2DataVec_t> &)> DataCallback_t;
+  void SetDataCallback(DataCallback_t callback, size_t minEvents = 1);
 
  private:
   uint64_t fHandle;
@@ -41,7 +109,30 @@ class PSD2
   std::string fURL = "";
   bool fDebugFlag = false;
   uint32_t fNThreads = 1;
+  uint32_t fNOMPThreads = 1;
+  uint32_t fNDecodeThreads = 0;  // 0: same as fNThreads
+  uint32_t fMinDecodeThreads = 0;  // 0: no autoscaling
+  uint32_t fDecodeLatencyUs = 1000;
+  bool fSafeDecodeFlag = false;
+  std::string fQuarantineFile = "";
+  void PrintDecodeErrors();
+
+  // Low latency mode: short read timeout, events published in small
+  // batches while an aggregate is decoded
+  bool fLowLatencyFlag = false;
+  size_t fLowLatencyEvents = 16;
+  int fLowLatencyReadTimeoutMs = 1;
+  bool fLatencyReportFlag = false;
+  std::atomic<int> fReadTimeOut = 10;  // ms, set at every start
+  std::atomic<uint32_t> fReadIdleSleepUs = 1000;
+  void PrintFilterStats();
+
+  std::string fSpillFile = "";
+  size_t fSpillFileSize = size_t(4) * 1024 * 1024 * 1024;
+  size_t fSpillQueueSize = 512 * 1024 * 1024;
+  size_t fSpillOutputEvents = 1000000;
   std::vector<std::array<std::string, 2>> fConfig;
+  std::vector<std::array<std::string, 2>> fAppliedConfig;
 
   bool CheckError(int err);
   bool SendCommand(std::string path);
@@ -49,22 +140,98 @@ class PSD2
   bool SetParameter(std::string path, std::string value);
   nlohmann::json GetReadDataFormatRAW();
 
+  // Local copy of the parameter tree (lower case path -> value)
+  std::map<std::string, std::string> fParameterCache;
+  bool ReadParameterTree();
+  void FillParameterCache(const nlohmann::json &node, std::string path);
+  std::vector<std::string> ExpandPath(std::string path);
+  bool IsSameValue(std::string a, std::string b);
+  bool ReadDataSize();
+
   bool Open(std::string URL);
   bool Close();
 
   std::mutex fDataMutex;
-  bool fDataTakingFlag;
+  std::atomic<bool> fDataTakingFlag = false;
   void ReadDataThread();
   int ReadDataWithLock(std::unique_ptr<RawData_t> &dummy, int timeOut);
   std::vector<std::thread> fReadDataThreads;
   std::mutex fReadDataMutex;
 
+  // Run control.  The read and decode threads live until the destructor or
+  // a rebuild of the pipeline, and are parked while Idle.
+  RunState fRunState = RunState::Idle;
+  bool fPipelineFlag = false;
+  bool fStopSeen = false;
+  bool fArmed = false;
+  uint32_t fNParkedThreads = 0;
+  std::mutex fRunStateMutex;
+  std::condition_variable fRunStateCondition;
+  void BuildPipeline();
+  void ShutdownPipeline();
+  // Config read again at every start, after a LoadConfig: filter, waveform
+  // windows, decode options and the low latency mode
+  void ApplyRunSettings();
+  // Thread counts and outputs the pipeline is built with.  The pipeline is
+  // rebuilt at the next start when one of them is changed.
+  std::map<std::string, std::string> fPipelineConfig;
+  std::map<std::string, std::string> GetPipelineConfig();
+
+  DataCallback_t fDataCallback = nullptr;
+  size_t fCallbackMinEvents = 1;
+  std::atomic<size_t> fCallbackBatchEvents = 1;  // Set at every start
+  std::thread fCallbackThread;
+  void CallbackThread();
+
+  // Shared memory output, enabled by EventRing in the config
+  std::string fEventRingName = "";
+  uint64_t fEventRingSlots = 256;
+  uint64_t fEventRingSlotSize = 1024 * 1024;
+  std::unique_ptr<EventRingWriter> fEventRing;
+
+  // One file per run, ListModeFile with the run number
+  std::string fListModeFile = "";
+  uint32_t fListModeBlockRecords = 65536;
+  uint32_t fListModeRun = 0;
+  std::shared_ptr<ListModeWriter> fListModeWriter;
+  void OpenListModeFile();
+  void CloseListModeFile();
+
+  // TCP output, enabled by ServerPort in the config
+  uint16_t fServerPort = 0;
+  bool fServerRawFlag = false;
+  bool fServerCompress = false;
+  size_t fServerQueueSize = 64 * 1024 * 1024;
+  std::unique_ptr<EventServer> fEventServer;
+
+  // Raw data history, enabled by FlightRecorderMB in the config
+  size_t fFlightRecorderSize = 0;
+  double fFlightRecorderSeconds = 0.;
+  std::string fFlightRecorderDir = ".";
+  std::vector<DecodeError> fFlightRecorderTriggers;
+  std::unique_ptr<FlightRecorder> fFlightRecorder;
+
+  std::string fCalibrationFile = "";
+
+  // Filter rules in the config order, see PSD2Filter.  Rebuilt at every
+  // start.
+  std::vector<std::string> fFilterRules;
+  std::shared_ptr<PSD2Filter> fFilter;
+
+  // Decode-time waveform trimming, WaveformWindow/WaveformDecimation.
+  // Applied at every start.
+  WaveformWindows_t fWaveformWindows;
+
+  // Read with atomic_load by the decode threads and the display
+  std::shared_ptr<WaveformMonitor> fWaveformMonitor;
+
   // RawToPSD2 converter
   std::unique_ptr<RawToPSD2> fRawToPSD2;
 
   // Configure and read data structure
   uint64_t fReadDataHandle;
   uint64_t fRecordLength;
+  uint32_t fTimeStep = 1;  // ns per time stamp unit
   bool EndpointConfigure();
 };
 
@@ -0,0 +1,73 @@
+#ifndef PSD2ARROW_HPP
+#define PSD2ARROW_HPP 1
+
+#include <cstdint>
+
+#include "PSD2Data.hpp"
+
+// Apache Arrow C Data Interface, copied from the specification.
+// https://arrow.apache.org/docs/format/CDataInterface.html
+#ifndef ARROW_C_DATA_INTERFACE
+#define ARROW_C_DATA_INTERFACE
+
+#define ARROW_FLAG_DICTIONARY_ORDERED 1
+#define ARROW_FLAG_NULLABLE 2
+#define ARROW_FLAG_MAP_KEYS_SORTED 4
+
+struct ArrowSchema {
+  // Array type description
+  const char *format;
+  const char *name;
+  const char *metadata;
+  int64_t flags;
+  int64_t n_children;
+  struct ArrowSchema **children;
+  struct ArrowSchema *dictionary;
+
+  // Release callback
+  void (*release)(struct ArrowSchema *);
+  // Opaque producer-specific data
+  void *private_data;
+};
+
+struct ArrowArray {
+  // Array data description
+  int64_t length;
+  int64_t null_count;
+  int64_t offset;
+  int64_t n_buffers;
+  int64_t n_children;
+  const void **buffers;
+  struct ArrowArray **children;
+  struct ArrowArray *dictionary;
+
+  // Release callback
+  void (*release)(struct ArrowArray *);
+  // Opaque producer-specific data
+  void *private_data;
+};
+
+#endif  // ARROW_C_DATA_INTERFACE
+
+// Export of decoded batches as an Arrow struct array (one record batch).
+// Columns: timeStamp (uint64), timeStampNs (double), channel (uint8),
+// energy, energyShort, fineTimeStamp, flagsLowPriority, flagsHighPriority,
+// triggerThr (uint16), aggregateCounter (uint32), timeResolution,
+// downSampleFactor (uint8), waveformStart (uint16), boardFail (bool),
+// calibratedEnergy (double), psdRatio (float), correctedTimeNs (double)
+// and with waveforms analogProbe1/2 (list<int32>), digitalProbe1..4
+// (list<uint8>).
+//
+// The events are gathered once into column buffers owned by the exported
+// ArrowArray.  The consumer (e.g. pyarrow RecordBatch._import_from_c) uses
+// them without a copy and frees them by calling release.  Every child has
+// its own release callback as the specification requires.
+class PSD2Arrow
+{
+ public:
+  static void ExportSchema(ArrowSchema *schema, bool withWaveform = true);
+  static void ExportBatch(const PSD2DataVec_t &events, ArrowArray *array,
+                          bool withWaveform = true);
+};
+
+#endif  // PSD2ARROW_HPP
@@ -0,0 +1,43 @@
+#ifndef PSD2CALIBRATION_HPP
+#define PSD2CALIBRATION_HPP 1
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "PSD2Data.hpp"
+
+// Per channel calibration applied to whole decoded batches.
+//   calibratedEnergy = c0 + c1 * energy + c2 * energy^2
+//   psdRatio = (energy - energyShort) / energy
+//   correctedTimeNs = timeStampNs + timeOffsetNs
+//
+// File format, one line per channel or channel range:
+//   # ch    c0   c1   c2   timeOffsetNs
+//   0..15   0.0  1.0  0.0  0.0
+//   16      1.5  0.98 0.0  -2.5
+class PSD2Calibration
+{
+ public:
+  static constexpr uint32_t kNChannels = 128;
+
+  PSD2Calibration();
+  ~PSD2Calibration() {};
+
+  // False for a missing file or an invalid line, load into a new object to
+  // keep the current calibration
+  bool Load(std::string path);
+
+  // The tables are read only after Load, Apply can be called by many threads
+  void Apply(PSD2DataVec_t &events) const;
+
+ private:
+  // Structure of arrays for the vectorized loops
+  alignas(64) std::array<double, kNChannels> fC0;
+  alignas(64) std::array<double, kNChannels> fC1;
+  alignas(64) std::array<double, kNChannels> fC2;
+  alignas(64) std::array<double, kNChannels> fTimeOffset;
+};
+
+#endif  // PSD2CALIBRATION_HPP
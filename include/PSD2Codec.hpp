@@ -0,0 +1,70 @@
+#ifndef PSD2CODEC_HPP
+#define PSD2CODEC_HPP 1
+
+#include <cstddef>
+#include <cstdint>
+
+#include "PSD2Data.hpp"
+
+// Binary layout of one event, shared by the event ring and the streaming
+// server (the spill file keeps the raw aggregates).  Little endian, no
+// padding between records.  The calibration columns are 0 without a
+// CalibrationFile.
+//
+//   PSD2EventRecord                 72 bytes
+//   int32_t analogProbe1[n]
+//   int32_t analogProbe2[n]
+//   uint8_t digitalProbe1..4[n]     4 * n bytes
+//   padding to 8 bytes
+//
+// n = waveformSize.  Bump kPSD2CodecVersion when this changes.
+constexpr uint32_t kPSD2CodecVersion = 3;
+
+#pragma pack(push, 1)
+struct PSD2EventRecord {
+  uint64_t timeStamp;
+  double timeStampNs;
+  uint32_t waveformSize;
+  uint32_t aggregateCounter;
+  uint16_t fineTimeStamp;
+  uint16_t energy;
+  uint16_t energyShort;
+  uint16_t flagsLowPriority;
+  uint16_t flagsHighPriority;
+  uint16_t triggerThr;
+  uint8_t channel;
+  uint8_t timeResolution;
+  uint8_t analogProbe1Type;
+  uint8_t analogProbe2Type;
+  uint8_t digitalProbe1Type;
+  uint8_t digitalProbe2Type;
+  uint8_t digitalProbe3Type;
+  uint8_t digitalProbe4Type;
+  uint8_t downSampleFactor;
+  uint8_t boardFail;
+  uint16_t waveformStart;
+  double calibratedEnergy;
+  double correctedTimeNs;
+  float psdRatio;
+  uint32_t reserved;
+};
+#pragma pack(pop)
+static_assert(sizeof(PSD2EventRecord) == 72, "PSD2EventRecord layout");
+
+class PSD2Codec
+{
+ public:
+  // Bytes needed to encode the event
+  static size_t EncodedSize(const PSD2Data_t &data);
+
+  // Write the event to dst, dst must have EncodedSize bytes
+  static size_t Encode(const PSD2Data_t &data, uint8_t *dst);
+
+  // Read one event.  Returns the consumed bytes, 0 for broken data.
+  static size_t Decode(const uint8_t *src, size_t size, PSD2Data_t &data);
+
+  // Decode all events in the buffer and append them
+  static bool DecodeAll(const uint8_t *src, size_t size, PSD2DataVec_t &events);
+};
+
+#endif  // PSD2CODEC_HPP
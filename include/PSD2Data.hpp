@@ -2,6 +2,7 @@
 #define PSD2DATA_HPP 1
 
 #include <cstdint>
+#include <memory>
 #include <vector>
 
 class PSD2Data
@@ -13,6 +14,7 @@ class PSD2Data
         waveformSize(0),
         eventSize(0),
         aggregateCounter(0),
+        waveformStart(0),
         fineTimeStamp(0),
         energy(0),
         energyShort(0),
@@ -29,7 +31,11 @@ class PSD2Data
         digitalProbe4Type(0),
         downSampleFactor(0),
         boardFail(false),
-        flush(false)
+        flush(false),
+        calibratedEnergy(0.),
+        psdRatio(0.f),
+        correctedTimeNs(0.),
+        readTimeNs(0)
   {
     if (size > 0) Resize(size);
   };
@@ -49,6 +55,7 @@ class PSD2Data
     digitalProbe3 = data.digitalProbe3;
     digitalProbe4 = data.digitalProbe4;
     aggregateCounter = data.aggregateCounter;
+    waveformStart = data.waveformStart;
     fineTimeStamp = data.fineTimeStamp;
     energy = data.energy;
     energyShort = data.energyShort;
@@ -65,6 +72,10 @@ class PSD2Data
     digitalProbe4Type = data.digitalProbe4Type;
     boardFail = data.boardFail;
     flush = data.flush;
+    calibratedEnergy = data.calibratedEnergy;
+    psdRatio = data.psdRatio;
+    correctedTimeNs = data.correctedTimeNs;
+    readTimeNs = data.readTimeNs;
   };
 
   void Resize(size_t size)
@@ -89,6 +100,7 @@ class PSD2Data
   std::vector<uint8_t> digitalProbe3;
   std::vector<uint8_t> digitalProbe4;
   uint32_t aggregateCounter;
+  uint32_t waveformStart;  // First stored sample in the digitizer record
   uint16_t fineTimeStamp;
   uint16_t energy;
   uint16_t energyShort;
@@ -106,8 +118,17 @@ class PSD2Data
   uint8_t downSampleFactor;
   bool boardFail;
   bool flush;
+
+  // Filled by the calibration stage (PSD2Calibration)
+  double calibratedEnergy;
+  float psdRatio;
+  double correctedTimeNs;
+
+  // Steady clock of the raw data read, for the latency report
+  uint64_t readTimeNs;
 };
 
 typedef PSD2Data PSD2Data_t;
+typedef std::vector<std::unique_ptr<PSD2Data_t>> PSD2DataVec_t;
 
 #endif  // PSD2DATA_HPP
\ No newline at end of file
@@ -0,0 +1,98 @@
+#ifndef PSD2FILTER_HPP
+#define PSD2FILTER_HPP 1
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Fields of the two event words, one column per field.  Filled by
+// PSD2Policy from the raw words, before any event is allocated.
+struct PSD2FilterBatch_t {
+  std::vector<uint8_t> channel;
+  std::vector<uint16_t> energy;
+  std::vector<uint16_t> energyShort;
+  std::vector<uint16_t> flagsLowPriority;
+  std::vector<uint16_t> flagsHighPriority;
+  std::vector<uint8_t> accept;  // Output, 1 = keep
+
+  void Resize(size_t size)
+  {
+    channel.resize(size);
+    energy.resize(size);
+    energyShort.resize(size);
+    flagsLowPriority.resize(size);
+    flagsHighPriority.resize(size);
+    accept.resize(size);
+  }
+};
+
+struct PSD2FilterStats_t {
+  std::string rule;
+  uint64_t nAccepted = 0;
+  uint64_t nRejected = 0;
+};
+
+// Software event filter.  An event is kept when it passes all the rules,
+// the rules are tested in order and only with the events kept so far.
+//
+//   channel 0..15              Only these channels
+//   energy 100 4000 [0..7]     Energy in [min, max]
+//   energyShort 0 2000 [ch]    Short gate in [min, max]
+//   psd 0.1 0.4 [ch]           (energy - energyShort) / energy in [min, max]
+//   flagsLow none 0x0C [ch]    No flag of the mask is set
+//   flagsHigh all 0x01 [ch]    All flags of the mask are set
+//
+// A rule with channels is applied only to these channels, the events of
+// the others pass it.
+class PSD2Filter
+{
+ public:
+  static constexpr uint32_t kNChannels = 128;
+
+  // False for an invalid rule
+  bool AddRule(std::string rule);
+  size_t GetNRules() const { return fRules.size(); }
+
+  // The rules are read only after AddRule, Apply can be called by many
+  // threads.  Sets batch.accept.
+  void Apply(PSD2FilterBatch_t &batch) const;
+
+  std::vector<PSD2FilterStats_t> GetStats() const;
+
+ private:
+  enum class Field : uint8_t {
+    Channel,
+    Energy,
+    EnergyShort,
+    PSD,
+    FlagsLow,
+    FlagsHigh,
+  };
+  enum class Op : uint8_t {
+    Range,
+    NoneOf,
+    AllOf,
+  };
+  struct Rule_t {
+    std::string text;
+    Field field;
+    Op op;
+    float min = 0.f;
+    float max = 0.f;
+    uint16_t mask = 0;
+    // Channels the rule is applied to, the dropped ones for Field::Channel
+    alignas(64) std::array<uint8_t, kNChannels> channels;
+  };
+  struct Counter_t {
+    std::atomic<uint64_t> nAccepted{0};
+    std::atomic<uint64_t> nRejected{0};
+  };
+
+  std::vector<Rule_t> fRules;
+  std::vector<std::unique_ptr<Counter_t>> fCounters;
+};
+
+#endif  // PSD2FILTER_HPP
@@ -0,0 +1,77 @@
+#ifndef PSD2POLICY_HPP
+#define PSD2POLICY_HPP 1
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "PSD2Calibration.hpp"
+#include "PSD2Data.hpp"
+#include "PSD2Filter.hpp"
+#include "RawDecoder.hpp"
+
+// Part of the waveform kept by the decoder.  The window is pre samples
+// before and post samples from the reference: the first sample with the
+// digital probe set (probe 1-4), or the fixed sample trigger when probe is
+// 0 or the probe is never set.  Every decimation-th sample of the window
+// is kept, the others are not unpacked.  pre = post = 0 is the whole
+// record.
+struct WaveformWindow_t {
+  uint32_t pre = 0;
+  uint32_t post = 0;
+  uint32_t trigger = 0;
+  uint8_t probe = 0;
+  uint8_t decimation = 1;
+};
+typedef std::array<WaveformWindow_t, kNChannelShards> WaveformWindows_t;
+
+// DPP-PSD event layout for RawDecoder
+class PSD2Policy
+{
+ public:
+  typedef PSD2Data_t Data_t;
+
+  void SetTimeStep(uint32_t timeStep) { fTimeStep = timeStep; }
+  void SetDumpFlag(bool dumpFlag) { fDumpFlag = dumpFlag; }
+  // Double buffered, the table not in use is filled and swapped in.  The
+  // next event uses it.  Set between runs, a decoder may still read the
+  // previous table but not the one before.
+  void SetWaveformWindows(const WaveformWindows_t &windows);
+
+  // Can be replaced during the run, the next batch uses the new one
+  void SetCalibration(std::shared_ptr<const PSD2Calibration> calibration)
+  {
+    std::atomic_store(&fCalibration, calibration);
+  }
+  // nullptr keeps every event
+  void SetFilter(std::shared_ptr<const PSD2Filter> filter)
+  {
+    std::atomic_store(&fFilter, filter);
+  }
+
+  // Check the event at word i and give the word index of the next event.
+  // Reads only the headers and the waveform size.
+  bool ScanEvent(const uint8_t *dataStart, size_t i, size_t nWords,
+                 size_t &next, DecodeError &error) const;
+  // Remove the events rejected by the filter from the index.  Reads only
+  // the two event words.
+  void FilterEvents(const uint8_t *dataStart,
+                    std::vector<size_t> &eventIndex) const;
+  void DecodeEvent(const uint8_t *dataStart, size_t i, size_t nWords,
+                   PSD2Data_t &psd2Data) const;
+  void FinishBatch(PSD2DataVec_t &psd2DataVec) const;
+
+ private:
+  uint32_t fTimeStep = 1;
+  bool fDumpFlag = false;
+  std::array<WaveformWindows_t, 2> fWaveformTables{};
+  std::atomic<const WaveformWindows_t *> fWaveformWindows{&fWaveformTables[0]};
+  std::shared_ptr<const PSD2Calibration> fCalibration = nullptr;
+  std::shared_ptr<const PSD2Filter> fFilter = nullptr;
+};
+
+#endif  // PSD2POLICY_HPP
@@ -16,6 +16,9 @@ class RawData
   std::vector<uint8_t> data;
   size_t size;
   uint32_t nEvents;
+  uint64_t readTimeNs = 0;   // Steady clock when given to the decoder
+  uint64_t queueTimeNs = 0;  // Steady clock when queued for decoding
+  uint64_t readSeq = 0;      // Read order, 0 when not ordered
 
  private:
   void Resize(size_t size) { data.resize(size); };
@@ -0,0 +1,332 @@
+#ifndef RAWDECODER_HPP
+#define RAWDECODER_HPP 1
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bitset>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "LatencyHistogram.hpp"
+#include "RawData.hpp"
+#include "SpillBuffer.hpp"
+
+enum class DataType {
+  Start,
+  Stop,
+  Event,
+  Unknown,
+};
+
+// Decode error classes, counted instead of printed
+enum class DecodeError : uint32_t {
+  InvalidHeader,      // Aggregate header bit[60:63] != 0x2
+  BoardFail,          // Aggregate header bit 56
+  CounterGap,         // Aggregate counter is not continuous
+  SizeMismatch,       // Aggregate total size != read size
+  BadEventHeader,     // Event first word bit 63 != 0
+  BadWaveformHeader,  // Waveform header check failed
+  Truncated,          // Event goes over the end of the aggregate
+  BadBufferSize,      // Read size is not a multiple of 8 bytes or too small
+  SkippedWords,       // Words skipped to resynchronize
+  NumberOfErrors,
+};
+
+// Output is sharded by channel (7 bits in the event header)
+constexpr uint32_t kNChannelShards = 128;
+typedef std::bitset<kNChannelShards> ChannelMask_t;
+
+// Aggregate and framing layer of the FELib RAW endpoint: byte swap,
+// start/stop detection, aggregate header and counter checks, queues,
+// decode threads and the channel sharded output.
+//
+// The firmware specific part is the Policy, fixed at compile time so the
+// per event calls are not virtual.  A Policy has
+//
+//   typedef ... Data_t;  // Event with channel, timeStamp and readTimeNs
+//   void SetTimeStep(uint32_t timeStep);
+//   void SetDumpFlag(bool dumpFlag);
+//   // Check the event at word i and give the word index of the next event
+//   bool ScanEvent(const uint8_t *dataStart, size_t i, size_t nWords,
+//                  size_t &next, DecodeError &error) const;
+//   // Remove the events to skip from the index, before they are allocated
+//   void FilterEvents(const uint8_t *dataStart,
+//                     std::vector<size_t> &eventIndex) const;
+//   void DecodeEvent(const uint8_t *dataStart, size_t i, size_t nWords,
+//                    Data_t &data) const;
+//   // Called with every decoded batch before the observers
+//   void FinishBatch(std::vector<std::unique_ptr<Data_t>> &batch) const;
+//
+// The members are defined in RawDecoder.cpp, add the explicit
+// instantiation of a new policy there.
+template <typename Policy>
+class RawDecoder
+{
+ public:
+  typedef typename Policy::Data_t Data_t;
+  typedef std::vector<std::unique_ptr<Data_t>> DataVec_t;
+
+  RawDecoder(uint32_t nThreads = 1);
+  ~RawDecoder();
+
+  // Firmware specific settings
+  Policy &GetPolicy() { return fPolicy; }
+
+  void SetTimeStep(uint32_t timeStep) { fPolicy.SetTimeStep(timeStep); }
+  // OpenMP threads to decode one large aggregate, 1 is serial
+  void SetOMPThreads(uint32_t nThreads)
+  {
+    fNOMPThreads = std::max(1u, nThreads);
+  }
+
+  // Hardened mode resynchronizes at the next valid aggregate or event header
+  // instead of dropping the rest of the aggregate.
+  void SetSafeDecode(bool safeDecode) { fSafeDecodeFlag = safeDecode; }
+  // A broken aggregate is written once with its first error, in both modes.
+  // The file is opened at the first one and kept open until the next call.
+  void SetQuarantineFile(std::string path)
+  {
+    std::lock_guard<std::mutex> lock(fQuarantineMutex);
+    fQuarantineStream.close();
+    fQuarantineFile = path;
+  }
+
+  uint64_t GetErrorCount(DecodeError error)
+  {
+    return fErrorCounters[static_cast<uint32_t>(error)];
+  }
+  static std::string GetErrorName(DecodeError error);
+  // Called by the decode threads at every counted error, keep it short
+  typedef std::function<void(DecodeError)> ErrorCallback_t;
+  void SetErrorCallback(ErrorCallback_t callback) { fErrorCallback = callback; }
+
+  // Check start, stop, or event
+  DataType AddData(std::unique_ptr<RawData_t> rawData);
+  // Read order for several readers, taken in the same lock as the read.
+  // AddData checks the counter and queues in this order, an aggregate with
+  // readSeq 0 is not ordered.  Every taken number must reach AddData.
+  uint64_t NextReadSeq() { return ++fReadSeq; }
+
+  // In time order within the batch, the channel shards are merged by time
+  // stamp.  With more than one decode worker, an aggregate decoded late can
+  // give events older than the last batch.
+  std::unique_ptr<DataVec_t> GetData();
+  // Block until minEvents are decoded or timeout.  The returned container
+  // can be given back by ReturnData to avoid the allocation.
+  std::unique_ptr<DataVec_t> WaitForData(std::chrono::milliseconds timeout,
+                                         size_t minEvents = 1);
+
+  // Only the events of the subscribed channels.  Consumers of different
+  // channels do not share any lock.  The events are grouped by channel.
+  // The channels of no consumer are discarded from the first call.
+  std::unique_ptr<DataVec_t> GetData(const ChannelMask_t &channels);
+  std::unique_ptr<DataVec_t> WaitForData(std::chrono::milliseconds timeout,
+                                         size_t minEvents,
+                                         const ChannelMask_t &channels);
+  void ReturnData(std::unique_ptr<DataVec_t> data);
+  // Events of the channels no consumer takes
+  uint64_t GetDiscardedEvents() { return fNDiscarded; }
+
+  void SetDumpFlag(bool dumpFlag)
+  {
+    fDumpFlag = dumpFlag;
+    fPolicy.SetDumpFlag(dumpFlag);
+  }
+
+  // Called by the decode threads with every decoded batch before it is
+  // merged to the output.  Register before the first AddData.
+  typedef std::function<void(const DataVec_t &)> BatchObserver_t;
+  void AddBatchObserver(BatchObserver_t observer)
+  {
+    fBatchObservers.push_back(observer);
+  }
+  // Called with every event aggregate after the byte swap
+  typedef std::function<void(const RawData_t &)> RawObserver_t;
+  void AddRawObserver(RawObserver_t observer)
+  {
+    fRawObservers.push_back(observer);
+  }
+
+  // Block until the queued and the spilled raw data are decoded.  The
+  // spill is replayed without waiting for room in the output.  Spilled
+  // data left at the destruction are discarded and printed.
+  void WaitForDrain();
+
+  // Raw data go to the spill file while the raw queue is over maxQueueBytes
+  // or the output is over maxOutputEvents, and while the file is not empty
+  // to keep the order.  They are decoded again when the output goes below
+  // maxOutputEvents / 2.  Set before the first AddData.
+  void SetSpill(std::string fileName, size_t maxFileBytes,
+                size_t maxQueueBytes, size_t maxOutputEvents);
+  SpillStats_t GetSpillStats();
+
+  // Run between minThreads and the nThreads of the constructor decode
+  // workers, the others are parked.  Grows when the queue is deeper than
+  // the active workers or the queue + decode latency is over the target,
+  // shrinks after one second without queue and with low load.  Can be
+  // called again between runs, minThreads of nThreads keeps all active.
+  void SetAutoScale(uint32_t minThreads,
+                    std::chrono::microseconds targetLatency);
+  struct ScaleStats_t {
+    uint32_t nActive = 0;
+    uint32_t nThreads = 0;
+    size_t queueDepth = 0;
+    uint64_t meanLatencyNs = 0;  // Last control period
+    uint64_t maxLatencyNs = 0;
+    double load = 0.;  // Busy time / (period * active workers)
+    uint64_t nGrow = 0;
+    uint64_t nShrink = 0;
+  };
+  ScaleStats_t GetScaleStats();
+
+  // Events of an aggregate are published every nEvents while it is decoded
+  // instead of at its end, for the low latency mode.  0 is the whole
+  // aggregate.
+  void SetPublishEvents(size_t nEvents) { fPublishEvents = nEvents; }
+  // Latency from AddData to the consumer, counted when the events are taken
+  void SetLatencyReport(bool latencyReport) { fLatencyFlag = latencyReport; }
+  LatencyStats_t GetLatencyStats(bool reset = false)
+  {
+    return fLatency.GetStats(reset);
+  }
+
+  // Reuse the read buffers between reads and runs
+  std::unique_ptr<RawData_t> GetRawBuffer(size_t size);
+  // Allocate count buffers of size bytes now, so the reads do not wait for
+  // an allocation.  Smaller buffers in the pool are dropped.
+  void ReserveRawBuffers(size_t count, size_t size);
+
+ private:
+  // Raw data queue, fRawDataMutex
+  std::deque<std::unique_ptr<RawData_t>> fRawDataQueue;
+  std::mutex fRawDataMutex;
+  std::condition_variable fRawDataCondition;
+  std::condition_variable fDrainCondition;
+  uint32_t fNDecoding = 0;
+  size_t fRawQueueBytes = 0;
+  bool fDrainFlag = false;
+  bool IsDrained();
+
+  // Aggregate counter of the last queued aggregate, fRawDataMutex
+  uint64_t fLastCounter = 0;
+  void CheckCounter(const RawData_t &rawData);
+  std::atomic<uint64_t> fReadSeq = 0;
+  uint64_t fLastReadSeq = 0;
+  std::condition_variable fReadOrderCondition;
+
+  // Spill file, fRawDataMutex must be locked
+  std::unique_ptr<SpillBuffer> fSpill;
+  size_t fSpillQueueBytes = 0;
+  size_t fSpillOutputEvents = 0;
+  bool NeedSpill(size_t size);
+  bool CanReplay();
+
+  // Read buffers, MaxRawDataSize can be large
+  std::deque<std::unique_ptr<RawData_t>> fRawBufferPool;
+  std::mutex fRawBufferMutex;
+  size_t fMaxRawBuffers = 16;
+  void ReturnRawBuffer(std::unique_ptr<RawData_t> rawData);
+
+  DataType CheckDataType(std::unique_ptr<RawData_t> &rawData);
+  bool CheckStart(std::unique_ptr<RawData_t> &rawData);
+  bool CheckStop(std::unique_ptr<RawData_t> &rawData);
+
+  // Channel sharded output
+  struct OutputShard {
+    std::mutex mutex;
+    DataVec_t data;
+    std::atomic<size_t> size = 0;
+  };
+  std::array<OutputShard, kNChannelShards> fShards;
+  std::atomic<size_t> fNData = 0;
+  void MergeData(DataVec_t &dataVec);
+  static void MergeRuns(std::vector<DataVec_t> &runs, uint32_t nRuns,
+                        DataVec_t &data);
+  size_t CountData(const ChannelMask_t &channels);
+  std::unique_ptr<DataVec_t> TakeData(const ChannelMask_t &channels);
+
+  // Channels taken by the consumers, all kept before the first take
+  std::array<std::atomic<uint64_t>, kNChannelShards / 64> fSubscribed{};
+  std::atomic<bool> fSubscribedFlag = false;
+  std::atomic<uint64_t> fNDiscarded = 0;
+  void Subscribe(const ChannelMask_t &channels);
+  bool IsSubscribed(uint32_t channel)
+  {
+    return !fSubscribedFlag ||
+           ((fSubscribed[channel / 64] >> (channel % 64)) & 1);
+  }
+
+  // Only the waiting consumers take this lock
+  std::mutex fWaitMutex;
+  std::condition_variable fDataCondition;
+  std::atomic<uint32_t> fNWaiters = 0;
+
+  std::vector<std::unique_ptr<DataVec_t>> fContainerPool;
+  std::mutex fContainerMutex;
+  std::unique_ptr<DataVec_t> GetContainer();
+
+  std::vector<BatchObserver_t> fBatchObservers;
+  std::vector<RawObserver_t> fRawObservers;
+
+  // Decode workers
+  Policy fPolicy;
+  bool fDumpFlag = false;
+  std::atomic<bool> fDecodeFlag = false;
+  uint32_t fNOMPThreads = 1;
+  std::vector<std::thread> fDecodeThreads;
+  void DecodeThread(uint32_t index);
+  void DecodeData(std::unique_ptr<RawData_t> &rawData);
+  bool CheckEventChain(const uint8_t *dataStart, size_t i, size_t nWords);
+
+  // Low latency mode and latency report
+  size_t fPublishEvents = 0;
+  std::atomic<bool> fLatencyFlag = false;
+  LatencyHistogram fLatency;
+
+  // Workers [0, fNActive) decode, the others wait on fParkCondition.
+  // Changed with fRawDataMutex locked.
+  std::atomic<uint32_t> fNActive = 1;
+  std::condition_variable fParkCondition;
+  uint32_t fMinActive = 1;
+  uint64_t fTargetLatencyNs = 0;
+  std::atomic<uint64_t> fLatencySumNs = 0;
+  std::atomic<uint64_t> fLatencyMaxNs = 0;
+  std::atomic<uint64_t> fBusyNs = 0;
+  std::atomic<uint64_t> fNDecoded = 0;
+  std::mutex fScaleMutex;
+  std::condition_variable fScaleCondition;
+  ScaleStats_t fScaleStats;
+  std::thread fScaleThread;
+  void ScaleThread();
+
+  // Decode errors
+  bool fSafeDecodeFlag = false;
+  std::array<std::atomic<uint64_t>,
+             static_cast<uint32_t>(DecodeError::NumberOfErrors)>
+      fErrorCounters{};
+  ErrorCallback_t fErrorCallback = nullptr;
+  void CountError(DecodeError error, uint64_t n = 1)
+  {
+    fErrorCounters[static_cast<uint32_t>(error)] += n;
+    if (fErrorCallback) {
+      fErrorCallback(error);
+    }
+  }
+
+  std::string fQuarantineFile = "";
+  uint64_t fQuarantineSize = 0;
+  std::mutex fQuarantineMutex;
+  std::ofstream fQuarantineStream;
+  void Quarantine(const RawData_t &rawData, DecodeError error);
+};
+
+#endif  // RAWDECODER_HPP
\ No newline at end of file
@@ -0,0 +1,77 @@
+#ifndef SPILLBUFFER_HPP
+#define SPILLBUFFER_HPP 1
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+#include "RawData.hpp"
+
+struct SpillStats_t {
+  uint64_t maxBytes = 0;
+  uint64_t usedBytes = 0;
+  uint64_t nRecords = 0;
+  uint64_t writtenBytes = 0;  // Since the start, for the bandwidth
+  uint64_t readBytes = 0;
+  uint64_t nDropped = 0;  // Aggregates lost with a full file
+};
+
+// FIFO of raw aggregates in a memory mapped file, for the overflow of the
+// in-memory queues.  The file is a ring of records: size (uint64), number
+// of events (uint32), ready flag (uint32), read time (uint64), data padded
+// to 8 bytes.  Records do not wrap, the writer goes back to the file start
+// instead.  Consumed pages are punched out of the file so they are never
+// written back.
+class SpillBuffer
+{
+ public:
+  SpillBuffer(std::string fileName, size_t maxBytes);
+  ~SpillBuffer();
+
+  bool IsOpen() { return fMemory != nullptr; }
+
+  // False and counted as dropped when the file is full
+  bool Push(const RawData_t &rawData);
+  // Push in two steps, the data are copied by Commit without the lock.
+  // Reserve gives the record offset, or kNoRecord when the file is full.
+  static constexpr size_t kNoRecord = SIZE_MAX;
+  size_t Reserve(const RawData_t &rawData);
+  void Commit(size_t offset, const RawData_t &rawData);
+  // Oldest record, false when empty or not committed yet
+  bool Pop(RawData_t &rawData);
+  bool CanPop();
+
+  // Reserved records included
+  uint64_t GetNRecords() { return fNRecords; }
+  SpillStats_t GetStats();
+
+ private:
+  struct RecordHeader {
+    uint64_t size;
+    uint32_t nEvents;
+    uint32_t ready;  // Set by Commit
+    uint64_t readTimeNs;
+  };
+
+  std::string fFileName;
+  size_t fMaxBytes = 0;
+  uint8_t *fMemory = nullptr;
+  size_t fPageSize = 4096;
+
+  std::mutex fMutex;
+  size_t fHead = 0;
+  size_t fTail = 0;
+  size_t fWrapAt = SIZE_MAX;  // End of the data before the writer wrapped
+  size_t fReleased = 0;       // Punched before, but the pages of the writer
+  std::atomic<uint64_t> fNRecords = 0;
+  std::atomic<uint64_t> fUsedBytes = 0;
+  std::atomic<uint64_t> fWrittenBytes = 0;
+  std::atomic<uint64_t> fReadBytes = 0;
+  std::atomic<uint64_t> fNDropped = 0;
+  // Punch the whole pages from fReleased to end
+  void Release(size_t end);
+};
+
+#endif  // SPILLBUFFER_HPP
@@ -0,0 +1,96 @@
+#ifndef WAVEFORMMONITOR_HPP
+#define WAVEFORMMONITOR_HPP 1
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "PSD2Data.hpp"
+#include "RawToPSD2.hpp"
+
+// Samples waveform events for the online display.
+//
+// Offer() is called by the decode threads with every batch.  It takes at
+// most one event per channel and interval and copies it into the channel
+// slot.  A slot is a triple buffer: the writer never waits for the display
+// and the display always gets the latest event, older ones are overwritten.
+// When two decode threads hit the same slot, the second one skips.
+class WaveformMonitor
+{
+ public:
+  WaveformMonitor(uint32_t intervalMs = 500);
+
+  void SetInterval(uint32_t intervalMs);
+  void SetChannels(const ChannelMask_t &channels);
+  ChannelMask_t GetChannels();
+
+  // Decode threads
+  void Offer(const PSD2DataVec_t &events);
+
+  // Display thread.  Copies the latest event of the channel to data,
+  // false if nothing new since the last call.
+  bool GetLatest(uint32_t channel, PSD2Data_t &data);
+
+  // Min/max decimation to at most maxPoints points.  Each bucket gives its
+  // min and max in time order, spikes are kept.
+  template <typename T>
+  static void Decimate(const std::vector<T> &samples, size_t size,
+                       uint32_t step, size_t maxPoints,
+                       std::vector<double> &x, std::vector<double> &y);
+
+ private:
+  struct Slot_t {
+    std::array<PSD2Data_t, 3> buffers;
+    // Index of the ready buffer, kDirty when not taken by the display yet
+    std::atomic<uint8_t> middle{1};
+    uint8_t back = 0;   // Writer side
+    uint8_t front = 2;  // Display side
+    std::atomic_flag writing = ATOMIC_FLAG_INIT;
+    std::atomic<uint64_t> nextTimeNs{0};
+  };
+  static constexpr uint8_t kDirty = 0x4;
+
+  std::atomic<uint64_t> fIntervalNs;
+  std::array<std::atomic<uint64_t>, kNChannelShards / 64> fChannelBits;
+  std::unique_ptr<Slot_t[]> fSlots;
+};
+
+template <typename T>
+void WaveformMonitor::Decimate(const std::vector<T> &samples, size_t size,
+                               uint32_t step, size_t maxPoints,
+                               std::vector<double> &x, std::vector<double> &y)
+{
+  x.clear();
+  y.clear();
+  size = std::min(size, samples.size());
+  if (size <= maxPoints || maxPoints < 2) {
+    for (size_t i = 0; i < size; i++) {
+      x.push_back(i * step);
+      y.push_back(samples[i]);
+    }
+    return;
+  }
+
+  auto bucket = (size + maxPoints / 2 - 1) / (maxPoints / 2);
+  for (size_t start = 0; start < size; start += bucket) {
+    auto end = std::min(start + bucket, size);
+    auto minIt = start;
+    auto maxIt = start;
+    for (auto i = start + 1; i < end; i++) {
+      if (samples[i] < samples[minIt]) minIt = i;
+      if (samples[i] > samples[maxIt]) maxIt = i;
+    }
+    auto first = std::min(minIt, maxIt);
+    auto second = std::max(minIt, maxIt);
+    x.push_back(first * step);
+    y.push_back(samples[first]);
+    if (second != first) {
+      x.push_back(second * step);
+      y.push_back(samples[second]);
+    }
+  }
+}
+
+#endif  // WAVEFORMMONITOR_HPP
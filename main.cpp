@@ -2,12 +2,15 @@
 #include <TApplication.h>
 #include <TCanvas.h>
 #include <TGraph.h>
+#include <TROOT.h>
+#include <TSystem.h>
 #include <fcntl.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <termios.h>
 
+#include <atomic>
 #include <chrono>
 #include <iostream>
 #include <memory>
@@ -19,7 +22,7 @@
 
 #include "PSD2.hpp"
 
-enum class AppState { Quit, Reload, Continue };
+enum class AppState { Quit, Reload, Dump, Calibration, Continue };
 
 AppState InputCheck()
 {
@@ -43,22 +46,153 @@ AppState InputCheck()
     return AppState::Quit;
   } else if (ch == 'r' || ch == 'R') {
     return AppState::Reload;
+  } else if (ch == 'd' || ch == 'D') {
+    return AppState::Dump;
+  } else if (ch == 'c' || ch == 'C') {
+    return AppState::Calibration;
   }
 
   return AppState::Continue;
 }
 
-int main()
+// Draws the latest sampled event of each display channel.  Polled by the
+// main loop, ROOT is used only from the main thread.  The decode threads
+// only fill the monitor slots.
+class WaveformDisplay
 {
-  TApplication app("app", 0, nullptr);
+ public:
+  // The channels are read again at every call, a reload can change them
+  void Update(std::shared_ptr<WaveformMonitor> monitor);
+
+ private:
+  static constexpr size_t kMaxPoints = 2000;
+  static constexpr uint32_t kMaxPads = 16;
+  static constexpr uint32_t kNProbes = 6;
 
-  std::vector<int32_t> waveform(1024);
-  for (int i = 0; i < 1024; i++) {
-    waveform[i] = i * i;
+  ChannelMask_t fMask;
+  std::vector<uint32_t> fChannels;
+  std::unique_ptr<TCanvas> fCanvas;
+  std::vector<std::unique_ptr<TGraph>> fGraphs;
+  PSD2Data_t fData;
+  std::vector<double> fX, fY;
+  void Build();
+  void Draw(uint32_t pad);
+  void SetGraph(TGraph *graph);
+};
+
+void WaveformDisplay::Update(std::shared_ptr<WaveformMonitor> monitor)
+{
+  if (monitor) {
+    auto mask = monitor->GetChannels();
+    if (mask != fMask) {
+      fMask = mask;
+      Build();
+    }
+    for (uint32_t pad = 0; pad < fChannels.size(); pad++) {
+      if (monitor->GetLatest(fChannels[pad], fData)) {
+        Draw(pad);
+      }
+    }
+    if (fCanvas) {
+      fCanvas->Update();
+    }
   }
+  gSystem->ProcessEvents();
+}
 
+void WaveformDisplay::Build()
+{
+  fChannels.clear();
+  for (uint32_t ch = 0; ch < fMask.size() && fChannels.size() < kMaxPads;
+       ch++) {
+    if (fMask[ch]) fChannels.push_back(ch);
+  }
+  if (fChannels.empty()) {
+    fCanvas.reset();
+    fGraphs.clear();
+    return;
+  }
+
+  if (!fCanvas) {
+    fCanvas = std::make_unique<TCanvas>("canvas", "Waveform", 1200, 800);
+  }
+  fCanvas->Clear();
+  auto nColumns = (fChannels.size() > 1) ? 2 : 1;
+  if (fChannels.size() > 4) nColumns = 4;
+  auto nRows = (fChannels.size() + nColumns - 1) / nColumns;
+  fCanvas->Divide(nColumns, nRows);
+
+  fGraphs.clear();
+  for (uint32_t i = 0; i < fChannels.size() * kNProbes; i++) {
+    fGraphs.emplace_back(new TGraph());
+    fGraphs.back()->SetLineColor(i % kNProbes + 1);
+  }
+}
+
+void WaveformDisplay::SetGraph(TGraph *graph)
+{
+  graph->Set(fX.size());
+  for (size_t i = 0; i < fX.size(); i++) {
+    graph->SetPoint(i, fX[i], fY[i]);
+  }
+}
+
+void WaveformDisplay::Draw(uint32_t pad)
+{
+  auto &data = fData;
+  auto step = std::max<uint32_t>(1, data.downSampleFactor);
+  auto graph = &fGraphs[pad * kNProbes];
+
+  auto yMin = 0.;
+  auto yMax = 1.;
+  auto updateRange = [this, &yMin, &yMax]() {
+    for (auto v : fY) {
+      yMin = std::min(yMin, v);
+      yMax = std::max(yMax, v);
+    }
+  };
+  WaveformMonitor::Decimate(data.analogProbe1, data.waveformSize, step,
+                            kMaxPoints, fX, fY);
+  updateRange();
+  SetGraph(graph[0].get());
+  graph[0]->SetTitle(("ch" + std::to_string(fChannels[pad])).c_str());
+  WaveformMonitor::Decimate(data.analogProbe2, data.waveformSize, step,
+                            kMaxPoints, fX, fY);
+  updateRange();
+  SetGraph(graph[1].get());
+
+  // Digital probes as steps of 1/8 of the analog range at the bottom
+  auto height = (yMax - yMin) / 8.;
+  const std::vector<uint8_t> *digital[] = {
+      &data.digitalProbe1, &data.digitalProbe2, &data.digitalProbe3,
+      &data.digitalProbe4};
+  for (uint32_t i = 0; i < 4; i++) {
+    WaveformMonitor::Decimate(*digital[i], data.waveformSize, step,
+                              kMaxPoints, fX, fY);
+    for (auto &v : fY) {
+      v = yMin + (i + v * 0.8) * height / 4.;
+    }
+    SetGraph(graph[2 + i].get());
+  }
+
+  fCanvas->cd(pad + 1);
+  graph[0]->SetMinimum(yMin);
+  graph[0]->SetMaximum(yMax);
+  graph[0]->Draw("AL");
+  for (uint32_t i = 1; i < kNProbes; i++) {
+    graph[i]->Draw("L SAME");
+  }
+  gPad->Modified();
+}
+
+int main()
+{
+  ROOT::EnableThreadSafety();
+  TApplication app("app", 0, nullptr);
+
+  const std::string configFile = "PSD2.conf";
   auto digitizer = std::make_unique<PSD2>();
-  digitizer->LoadConfig("PSD2.conf");
+  digitizer->LoadConfig(configFile);
 
   if (!digitizer->Initialize()) {
     std::cerr << "Failed to initialize digitizer" << std::endl;
@@ -75,17 +209,72 @@ int main()
     exit(1);
   }
 
+  WaveformDisplay display;
+  auto lastDisplay = std::chrono::steady_clock::now();
+
   double_t eveCounter = 0;
   auto startTime = std::chrono::system_clock::now();
+  auto lastReport = startTime;
+  auto lastSpill = digitizer->GetSpillStats();
   while (true) {
     auto state = InputCheck();
     if (state == AppState::Quit) {
       break;
+    } else if (state == AppState::Reload) {
+      digitizer->StopAcquisition();
+      digitizer->LoadConfig(configFile);
+      if (!digitizer->Reconfigure()) {
+        std::cerr << "Failed to reconfigure digitizer" << std::endl;
+        break;
+      }
+      digitizer->StartAcquisition();
+    } else if (state == AppState::Dump) {
+      digitizer->DumpFlightRecorder();
+    } else if (state == AppState::Calibration) {
+      digitizer->ReloadCalibration();
     }
 
-    auto data = digitizer->GetData();
-    if (data->size() > 0) {
-      eveCounter += data->size();
+    auto data = digitizer->WaitForData(std::chrono::milliseconds(100));
+    eveCounter += data->size();
+    digitizer->ReturnData(std::move(data));
+
+    // The monitor can be created by a reload
+    if (std::chrono::steady_clock::now() - lastDisplay >=
+        std::chrono::milliseconds(100)) {
+      display.Update(digitizer->GetWaveformMonitor());
+      lastDisplay = std::chrono::steady_clock::now();
+    }
+
+    // Overflow file, only while it is used
+    auto now = std::chrono::system_clock::now();
+    if (now - lastReport >= std::chrono::seconds(1)) {
+      auto spill = digitizer->GetSpillStats();
+      if (spill.writtenBytes < lastSpill.writtenBytes) {
+        lastSpill = SpillStats_t();  // New pipeline
+      }
+      if (spill.usedBytes > 0 || spill.writtenBytes != lastSpill.writtenBytes) {
+        auto sec = std::chrono::duration<double>(now - lastReport).count();
+        constexpr double MB = 1024. * 1024.;
+        std::cout << "Spill: " << spill.usedBytes / MB << " / "
+                  << spill.maxBytes / MB << " MB, write "
+                  << (spill.writtenBytes - lastSpill.writtenBytes) / MB / sec
+                  << " MB/s, read "
+                  << (spill.readBytes - lastSpill.readBytes) / MB / sec
+                  << " MB/s, dropped " << spill.nDropped << std::endl;
+      }
+      lastSpill = spill;
+
+      // Read to consumer, only with LatencyReport or LowLatency
+      auto latency = digitizer->GetLatencyStats(true);
+      if (latency.count > 0) {
+        constexpr double us = 1000.;
+        std::cout << "Latency [us]: p50 " << latency.p50Ns / us << ", p90 "
+                  << latency.p90Ns / us << ", p99 " << latency.p99Ns / us
+                  << ", p99.9 " << latency.p999Ns / us << ", max "
+                  << latency.maxNs / us << " (" << latency.count
+                  << " events)" << std::endl;
+      }
+      lastReport = now;
     }
   }
   auto endTime = std::chrono::system_clock::now();
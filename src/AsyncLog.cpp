@@ -0,0 +1,277 @@
+#include "AsyncLog.hpp"
+
+#include <algorithm>
+#include <bitset>
+#include <cstdio>
+#include <ctime>
+#include <iostream>
+
+AsyncLog &AsyncLog::Get()
+{
+  static AsyncLog log;
+  return log;
+}
+
+AsyncLog::AsyncLog()
+{
+  fStartSteadyNs = NowNs();
+  fStartSystemNs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                       std::chrono::system_clock::now().time_since_epoch())
+                       .count();
+  fLogThread = std::thread(&AsyncLog::LogThread, this);
+}
+
+AsyncLog::~AsyncLog()
+{
+  {
+    std::lock_guard<std::mutex> lock(fFlushMutex);
+    fLogFlag = false;
+  }
+  fFlushCondition.notify_all();
+  if (fLogThread.joinable()) {
+    fLogThread.join();
+  }
+}
+
+void AsyncLog::SetOutput(std::string fileName)
+{
+  std::lock_guard<std::mutex> lock(fOutputMutex);
+  if (fFile.is_open()) {
+    fFile.close();
+  }
+  if (fileName != "") {
+    fFile.open(fileName, std::ios::app);
+    if (!fFile) {
+      std::cerr << "Failed to open log file " << fileName << std::endl;
+    }
+  }
+}
+
+AsyncLog::Buffer_t &AsyncLog::GetBuffer()
+{
+  thread_local BufferHolder_t holder;
+  if (!holder.buffer) {
+    holder.buffer = std::make_shared<Buffer_t>();
+    std::lock_guard<std::mutex> lock(fBuffersMutex);
+    holder.buffer->threadId = fNThreads++;
+    fBuffers.push_back(holder.buffer);
+  }
+  return *holder.buffer;
+}
+
+bool AsyncLog::Allow(LogSite &site, uint64_t now)
+{
+  uint32_t limit = site.maxPerSecond;
+  if (limit == 0) {
+    limit = fRateLimit;
+  }
+  if (limit == 0) {
+    return true;  // No limit
+  }
+
+  constexpr uint64_t window = 1000000000;
+  auto start = site.windowStart.load(std::memory_order_relaxed);
+  if (now - start >= window &&
+      site.windowStart.compare_exchange_strong(start, now)) {
+    site.count.store(0, std::memory_order_relaxed);
+  }
+  if (site.count.fetch_add(1, std::memory_order_relaxed) < limit) {
+    return true;
+  }
+  site.suppressed.fetch_add(1, std::memory_order_relaxed);
+  return false;
+}
+
+void AsyncLog::Push(const LogRecord &record)
+{
+  auto &buffer = GetBuffer();
+  auto head = buffer.head.load(std::memory_order_relaxed);
+  if (head - buffer.tail.load(std::memory_order_acquire) >= Buffer_t::kSize) {
+    fNDropped++;
+    return;
+  }
+  buffer.records[head & (Buffer_t::kSize - 1)] = record;
+  buffer.head.store(head + 1, std::memory_order_release);
+}
+
+void AsyncLog::Dump(LogSite &site, const uint8_t *data, size_t size)
+{
+  auto now = NowNs();
+  constexpr uint64_t window = 1000000000;
+  auto start = fDumpWindowStart.load(std::memory_order_relaxed);
+  if (now - start >= window &&
+      fDumpWindowStart.compare_exchange_strong(start, now)) {
+    fDumpBytes.store(0, std::memory_order_relaxed);
+  }
+  auto limit = fDumpLimit.load();
+  if (limit > 0 &&
+      fDumpBytes.fetch_add(size, std::memory_order_relaxed) + size > limit) {
+    fNDropped++;
+    return;
+  }
+
+  // Header with the size, then the words.  The last word is padded with
+  // zero bytes.  Dropped as a whole when the ring has no room for it.
+  auto nWords = (size + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+  auto nRecords = 1 + (nWords + kLogMaxArgs - 1) / kLogMaxArgs;
+  auto &buffer = GetBuffer();
+  auto used = buffer.head.load(std::memory_order_relaxed) -
+              buffer.tail.load(std::memory_order_acquire);
+  if (used + nRecords > Buffer_t::kSize) {
+    fNDropped++;
+    return;
+  }
+
+  LogRecord record;
+  record.timeNs = now;
+  record.site = &site;
+  record.nArgs = 0;
+  record.dump = 0;
+  Pack(record, size);
+  Push(record);
+  record.dump = 1;
+  for (size_t i = 0; i < nWords; i += kLogMaxArgs) {
+    record.nArgs = std::min<size_t>(kLogMaxArgs, nWords - i);
+    auto offset = i * sizeof(uint64_t);
+    auto nBytes = std::min<size_t>(size - offset,
+                                   record.nArgs * sizeof(uint64_t));
+    std::memset(record.args, 0, sizeof(record.args));
+    std::memcpy(record.args, data + offset, nBytes);
+    Push(record);
+  }
+}
+
+void AsyncLog::Flush()
+{
+  std::unique_lock<std::mutex> lock(fFlushMutex);
+  auto request = ++fFlushRequest;
+  fFlushCondition.notify_all();
+  fFlushCondition.wait(
+      lock, [this, request] { return fFlushDone >= request || !fLogFlag; });
+}
+
+void AsyncLog::LogThread()
+{
+  constexpr auto period = std::chrono::milliseconds(20);
+  std::vector<std::pair<LogRecord, uint32_t>> records;
+  std::string out;
+
+  while (true) {
+    uint64_t request = 0;
+    bool logFlag = true;
+    {
+      std::unique_lock<std::mutex> lock(fFlushMutex);
+      fFlushCondition.wait_for(lock, period, [this] {
+        return fFlushRequest > fFlushDone || !fLogFlag;
+      });
+      request = fFlushRequest;
+      logFlag = fLogFlag;
+    }
+
+    std::vector<std::shared_ptr<Buffer_t>> buffers;
+    {
+      std::lock_guard<std::mutex> lock(fBuffersMutex);
+      // Threads gone and nothing left
+      fBuffers.erase(
+          std::remove_if(fBuffers.begin(), fBuffers.end(),
+                         [](const std::shared_ptr<Buffer_t> &buffer) {
+                           return buffer->retired &&
+                                  buffer->head == buffer->tail;
+                         }),
+          fBuffers.end());
+      buffers = fBuffers;
+    }
+
+    records.clear();
+    for (auto &buffer : buffers) {
+      auto tail = buffer->tail.load(std::memory_order_relaxed);
+      auto head = buffer->head.load(std::memory_order_acquire);
+      for (; tail < head; tail++) {
+        records.emplace_back(buffer->records[tail & (Buffer_t::kSize - 1)],
+                             buffer->threadId);
+      }
+      buffer->tail.store(tail, std::memory_order_release);
+    }
+    std::stable_sort(records.begin(), records.end(),
+                     [](const auto &a, const auto &b) {
+                       return a.first.timeNs < b.first.timeNs;
+                     });
+
+    if (!records.empty()) {
+      out.clear();
+      for (auto &record : records) {
+        Format(record.first, record.second, out);
+      }
+      std::lock_guard<std::mutex> lock(fOutputMutex);
+      if (fFile.is_open()) {
+        fFile << out << std::flush;
+      } else {
+        std::cout << out << std::flush;
+      }
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(fFlushMutex);
+      fFlushDone = request;
+    }
+    fFlushCondition.notify_all();
+    if (!logFlag) {
+      break;
+    }
+  }
+}
+
+void AsyncLog::Format(const LogRecord &record, uint32_t threadId,
+                      std::string &out)
+{
+  if (record.dump) {
+    for (uint32_t i = 0; i < record.nArgs; i++) {
+      out += std::bitset<64>(record.args[i]).to_string();
+      out += '\n';
+    }
+    return;
+  }
+
+  auto timeNs = fStartSystemNs + (record.timeNs - fStartSteadyNs);
+  time_t sec = timeNs / 1000000000;
+  std::tm tm;
+  localtime_r(&sec, &tm);
+  char buf[64];
+  auto n = std::strftime(buf, sizeof(buf), "%H:%M:%S", &tm);
+  std::snprintf(buf + n, sizeof(buf) - n, ".%06lu [t%u] ",
+                static_cast<unsigned long>(timeNs % 1000000000 / 1000),
+                threadId);
+  out += buf;
+
+  uint32_t iArg = 0;
+  for (auto p = record.site->format; *p != '\0'; p++) {
+    if (p[0] == '{' && p[1] == '}' && iArg < record.nArgs) {
+      auto arg = record.args[iArg];
+      switch (record.types[iArg]) {
+        case Int:
+          out += std::to_string(static_cast<int64_t>(arg));
+          break;
+        case UInt:
+          out += std::to_string(arg);
+          break;
+        case Double: {
+          double d;
+          std::memcpy(&d, &arg, sizeof(d));
+          std::snprintf(buf, sizeof(buf), "%.17g", d);
+          out += buf;
+          break;
+        }
+      }
+      iArg++;
+      p++;
+    } else {
+      out += *p;
+    }
+  }
+
+  auto suppressed = record.site->suppressed.exchange(0);
+  if (suppressed > 0) {
+    out += " (+" + std::to_string(suppressed) + " suppressed)";
+  }
+  out += '\n';
+}
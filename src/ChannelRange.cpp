@@ -0,0 +1,41 @@
+#include "ChannelRange.hpp"
+
+#include <cctype>
+#include <stdexcept>
+
+namespace
+{
+// Whole token, digits only
+bool ParseNumber(const std::string &token, uint32_t &number)
+{
+  if (token.empty() || !std::isdigit(static_cast<unsigned char>(token[0]))) {
+    return false;
+  }
+  try {
+    size_t end = 0;
+    auto value = std::stoul(token, &end);
+    if (end != token.size() || value > UINT32_MAX) {
+      return false;
+    }
+    number = value;
+  } catch (const std::exception &) {
+    return false;
+  }
+  return true;
+}
+}  // namespace
+
+bool ParseChannelRange(const std::string &token, uint32_t &first,
+                       uint32_t &last)
+{
+  auto range = token.find("..");
+  if (!ParseNumber(token.substr(0, range), first)) {
+    return false;
+  }
+  last = first;
+  if (range != std::string::npos &&
+      !ParseNumber(token.substr(range + 2), last)) {
+    return false;
+  }
+  return first <= last;
+}
@@ -0,0 +1,285 @@
+#include "EventRing.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <iostream>
+
+#include "PSD2Codec.hpp"
+
+EventRingWriter::EventRingWriter(std::string name, uint64_t nSlots,
+                                 uint64_t slotSize)
+    : fName(name)
+{
+  if (nSlots < 2) {
+    nSlots = 2;
+  }
+  // Slot payload starts 8 byte aligned
+  slotSize = (slotSize + 7) & ~uint64_t(7);
+  if (slotSize < sizeof(EventRingSlot) + 1024) {
+    slotSize = sizeof(EventRingSlot) + 1024;
+  }
+
+  // Start from a clean segment, old readers keep their mapping
+  shm_unlink(fName.c_str());
+  auto fd = shm_open(fName.c_str(), O_CREAT | O_RDWR, 0666);
+  if (fd < 0) {
+    std::cerr << "Failed to open shared memory " << fName << std::endl;
+    return;
+  }
+
+  fMemorySize = kEventRingHeaderSize + nSlots * slotSize;
+  if (ftruncate(fd, fMemorySize) != 0) {
+    std::cerr << "Failed to resize shared memory " << fName << std::endl;
+    close(fd);
+    shm_unlink(fName.c_str());
+    return;
+  }
+
+  fMemory =
+      mmap(nullptr, fMemorySize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (fMemory == MAP_FAILED) {
+    std::cerr << "Failed to map shared memory " << fName << std::endl;
+    fMemory = nullptr;
+    shm_unlink(fName.c_str());
+    return;
+  }
+
+  // ftruncate gives zero filled memory, all slots are empty (seq = 0)
+  fHeader = new (fMemory) EventRingHeader;
+  fHeader->version = kEventRingVersion;
+  fHeader->codecVersion = kPSD2CodecVersion;
+  fHeader->headerSize = kEventRingHeaderSize;
+  fHeader->nSlots = nSlots;
+  fHeader->slotSize = slotSize;
+  fHeader->writeSeq.store(0);
+  fHeader->droppedEvents.store(0);
+  for (uint64_t i = 0; i < nSlots; i++) {
+    new (GetSlot(i)) EventRingSlot;
+    GetSlot(i)->seq.store(0);
+  }
+  // Readers check the magic last
+  std::atomic_thread_fence(std::memory_order_release);
+  fHeader->magic = kEventRingMagic;
+
+  std::cout << "Event ring: " << fName << " " << nSlots << " x " << slotSize
+            << " bytes" << std::endl;
+}
+
+EventRingWriter::~EventRingWriter()
+{
+  if (fMemory) {
+    munmap(fMemory, fMemorySize);
+    shm_unlink(fName.c_str());
+  }
+}
+
+EventRingSlot *EventRingWriter::GetSlot(uint64_t seq)
+{
+  auto offset =
+      kEventRingHeaderSize + (seq % fHeader->nSlots) * fHeader->slotSize;
+  return reinterpret_cast<EventRingSlot *>(static_cast<uint8_t *>(fMemory) +
+                                           offset);
+}
+
+void EventRingWriter::Commit(EventRingSlot *slot, uint64_t seq, uint64_t size,
+                             uint32_t nEvents)
+{
+  slot->payloadSize = size;
+  slot->nEvents = nEvents;
+  slot->publishTimeNs =
+      std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::system_clock::now().time_since_epoch())
+          .count();
+  slot->seq.store(2 * seq + 2, std::memory_order_release);
+  fHeader->writeSeq.store(seq + 1, std::memory_order_release);
+}
+
+void EventRingWriter::Publish(const PSD2DataVec_t &events)
+{
+  if (!fHeader || events.empty()) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(fWriteMutex);
+  const auto capacity = fHeader->slotSize - sizeof(EventRingSlot);
+  auto seq = fHeader->writeSeq.load(std::memory_order_relaxed);
+  EventRingSlot *slot = nullptr;
+  uint8_t *payload = nullptr;
+  uint64_t used = 0;
+  uint32_t nEvents = 0;
+
+  for (auto &event : events) {
+    auto size = PSD2Codec::EncodedSize(*event);
+    if (size > capacity) {
+      fHeader->droppedEvents.fetch_add(1, std::memory_order_relaxed);
+      continue;
+    }
+
+    if (slot && used + size > capacity) {
+      Commit(slot, seq, used, nEvents);
+      seq++;
+      slot = nullptr;
+    }
+
+    if (!slot) {
+      slot = GetSlot(seq);
+      slot->seq.store(2 * seq + 1, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_release);
+      payload = reinterpret_cast<uint8_t *>(slot) + sizeof(EventRingSlot);
+      used = 0;
+      nEvents = 0;
+    }
+
+    used += PSD2Codec::Encode(*event, payload + used);
+    nEvents++;
+  }
+
+  if (slot) {
+    Commit(slot, seq, used, nEvents);
+  }
+}
+
+EventRingReader::EventRingReader(std::string name, bool fromOldest)
+{
+  auto fd = shm_open(name.c_str(), O_RDONLY, 0);
+  if (fd < 0) {
+    std::cerr << "Failed to open shared memory " << name << std::endl;
+    return;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t)kEventRingHeaderSize) {
+    std::cerr << "Shared memory " << name << " is not ready" << std::endl;
+    close(fd);
+    return;
+  }
+  fMemorySize = st.st_size;
+  fMemory = mmap(nullptr, fMemorySize, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (fMemory == MAP_FAILED) {
+    std::cerr << "Failed to map shared memory " << name << std::endl;
+    fMemory = nullptr;
+    return;
+  }
+
+  auto header = static_cast<const EventRingHeader *>(fMemory);
+  std::atomic_thread_fence(std::memory_order_acquire);
+  if (header->magic != kEventRingMagic ||
+      header->version != kEventRingVersion ||
+      header->codecVersion != kPSD2CodecVersion ||
+      fMemorySize < header->headerSize + header->nSlots * header->slotSize) {
+    std::cerr << "Unknown event ring layout in " << name << std::endl;
+    munmap(fMemory, fMemorySize);
+    fMemory = nullptr;
+    return;
+  }
+  fHeader = header;
+
+  fCursor = fHeader->writeSeq.load(std::memory_order_acquire);
+  if (fromOldest && fCursor > fHeader->nSlots) {
+    fCursor -= fHeader->nSlots;
+  } else if (fromOldest) {
+    fCursor = 0;
+  }
+}
+
+EventRingReader::~EventRingReader()
+{
+  if (fMemory) {
+    munmap(fMemory, fMemorySize);
+  }
+}
+
+const EventRingSlot *EventRingReader::GetSlot(uint64_t seq)
+{
+  auto offset = fHeader->headerSize + (seq % fHeader->nSlots) * fHeader->slotSize;
+  return reinterpret_cast<const EventRingSlot *>(
+      static_cast<const uint8_t *>(fMemory) + offset);
+}
+
+bool EventRingReader::Next(const uint8_t *&payload, uint64_t &size,
+                           uint32_t &nEvents)
+{
+  if (!fHeader) {
+    return false;
+  }
+
+  while (true) {
+    auto writeSeq = fHeader->writeSeq.load(std::memory_order_acquire);
+    if (fCursor >= writeSeq) {
+      return false;
+    }
+    if (writeSeq - fCursor > fHeader->nSlots) {
+      // Lapped by the writer, jump to the oldest slot
+      fLostBatches += writeSeq - fHeader->nSlots - fCursor;
+      fCursor = writeSeq - fHeader->nSlots;
+    }
+
+    auto slot = GetSlot(fCursor);
+    auto seqValue = slot->seq.load(std::memory_order_acquire);
+    if (seqValue != 2 * fCursor + 2) {
+      // Being overwritten, try again with the new writeSeq
+      fLostBatches++;
+      fCursor++;
+      continue;
+    }
+
+    fCurrentSlot = slot;
+    fCurrentSeqValue = seqValue;
+    payload = reinterpret_cast<const uint8_t *>(slot) + sizeof(EventRingSlot);
+    size = slot->payloadSize;
+    nEvents = slot->nEvents;
+    fCursor++;
+
+    if (size > fHeader->slotSize - sizeof(EventRingSlot)) {
+      continue;  // Torn header, IsValid would fail
+    }
+    return true;
+  }
+}
+
+bool EventRingReader::IsValid()
+{
+  if (!fCurrentSlot) {
+    return false;
+  }
+  std::atomic_thread_fence(std::memory_order_acquire);
+  auto valid = fCurrentSlot->seq.load(std::memory_order_relaxed) ==
+               fCurrentSeqValue;
+  if (!valid) {
+    fLostBatches++;
+  }
+  return valid;
+}
+
+bool EventRingReader::Read(PSD2DataVec_t &events)
+{
+  const uint8_t *payload = nullptr;
+  uint64_t size = 0;
+  uint32_t nEvents = 0;
+  while (Next(payload, size, nEvents)) {
+    auto first = events.size();
+    events.reserve(first + nEvents);
+    auto ok = PSD2Codec::DecodeAll(payload, size, events);
+    if (ok && IsValid()) {
+      return true;
+    }
+    // Overwritten while decoding
+    events.resize(first);
+  }
+
+  return false;
+}
+
+uint64_t EventRingReader::GetDroppedEvents()
+{
+  if (!fHeader) {
+    return 0;
+  }
+  return fHeader->droppedEvents.load(std::memory_order_relaxed);
+}
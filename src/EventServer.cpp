@@ -0,0 +1,469 @@
+#include "EventServer.hpp"
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <iostream>
+
+#ifdef USE_LZ4
+#include <lz4.h>
+#endif
+
+#include "PSD2Codec.hpp"
+
+EventServer::EventServer(uint16_t port, size_t maxQueueBytes, bool compress)
+    : fPort(port), fMaxQueueBytes(maxQueueBytes), fCompress(compress)
+{
+#ifndef USE_LZ4
+  if (fCompress) {
+    std::cerr << "Built without LZ4, compression is disabled" << std::endl;
+    fCompress = false;
+  }
+#endif
+}
+
+EventServer::~EventServer() { Stop(); }
+
+bool EventServer::Start()
+{
+  fListenSocket = socket(AF_INET, SOCK_STREAM, 0);
+  if (fListenSocket < 0) {
+    std::cerr << "Failed to create socket" << std::endl;
+    return false;
+  }
+
+  int yes = 1;
+  setsockopt(fListenSocket, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(fPort);
+  if (bind(fListenSocket, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) <
+          0 ||
+      listen(fListenSocket, 8) < 0) {
+    std::cerr << "Failed to listen on port " << fPort << std::endl;
+    close(fListenSocket);
+    fListenSocket = -1;
+    return false;
+  }
+
+  std::cout << "Event server: port " << fPort << std::endl;
+  fServerFlag = true;
+  fAcceptThread = std::thread(&EventServer::AcceptThread, this);
+
+  return true;
+}
+
+void EventServer::Stop()
+{
+  if (!fServerFlag) {
+    return;
+  }
+  fServerFlag = false;
+
+  if (fAcceptThread.joinable()) {
+    fAcceptThread.join();
+  }
+  close(fListenSocket);
+  fListenSocket = -1;
+
+  std::vector<std::shared_ptr<Client>> clients;
+  {
+    std::lock_guard<std::mutex> lock(fClientsMutex);
+    clients.swap(fClients);
+  }
+  for (auto &client : clients) {
+    CloseClient(*client);
+  }
+}
+
+void EventServer::CloseClient(Client &client)
+{
+  {
+    std::lock_guard<std::mutex> lock(client.mutex);
+    client.closed = true;
+  }
+  client.condition.notify_all();
+  // Unblock a send to a stalled client
+  shutdown(client.socket, SHUT_RDWR);
+  if (client.thread.joinable()) {
+    client.thread.join();
+  }
+  close(client.socket);
+
+  std::cout << "Client " << client.address << " closed: "
+            << client.sentFrames << " frames sent, " << client.droppedFrames
+            << " frames (" << client.droppedEvents << " events) dropped"
+            << std::endl;
+}
+
+void EventServer::AcceptThread()
+{
+  while (fServerFlag) {
+    pollfd pfd{fListenSocket, POLLIN, 0};
+    auto ret = poll(&pfd, 1, 100);
+
+    if (ret > 0 && (pfd.revents & POLLIN)) {
+      sockaddr_in addr{};
+      socklen_t addrLen = sizeof(addr);
+      auto fd =
+          accept(fListenSocket, reinterpret_cast<sockaddr *>(&addr), &addrLen);
+      if (fd >= 0) {
+        int yes = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+
+        auto client = std::make_shared<Client>();
+        client->socket = fd;
+        char host[INET_ADDRSTRLEN] = {0};
+        inet_ntop(AF_INET, &addr.sin_addr, host, sizeof(host));
+        client->address = std::string(host) + ":" +
+                          std::to_string(ntohs(addr.sin_port));
+        client->thread = std::thread(&EventServer::SendThread, this, client);
+        std::cout << "Client " << client->address << " connected"
+                  << std::endl;
+
+        std::lock_guard<std::mutex> lock(fClientsMutex);
+        fClients.push_back(client);
+      }
+    }
+
+    // Clean up disconnected clients, joined without fClientsMutex so the
+    // publishers do not wait for them
+    std::vector<std::shared_ptr<Client>> closedClients;
+    {
+      std::lock_guard<std::mutex> lock(fClientsMutex);
+      for (auto it = fClients.begin(); it != fClients.end();) {
+        bool closed = false;
+        {
+          std::lock_guard<std::mutex> clientLock((*it)->mutex);
+          closed = (*it)->closed;
+        }
+        if (closed) {
+          closedClients.push_back(std::move(*it));
+          it = fClients.erase(it);
+        } else {
+          it++;
+        }
+      }
+    }
+    for (auto &client : closedClients) {
+      CloseClient(*client);
+    }
+  }
+}
+
+void EventServer::SendThread(std::shared_ptr<Client> client)
+{
+  // Several frames are sent by one sendmsg
+  constexpr size_t maxFramesPerWrite = 64;
+  std::vector<Frame_t> frames;
+  std::vector<iovec> iov;
+  frames.reserve(maxFramesPerWrite);
+  iov.reserve(maxFramesPerWrite);
+
+  while (true) {
+    frames.clear();
+    {
+      std::unique_lock<std::mutex> lock(client->mutex);
+      client->condition.wait(lock, [this, &client] {
+        return !client->queue.empty() || client->closed || !fServerFlag;
+      });
+      if (client->closed || client->queue.empty()) {
+        break;
+      }
+      while (!client->queue.empty() && frames.size() < maxFramesPerWrite) {
+        client->queuedBytes -= client->queue.front()->size();
+        frames.push_back(std::move(client->queue.front()));
+        client->queue.pop_front();
+      }
+    }
+
+    iov.clear();
+    size_t total = 0;
+    for (auto &frame : frames) {
+      iov.push_back({const_cast<uint8_t *>(frame->data()), frame->size()});
+      total += frame->size();
+    }
+
+    auto failed = false;
+    size_t first = 0;
+    while (first < iov.size()) {
+      msghdr msg{};
+      msg.msg_iov = &iov[first];
+      msg.msg_iovlen = iov.size() - first;
+      auto sent = sendmsg(client->socket, &msg, MSG_NOSIGNAL);
+      if (sent < 0) {
+        if (errno == EINTR) continue;
+        failed = true;
+        break;
+      }
+      // Skip what is written, partial writes are possible
+      while (first < iov.size() && size_t(sent) >= iov[first].iov_len) {
+        sent -= iov[first].iov_len;
+        first++;
+      }
+      if (first < iov.size()) {
+        iov[first].iov_base = static_cast<uint8_t *>(iov[first].iov_base) + sent;
+        iov[first].iov_len -= sent;
+      }
+    }
+
+    if (failed) {
+      std::lock_guard<std::mutex> lock(client->mutex);
+      client->closed = true;
+      break;
+    }
+    client->sentFrames += frames.size();
+    client->sentBytes += total;
+  }
+}
+
+std::shared_ptr<std::vector<uint8_t>> EventServer::MakeFrame(
+    EventFrameType type, uint32_t nEvents, const uint8_t *payload,
+    size_t size)
+{
+  EventFrameHeader header{};
+  header.magic = kEventFrameMagic;
+  header.version = kEventFrameVersion;
+  header.type = static_cast<uint16_t>(type);
+  header.nEvents = nEvents;
+  header.rawSize = size;
+  header.payloadSize = size;
+
+  auto frame = std::make_shared<std::vector<uint8_t>>();
+#ifdef USE_LZ4
+  if (fCompress) {
+    frame->resize(sizeof(header) + LZ4_compressBound(size));
+    auto compSize = LZ4_compress_default(
+        reinterpret_cast<const char *>(payload),
+        reinterpret_cast<char *>(frame->data() + sizeof(header)), size,
+        frame->size() - sizeof(header));
+    if (compSize > 0 && size_t(compSize) < size) {
+      header.flags |= kEventFrameLZ4;
+      header.payloadSize = compSize;
+      frame->resize(sizeof(header) + compSize);
+    }
+  }
+#endif
+  if (!(header.flags & kEventFrameLZ4)) {
+    frame->resize(sizeof(header) + size);
+    std::memcpy(frame->data() + sizeof(header), payload, size);
+  }
+
+  std::memcpy(frame->data(), &header, sizeof(header));
+
+  return frame;
+}
+
+void EventServer::Broadcast(std::shared_ptr<std::vector<uint8_t>> frame,
+                            uint32_t nEvents)
+{
+  std::lock_guard<std::mutex> lock(fClientsMutex);
+  // Frames are made by many threads, the seq follows the queue order
+  auto seq = fFrameSeq++;
+  if (frame->size() - sizeof(EventFrameHeader) > kEventFrameMaxPayload) {
+    // Clients refuse it, they see the gap of its seq
+    for (auto &client : fClients) {
+      std::lock_guard<std::mutex> clientLock(client->mutex);
+      client->droppedFrames++;
+      client->droppedEvents += nEvents;
+    }
+    return;
+  }
+  std::memcpy(frame->data() + offsetof(EventFrameHeader, seq), &seq,
+              sizeof(seq));
+  for (auto &client : fClients) {
+    {
+      std::lock_guard<std::mutex> clientLock(client->mutex);
+      if (client->closed) {
+        continue;
+      }
+      if (client->queuedBytes + frame->size() > fMaxQueueBytes) {
+        // Slow client, it sees a gap of seq
+        client->droppedFrames++;
+        client->droppedEvents += nEvents;
+        continue;
+      }
+      client->queue.push_back(frame);
+      client->queuedBytes += frame->size();
+    }
+    client->condition.notify_one();
+  }
+}
+
+void EventServer::PublishEvents(const PSD2DataVec_t &events)
+{
+  if (!fServerFlag || events.empty()) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(fClientsMutex);
+    if (fClients.empty()) {
+      return;
+    }
+  }
+
+  size_t size = 0;
+  for (auto &event : events) {
+    size += PSD2Codec::EncodedSize(*event);
+  }
+  std::vector<uint8_t> payload(size);
+  size_t pos = 0;
+  for (auto &event : events) {
+    pos += PSD2Codec::Encode(*event, payload.data() + pos);
+  }
+
+  Broadcast(MakeFrame(EventFrameType::Events, events.size(), payload.data(),
+                      payload.size()),
+            events.size());
+}
+
+void EventServer::PublishRaw(const RawData_t &rawData)
+{
+  if (!fServerFlag) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(fClientsMutex);
+    if (fClients.empty()) {
+      return;
+    }
+  }
+
+  Broadcast(MakeFrame(EventFrameType::Raw, rawData.nEvents,
+                      rawData.data.data(), rawData.size),
+            rawData.nEvents);
+}
+
+std::vector<EventClientStats> EventServer::GetClientStats()
+{
+  std::vector<EventClientStats> stats;
+  std::lock_guard<std::mutex> lock(fClientsMutex);
+  for (auto &client : fClients) {
+    std::lock_guard<std::mutex> clientLock(client->mutex);
+    stats.push_back({client->address, client->sentFrames, client->sentBytes,
+                     client->droppedFrames, client->droppedEvents,
+                     client->queuedBytes});
+  }
+  return stats;
+}
+
+EventClient::~EventClient() { Close(); }
+
+bool EventClient::Connect(std::string host, uint16_t port)
+{
+  addrinfo hints{};
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  addrinfo *result = nullptr;
+  auto portStr = std::to_string(port);
+  if (getaddrinfo(host.c_str(), portStr.c_str(), &hints, &result) != 0) {
+    std::cerr << "Failed to resolve " << host << std::endl;
+    return false;
+  }
+
+  fSocket = socket(AF_INET, SOCK_STREAM, 0);
+  auto err = connect(fSocket, result->ai_addr, result->ai_addrlen);
+  freeaddrinfo(result);
+  if (err < 0) {
+    std::cerr << "Failed to connect " << host << ":" << port << std::endl;
+    Close();
+    return false;
+  }
+  fFirstFrame = true;
+
+  return true;
+}
+
+void EventClient::Close()
+{
+  if (fSocket >= 0) {
+    close(fSocket);
+    fSocket = -1;
+  }
+}
+
+bool EventClient::ReadAll(void *buf, size_t size)
+{
+  auto p = static_cast<uint8_t *>(buf);
+  while (size > 0) {
+    auto n = recv(fSocket, p, size, 0);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    p += n;
+    size -= n;
+  }
+  return true;
+}
+
+bool EventClient::Receive(EventFrameHeader &header,
+                          std::vector<uint8_t> &payload)
+{
+  if (fSocket < 0 || !ReadAll(&header, sizeof(header))) {
+    return false;
+  }
+  if (header.magic != kEventFrameMagic ||
+      header.version != kEventFrameVersion) {
+    std::cerr << "Unknown frame" << std::endl;
+    return false;
+  }
+
+  if (header.payloadSize > kEventFrameMaxPayload ||
+      header.rawSize > kEventFrameMaxPayload) {
+    std::cerr << "Frame too large: " << header.payloadSize << std::endl;
+    return false;
+  }
+
+  if (fFirstFrame || header.seq >= fNextSeq) {
+    if (!fFirstFrame) {
+      fLostFrames += header.seq - fNextSeq;
+    }
+    fNextSeq = header.seq + 1;
+  } else {
+    // Older than a frame already seen, not a loss
+    fReorderedFrames++;
+  }
+  fFirstFrame = false;
+
+  if (!(header.flags & kEventFrameLZ4)) {
+    payload.resize(header.payloadSize);
+    return ReadAll(payload.data(), payload.size());
+  }
+
+#ifdef USE_LZ4
+  fBuffer.resize(header.payloadSize);
+  if (!ReadAll(fBuffer.data(), fBuffer.size())) {
+    return false;
+  }
+  payload.resize(header.rawSize);
+  auto size = LZ4_decompress_safe(reinterpret_cast<const char *>(fBuffer.data()),
+                                  reinterpret_cast<char *>(payload.data()),
+                                  fBuffer.size(), payload.size());
+  return size >= 0 && uint64_t(size) == header.rawSize;
+#else
+  std::cerr << "Built without LZ4, can not read compressed frame" << std::endl;
+  return false;
+#endif
+}
+
+bool EventClient::ReceiveEvents(PSD2DataVec_t &events)
+{
+  EventFrameHeader header;
+  std::vector<uint8_t> payload;
+  while (Receive(header, payload)) {
+    if (header.type == static_cast<uint16_t>(EventFrameType::Events)) {
+      return PSD2Codec::DecodeAll(payload.data(), payload.size(), events);
+    }
+  }
+  return false;
+}
@@ -0,0 +1,159 @@
+#include "FlightRecorder.hpp"
+
+#include <chrono>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+FlightRecorder::FlightRecorder(size_t maxBytes, double maxSeconds,
+                               std::string directory)
+    : fMaxBytes(maxBytes), fDirectory(directory)
+{
+  fMaxTimeNs = static_cast<uint64_t>(maxSeconds * 1.e9);
+  // Allocate now, not during the run
+  fRing.buffer.resize(fMaxBytes);
+  fSpare.buffer.resize(fMaxBytes);
+  fLastAutoDump = std::chrono::steady_clock::time_point();
+
+  fDumpThread = std::thread(&FlightRecorder::DumpThread, this);
+}
+
+FlightRecorder::~FlightRecorder()
+{
+  {
+    std::lock_guard<std::mutex> lock(fDumpMutex);
+    fDumpFlag = false;
+  }
+  fDumpCondition.notify_all();
+  if (fDumpThread.joinable()) {
+    fDumpThread.join();
+  }
+}
+
+void FlightRecorder::Record(const RawData_t &rawData)
+{
+  auto size = rawData.size;
+  if (size == 0 || size > fMaxBytes) {
+    return;
+  }
+  uint64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                     std::chrono::system_clock::now().time_since_epoch())
+                     .count();
+
+  std::lock_guard<std::mutex> lock(fRingMutex);
+  auto &records = fRing.records;
+
+  // Too old
+  while (!records.empty() && fMaxTimeNs > 0 &&
+         records.front().timeNs + fMaxTimeNs < now) {
+    records.pop_front();
+  }
+
+  // Records never wrap.  The rest of the last lap is the oldest data.
+  if (fRing.head + size > fMaxBytes) {
+    while (!records.empty() && records.front().offset >= fRing.head) {
+      records.pop_front();
+    }
+    fRing.head = 0;
+  }
+  // Overwritten by this record
+  while (!records.empty() && records.front().offset >= fRing.head &&
+         records.front().offset < fRing.head + size) {
+    records.pop_front();
+  }
+
+  std::memcpy(fRing.buffer.data() + fRing.head, rawData.data.data(), size);
+  records.push_back({fRing.head, size, now});
+  fRing.head += size;
+}
+
+void FlightRecorder::Trigger(std::string reason, bool automatic)
+{
+  constexpr auto minInterval = std::chrono::seconds(10);
+  auto now = std::chrono::steady_clock::now();
+
+  {
+    std::lock_guard<std::mutex> lock(fDumpMutex);
+    if (fDumpRequest) {
+      return;  // One is already waiting
+    }
+    if (automatic) {
+      if (now - fLastAutoDump < minInterval) {
+        return;
+      }
+      fLastAutoDump = now;
+    }
+    fDumpReason = reason;
+    fDumpRequest = true;
+  }
+  fDumpCondition.notify_one();
+}
+
+void FlightRecorder::DumpThread()
+{
+  while (true) {
+    std::string reason;
+    {
+      std::unique_lock<std::mutex> lock(fDumpMutex);
+      fDumpCondition.wait(lock, [this] { return fDumpRequest || !fDumpFlag; });
+      if (!fDumpFlag) {
+        break;
+      }
+      reason = fDumpReason;
+    }
+
+    // Freeze the current ring, recording goes on in the spare one
+    {
+      std::lock_guard<std::mutex> lock(fRingMutex);
+      std::swap(fRing, fSpare);
+      fRing.records.clear();
+      fRing.head = 0;
+    }
+    WriteRing(fSpare, reason);
+    fSpare.records.clear();
+    fNDumps++;
+
+    {
+      std::lock_guard<std::mutex> lock(fDumpMutex);
+      fDumpRequest = false;
+    }
+  }
+}
+
+void FlightRecorder::WriteRing(const Ring_t &ring, std::string reason)
+{
+  auto now = std::chrono::system_clock::to_time_t(
+      std::chrono::system_clock::now());
+  std::tm tm;
+  localtime_r(&now, &tm);
+  std::ostringstream fileName;
+  fileName << fDirectory << "/flight_" << std::put_time(&tm, "%Y%m%d_%H%M%S")
+           << "_" << reason << ".dat";
+
+  std::ofstream file(fileName.str(), std::ios::binary);
+  if (!file) {
+    std::cerr << "Failed to open " << fileName.str() << std::endl;
+    return;
+  }
+
+  constexpr uint32_t magic = 0x52463244;  // "D2FR"
+  constexpr uint32_t version = 1;
+  uint64_t nRecords = ring.records.size();
+  file.write(reinterpret_cast<const char *>(&magic), sizeof(magic));
+  file.write(reinterpret_cast<const char *>(&version), sizeof(version));
+  file.write(reinterpret_cast<const char *>(&nRecords), sizeof(nRecords));
+  for (auto &record : ring.records) {
+    uint64_t size = record.size;
+    file.write(reinterpret_cast<const char *>(&record.timeNs),
+               sizeof(record.timeNs));
+    file.write(reinterpret_cast<const char *>(&size), sizeof(size));
+    file.write(reinterpret_cast<const char *>(ring.buffer.data() + record.offset),
+               record.size);
+  }
+
+  std::cout << "Flight recorder: " << nRecords << " aggregates to "
+            << fileName.str() << std::endl;
+}
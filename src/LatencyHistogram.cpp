@@ -0,0 +1,56 @@
+#include "LatencyHistogram.hpp"
+
+#include <algorithm>
+
+uint64_t LatencyHistogram::UpperEdge(uint32_t bin)
+{
+  if (bin < 16) {
+    return bin;
+  }
+  uint32_t exponent = (bin - 16) / 8 + 4;
+  uint64_t sub = (bin - 16) % 8;
+  uint64_t width = uint64_t(1) << (exponent - 3);
+  return (8 + sub) * width + width - 1;
+}
+
+void LatencyHistogram::Add(Counts_t &counts, uint64_t max)
+{
+  for (uint32_t i = 0; i < kNBins; i++) {
+    if (counts[i] > 0) {
+      fCounts[i].fetch_add(counts[i], std::memory_order_relaxed);
+      counts[i] = 0;
+    }
+  }
+  auto current = fMax.load();
+  while (max > current && !fMax.compare_exchange_weak(current, max)) {
+  }
+}
+
+LatencyStats_t LatencyHistogram::GetStats(bool reset)
+{
+  Counts_t counts;
+  LatencyStats_t stats;
+  for (uint32_t i = 0; i < kNBins; i++) {
+    counts[i] = reset ? fCounts[i].exchange(0) : fCounts[i].load();
+    stats.count += counts[i];
+  }
+  stats.maxNs = reset ? fMax.exchange(0) : fMax.load();
+  if (stats.count == 0) {
+    return stats;
+  }
+
+  // Smallest bin with at least the fraction of the counts below
+  const double fractions[] = {0.5, 0.9, 0.99, 0.999};
+  uint64_t *results[] = {&stats.p50Ns, &stats.p90Ns, &stats.p99Ns,
+                         &stats.p999Ns};
+  uint64_t sum = 0;
+  uint32_t iFraction = 0;
+  for (uint32_t i = 0; i < kNBins && iFraction < 4; i++) {
+    sum += counts[i];
+    while (iFraction < 4 && sum >= fractions[iFraction] * stats.count) {
+      *results[iFraction] = std::min(UpperEdge(i), stats.maxNs);
+      iFraction++;
+    }
+  }
+  return stats;
+}
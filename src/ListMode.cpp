@@ -0,0 +1,289 @@
+#include "ListMode.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+
+ListModeWriter::ListModeWriter(std::string fileName, double timeStep,
+                               uint32_t blockRecords)
+    : fFileName(fileName), fBlockRecords(blockRecords)
+{
+  if (fBlockRecords == 0) {
+    fBlockRecords = 65536;
+  }
+
+  fFile.open(fFileName, std::ios::binary | std::ios::trunc);
+  if (!fFile) {
+    std::cerr << "Failed to open list mode file " << fFileName << std::endl;
+    return;
+  }
+
+  ListModeFileHeader header{};
+  header.magic = kListModeMagic;
+  header.version = kListModeVersion;
+  header.recordSize = sizeof(ListModeRecord);
+  header.blockRecords = fBlockRecords;
+  header.timeStep = timeStep;
+  header.startTime = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                         std::chrono::system_clock::now().time_since_epoch())
+                         .count();
+  fFile.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  fOffset = sizeof(header);
+
+  fBlock.records.reserve(fBlockRecords);
+  fWriteThread = std::thread(&ListModeWriter::WriteThread, this);
+}
+
+ListModeWriter::~ListModeWriter() { Close(); }
+
+void ListModeWriter::Write(const PSD2DataVec_t &events)
+{
+  if (!fFile.is_open() || events.empty()) {
+    return;
+  }
+
+  // Pack outside of the lock
+  thread_local std::vector<ListModeRecord> packed;
+  packed.resize(events.size());
+  for (size_t i = 0; i < events.size(); i++) {
+    auto &event = *events[i];
+    auto &record = packed[i];
+    record.timeStamp = event.timeStamp;
+    record.aggregateCounter = event.aggregateCounter;
+    record.fineTimeStamp = event.fineTimeStamp;
+    record.energy = event.energy;
+    record.energyShort = event.energyShort;
+    record.flagsLowPriority = event.flagsLowPriority;
+    record.flagsHighPriority = static_cast<uint8_t>(event.flagsHighPriority);
+    record.channel = event.channel;
+    record.boardFail = event.boardFail;
+    record.reserved = 0;
+  }
+
+  std::lock_guard<std::mutex> lock(fBlockMutex);
+  size_t done = 0;
+  while (done < packed.size()) {
+    auto n = std::min<size_t>(packed.size() - done,
+                              fBlockRecords - fBlock.records.size());
+    for (size_t i = done; i < done + n; i++) {
+      fBlock.minTimeStamp = std::min(fBlock.minTimeStamp, packed[i].timeStamp);
+      fBlock.maxTimeStamp = std::max(fBlock.maxTimeStamp, packed[i].timeStamp);
+    }
+    fBlock.records.insert(fBlock.records.end(), packed.begin() + done,
+                          packed.begin() + done + n);
+    done += n;
+    if (fBlock.records.size() >= fBlockRecords) {
+      PushBlock();
+    }
+  }
+  fNRecords += packed.size();
+}
+
+// fBlockMutex must be locked
+void ListModeWriter::PushBlock()
+{
+  std::unique_lock<std::mutex> lock(fQueueMutex);
+  fQueue.push_back(std::move(fBlock));
+  fBlock = Block_t();
+  if (!fBufferPool.empty()) {
+    fBlock.records = std::move(fBufferPool.back());
+    fBufferPool.pop_back();
+  }
+  lock.unlock();
+  fQueueCondition.notify_one();
+
+  fBlock.records.clear();
+  fBlock.records.reserve(fBlockRecords);
+}
+
+void ListModeWriter::WriteThread()
+{
+  while (true) {
+    Block_t block;
+    {
+      std::unique_lock<std::mutex> lock(fQueueMutex);
+      fQueueCondition.wait(lock,
+                           [this] { return !fQueue.empty() || !fWriteFlag; });
+      if (fQueue.empty()) {
+        break;  // Stopped and nothing left
+      }
+      block = std::move(fQueue.front());
+      fQueue.pop_front();
+    }
+
+    auto size = block.records.size() * sizeof(ListModeRecord);
+    fFile.write(reinterpret_cast<const char *>(block.records.data()), size);
+    fIndex.push_back({fOffset, block.records.size(), block.minTimeStamp,
+                      block.maxTimeStamp});
+    fOffset += size;
+
+    std::lock_guard<std::mutex> lock(fQueueMutex);
+    if (fBufferPool.size() < 4) {
+      fBufferPool.push_back(std::move(block.records));
+    }
+  }
+}
+
+void ListModeWriter::Close()
+{
+  if (!fWriteThread.joinable()) {
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(fBlockMutex);
+    if (!fBlock.records.empty()) {
+      PushBlock();
+    }
+  }
+  {
+    std::lock_guard<std::mutex> lock(fQueueMutex);
+    fWriteFlag = false;
+  }
+  fQueueCondition.notify_all();
+  fWriteThread.join();
+
+  ListModeFileFooter footer{};
+  footer.indexOffset = fOffset;
+  footer.nBlocks = fIndex.size();
+  footer.nRecords = fNRecords;
+  footer.magic = kListModeFooterMagic;
+  footer.version = kListModeVersion;
+  fFile.write(reinterpret_cast<const char *>(fIndex.data()),
+              fIndex.size() * sizeof(ListModeBlockIndex));
+  fFile.write(reinterpret_cast<const char *>(&footer), sizeof(footer));
+  fFile.close();
+  if (!fFile) {
+    std::cerr << "Failed to write list mode file " << fFileName << std::endl;
+  }
+}
+
+ListModeReader::ListModeReader(std::string fileName)
+{
+  auto fd = open(fileName.c_str(), O_RDONLY);
+  if (fd < 0) {
+    std::cerr << "Failed to open list mode file " << fileName << std::endl;
+    return;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 ||
+      st.st_size < static_cast<off_t>(sizeof(ListModeFileHeader) +
+                                      sizeof(ListModeFileFooter))) {
+    std::cerr << "Too small list mode file " << fileName << std::endl;
+    close(fd);
+    return;
+  }
+
+  fMemorySize = st.st_size;
+  auto memory = mmap(nullptr, fMemorySize, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (memory == MAP_FAILED) {
+    std::cerr << "Failed to map list mode file " << fileName << std::endl;
+    return;
+  }
+  madvise(memory, fMemorySize, MADV_SEQUENTIAL);
+  fMemory = static_cast<const uint8_t *>(memory);
+
+  fHeader = reinterpret_cast<const ListModeFileHeader *>(fMemory);
+  fFooter = reinterpret_cast<const ListModeFileFooter *>(
+      fMemory + fMemorySize - sizeof(ListModeFileFooter));
+  auto indexEnd = fMemorySize - sizeof(ListModeFileFooter);
+  auto valid = fHeader->magic == kListModeMagic &&
+               fHeader->version == kListModeVersion &&
+               fHeader->recordSize == sizeof(ListModeRecord) &&
+               fFooter->magic == kListModeFooterMagic &&
+               fFooter->indexOffset <= indexEnd &&
+               fFooter->nBlocks == (indexEnd - fFooter->indexOffset) /
+                                       sizeof(ListModeBlockIndex);
+  if (valid) {
+    fIndex = reinterpret_cast<const ListModeBlockIndex *>(
+        fMemory + fFooter->indexOffset);
+    for (uint64_t i = 0; i < fFooter->nBlocks; i++) {
+      valid &= fIndex[i].offset >= sizeof(ListModeFileHeader) &&
+               fIndex[i].offset +
+                       fIndex[i].nRecords * sizeof(ListModeRecord) <=
+                   fFooter->indexOffset;
+    }
+  }
+  if (!valid) {
+    std::cerr << "Invalid list mode file " << fileName << std::endl;
+    munmap(memory, fMemorySize);
+    fMemory = nullptr;
+    return;
+  }
+
+  auto nBlocks = fFooter->nBlocks;
+  fMaxUntil.resize(nBlocks);
+  fMinFrom.resize(nBlocks);
+  uint64_t maxTime = 0;
+  for (uint64_t i = 0; i < nBlocks; i++) {
+    maxTime = std::max(maxTime, fIndex[i].maxTimeStamp);
+    fMaxUntil[i] = maxTime;
+  }
+  uint64_t minTime = UINT64_MAX;
+  for (uint64_t i = nBlocks; i > 0; i--) {
+    minTime = std::min(minTime, fIndex[i - 1].minTimeStamp);
+    fMinFrom[i - 1] = minTime;
+  }
+}
+
+ListModeReader::~ListModeReader()
+{
+  if (fMemory) {
+    munmap(const_cast<uint8_t *>(fMemory), fMemorySize);
+  }
+}
+
+void ListModeReader::FindBlocks(uint64_t start, uint64_t end, uint64_t &first,
+                                uint64_t &last)
+{
+  // Blocks before first have only events older than start,
+  // blocks from last have only events newer than end
+  first = std::lower_bound(fMaxUntil.begin(), fMaxUntil.end(), start) -
+          fMaxUntil.begin();
+  last = std::upper_bound(fMinFrom.begin(), fMinFrom.end(), end) -
+         fMinFrom.begin();
+  if (last < first) {
+    last = first;
+  }
+}
+
+std::vector<uint64_t> ListModeReader::EnergySpectrum(uint8_t channel,
+                                                     uint64_t start,
+                                                     uint64_t end,
+                                                     bool shortGate)
+{
+  constexpr size_t nBins = 65536;
+  std::vector<uint64_t> spectrum(nBins, 0);
+  uint64_t first, last;
+  FindBlocks(start, end, first, last);
+
+#pragma omp parallel
+  {
+    std::vector<uint64_t> local(nBins, 0);
+#pragma omp for schedule(dynamic) nowait
+    for (uint64_t i = first; i < last; i++) {
+      auto records = GetBlock(i);
+      auto n = fIndex[i].nRecords;
+      for (uint64_t j = 0; j < n; j++) {
+        auto &record = records[j];
+        if (record.channel == channel && record.timeStamp >= start &&
+            record.timeStamp <= end) {
+          local[shortGate ? record.energyShort : record.energy]++;
+        }
+      }
+    }
+#pragma omp critical
+    for (size_t k = 0; k < nBins; k++) {
+      spectrum[k] += local[k];
+    }
+  }
+
+  return spectrum;
+}
@@ -2,13 +2,41 @@
 
 #include <CAEN_FELib.h>
 
+#include <algorithm>
 #include <bitset>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
 #include <fstream>
 #include <iostream>
+#include <set>
+#include <sstream>
+
+#include "AsyncLog.hpp"
+#include "ChannelRange.hpp"
+
+namespace
+{
+// Add the channels of "0..3" or "5" to the mask
+bool ParseChannels(const std::string &token, ChannelMask_t &channels)
+{
+  uint32_t first = 0;
+  uint32_t last = 0;
+  if (!ParseChannelRange(token, first, last)) {
+    std::cerr << "Invalid channels: " << token << std::endl;
+    return false;
+  }
+  for (auto ch = first; ch <= last && ch < kNChannelShards; ch++) {
+    channels[ch] = true;
+  }
+  return true;
+}
+}  // namespace
 
 PSD2::PSD2() {}
 PSD2::~PSD2()
 {
+  ShutdownPipeline();
   SendCommand("/cmd/Reset");
   Close();
 }
@@ -30,6 +58,14 @@ void PSD2::LoadConfig(std::string path)
     exit(1);
   }
 
+  fConfig.clear();
+  fWaveformWindows.fill(WaveformWindow_t());
+  fFilterRules.clear();
+  fFlightRecorderTriggers.clear();
+  auto monitor = std::atomic_load(&fWaveformMonitor);
+  if (monitor) {
+    monitor->SetChannels(ChannelMask_t());
+  }
   std::string line;
   while (std::getline(configFile, line)) {
     if (line[0] == '#' || line.size() == 0) {
@@ -57,6 +93,150 @@ void PSD2::LoadConfig(std::string path)
       if (fNThreads < 1) {
         fNThreads = 1;
       }
+    } else if (key == "LogFile") {
+      AsyncLog::Get().SetOutput(value);
+    } else if (key == "LogRateLimit") {
+      AsyncLog::Get().SetRateLimit(std::stoul(value));
+    } else if (key == "LogDumpKBps") {
+      AsyncLog::Get().SetDumpLimit(std::stoull(value) * 1024);
+    } else if (key == "DecodeThreads") {
+      fNDecodeThreads = std::stoul(value);
+    } else if (key == "DecodeThreadsMin") {
+      fMinDecodeThreads = std::stoul(value);
+    } else if (key == "DecodeLatencyUs") {
+      fDecodeLatencyUs = std::stoul(value);
+    } else if (key == "DecodeOMPThreads") {
+      fNOMPThreads = std::stoi(value);
+    } else if (key == "SafeDecode") {
+      std::transform(value.begin(), value.end(), value.begin(), ::tolower);
+      fSafeDecodeFlag = (value == "true" || value == "1" || value == "yes");
+    } else if (key == "QuarantineFile") {
+      fQuarantineFile = value;
+    } else if (key == "LowLatency") {
+      std::transform(value.begin(), value.end(), value.begin(), ::tolower);
+      fLowLatencyFlag = (value == "true" || value == "1" || value == "yes");
+    } else if (key == "LowLatencyEvents") {
+      fLowLatencyEvents = std::max<size_t>(1, std::stoul(value));
+    } else if (key == "LowLatencyReadTimeoutMs") {
+      fLowLatencyReadTimeoutMs = std::max(0, std::stoi(value));
+    } else if (key == "LatencyReport") {
+      std::transform(value.begin(), value.end(), value.begin(), ::tolower);
+      fLatencyReportFlag =
+          (value == "true" || value == "1" || value == "yes");
+    } else if (key == "SpillFile") {
+      fSpillFile = value;
+    } else if (key == "SpillFileMB") {
+      fSpillFileSize = std::stoull(value) * 1024 * 1024;
+    } else if (key == "SpillQueueMB") {
+      fSpillQueueSize = std::stoull(value) * 1024 * 1024;
+    } else if (key == "SpillOutputEvents") {
+      fSpillOutputEvents = std::stoull(value);
+    } else if (key == "EventRing") {
+      fEventRingName = value;
+    } else if (key == "EventRingSlots") {
+      fEventRingSlots = std::stoull(value);
+    } else if (key == "EventRingSlotSize") {
+      fEventRingSlotSize = std::stoull(value);
+    } else if (key == "ServerPort") {
+      fServerPort = std::stoi(value);
+    } else if (key == "ServerData") {
+      std::transform(value.begin(), value.end(), value.begin(), ::tolower);
+      fServerRawFlag = (value == "raw");
+    } else if (key == "ServerCompress") {
+      std::transform(value.begin(), value.end(), value.begin(), ::tolower);
+      fServerCompress = (value == "true" || value == "1" || value == "yes");
+    } else if (key == "ServerQueueMB") {
+      fServerQueueSize = std::stoull(value) * 1024 * 1024;
+    } else if (key == "ListModeFile") {
+      fListModeFile = value;
+    } else if (key == "ListModeBlockRecords") {
+      fListModeBlockRecords = std::stoul(value);
+    } else if (key == "DisplayChannels") {
+      // "0..3" or "0 5 7"
+      ChannelMask_t channels;
+      std::istringstream tokens(value);
+      std::string token;
+      while (tokens >> token) {
+        ParseChannels(token, channels);
+      }
+      if (!monitor) {
+        monitor = std::make_shared<WaveformMonitor>();
+        std::atomic_store(&fWaveformMonitor, monitor);
+      }
+      monitor->SetChannels(channels);
+    } else if (key == "DisplayIntervalMs") {
+      if (!monitor) {
+        monitor = std::make_shared<WaveformMonitor>();
+        std::atomic_store(&fWaveformMonitor, monitor);
+      }
+      monitor->SetInterval(std::stoul(value));
+    } else if (key == "WaveformWindow") {
+      // "0..31 pre post [trigger sample or D1..D4]"
+      std::istringstream tokens(value);
+      std::string channels, reference;
+      uint32_t pre = 0, post = 0;
+      if (!(tokens >> channels >> pre >> post)) {
+        std::cerr << "Invalid WaveformWindow: " << value << std::endl;
+        continue;
+      }
+      tokens >> reference;
+      ChannelMask_t mask;
+      if (!ParseChannels(channels, mask)) {
+        continue;
+      }
+      for (uint32_t ch = 0; ch < kNChannelShards; ch++) {
+        if (!mask[ch]) continue;
+        auto &window = fWaveformWindows[ch];
+        window.pre = pre;
+        window.post = post;
+        if (reference.size() == 2 && (reference[0] == 'D' ||
+                                      reference[0] == 'd')) {
+          window.probe = std::clamp(reference[1] - '0', 1, 4);
+        } else if (reference != "") {
+          window.trigger = std::stoul(reference);
+          window.probe = 0;
+        }
+      }
+    } else if (key == "WaveformDecimation") {
+      // "0..31 factor"
+      std::istringstream tokens(value);
+      std::string channels;
+      uint32_t factor = 1;
+      if (!(tokens >> channels >> factor)) {
+        std::cerr << "Invalid WaveformDecimation: " << value << std::endl;
+        continue;
+      }
+      // downSampleFactor (uint8) is multiplied by it, up to 8 * 31
+      factor = std::clamp<uint32_t>(factor, 1, 31);
+      ChannelMask_t mask;
+      if (!ParseChannels(channels, mask)) {
+        continue;
+      }
+      for (uint32_t ch = 0; ch < kNChannelShards; ch++) {
+        if (mask[ch]) fWaveformWindows[ch].decimation = factor;
+      }
+    } else if (key == "Filter") {
+      fFilterRules.push_back(value);
+    } else if (key == "CalibrationFile") {
+      fCalibrationFile = value;
+    } else if (key == "FlightRecorderMB") {
+      fFlightRecorderSize = std::stoull(value) * 1024 * 1024;
+    } else if (key == "FlightRecorderSeconds") {
+      fFlightRecorderSeconds = std::stod(value);
+    } else if (key == "FlightRecorderDir") {
+      fFlightRecorderDir = value;
+    } else if (key == "FlightRecorderTrigger") {
+      // Decode error names, e.g. "BoardFail CounterGap"
+      std::istringstream names(value);
+      std::string name;
+      while (names >> name) {
+        auto nErrors = static_cast<uint32_t>(DecodeError::NumberOfErrors);
+        for (uint32_t i = 0; i < nErrors; i++) {
+          if (RawToPSD2::GetErrorName(static_cast<DecodeError>(i)) == name) {
+            fFlightRecorderTriggers.push_back(static_cast<DecodeError>(i));
+          }
+        }
+      }
     } else {
       fConfig.push_back({key, value});
     }
@@ -96,12 +276,105 @@ bool PSD2::Close()
 bool PSD2::Configure()
 {
   SendCommand("/cmd/Reset");
+  fArmed = false;
 
   auto status = true;
   for (auto &config : fConfig) {
     status &= SetParameter(config[0], config[1]);
   }
 
+  status &= ReadDataSize();
+  status &= EndpointConfigure();
+
+  // Fill the cache with one bulk read for the next Reconfigure
+  if (ReadParameterTree()) {
+    fAppliedConfig = fConfig;
+  } else {
+    fParameterCache.clear();
+  }
+
+  status &= SendCommand("/cmd/ArmAcquisition");
+  fArmed = status;
+
+  return status;
+}
+
+bool PSD2::Reconfigure()
+{
+  // A line removed from the config can not be reverted without knowing the
+  // default value.  Fall back to the full reset in that case.
+  std::set<std::string> newKeys;
+  for (auto &config : fConfig) {
+    newKeys.insert(config[0]);
+  }
+  auto needReset = fParameterCache.empty();
+  for (auto &config : fAppliedConfig) {
+    if (newKeys.find(config[0]) == newKeys.end()) {
+      needReset = true;
+      break;
+    }
+  }
+  if (needReset) {
+    std::cout << "Parameter cache is not usable, full configure" << std::endl;
+    return Configure();
+  }
+
+  auto startTime = std::chrono::steady_clock::now();
+  auto status = true;
+  if (fArmed) {
+    status &= SendCommand("/cmd/DisarmAcquisition");
+    fArmed = false;
+  }
+  uint32_t nSent = 0;
+  for (auto &config : fConfig) {
+    auto paths = ExpandPath(config[0]);
+    std::vector<std::string> changed;
+    for (auto &path : paths) {
+      auto it = fParameterCache.find(path);
+      if (it == fParameterCache.end() || !IsSameValue(it->second, config[1])) {
+        changed.push_back(path);
+      }
+    }
+    if (changed.empty()) {
+      continue;
+    }
+
+    if (changed.size() == paths.size()) {
+      // Range path (e.g. /ch/0..31/...) is set by one call
+      status &= SetParameter(config[0], config[1]);
+      nSent++;
+    } else {
+      for (auto &path : changed) {
+        status &= SetParameter(path, config[1]);
+        nSent++;
+      }
+    }
+    for (auto &path : changed) {
+      fParameterCache[path] = config[1];
+    }
+  }
+
+  if (!status) {
+    std::cerr << "Reconfigure failed, full configure" << std::endl;
+    return Configure();
+  }
+  fAppliedConfig = fConfig;
+
+  status &= ReadDataSize();
+  status &= SendCommand("/cmd/ArmAcquisition");
+  fArmed = status;
+
+  auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(
+                      std::chrono::steady_clock::now() - startTime)
+                      .count();
+  std::cout << "Reconfigure: " << nSent << " parameters sent in " << duration
+            << " ms" << std::endl;
+
+  return status;
+}
+
+bool PSD2::ReadDataSize()
+{
   std::string buf;
   GetParameter("/ch/0/par/ChRecordLengthT", buf);
   auto rl = std::stoi(buf);
@@ -112,37 +385,155 @@ bool PSD2::Configure()
   fRecordLength = rl;
   std::cout << "Record length: " << fRecordLength << std::endl;
 
-  status &= EndpointConfigure();
-
   GetParameter("/par/MaxRawDataSize", buf);
   fMaxRawDataSize = std::stoi(buf);
   std::cout << "Max raw data size: " << fMaxRawDataSize << std::endl;
 
-  status &= SendCommand("/cmd/ArmAcquisition");
+  return true;
+}
 
-  return status;
+bool PSD2::ReadParameterTree()
+{
+  auto size = CAEN_FELib_GetDeviceTree(fHandle, nullptr, 0);
+  if (size < 0) {
+    CheckError(size);
+    return false;
+  }
+  std::string buf(size + 1, '\0');
+  auto err = CAEN_FELib_GetDeviceTree(fHandle, buf.data(), buf.size());
+  if (err < 0) {
+    CheckError(err);
+    return false;
+  }
+
+  auto tree = nlohmann::json::parse(buf.c_str(), nullptr, false);
+  if (tree.is_discarded()) {
+    std::cerr << "Failed to parse the device tree" << std::endl;
+    return false;
+  }
+
+  fParameterCache.clear();
+  FillParameterCache(tree, "");
+  std::cout << "Parameter cache: " << fParameterCache.size() << " parameters"
+            << std::endl;
+
+  return !fParameterCache.empty();
+}
+
+void PSD2::FillParameterCache(const nlohmann::json &node, std::string path)
+{
+  if (!node.is_object()) {
+    return;
+  }
+
+  // Parameter node has its value, others are folders
+  auto value = node.find("value");
+  if (value != node.end() && value->is_string()) {
+    fParameterCache[path] = value->get<std::string>();
+    return;
+  }
+
+  for (auto &[key, child] : node.items()) {
+    if (child.is_object()) {
+      auto name = key;
+      std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+      FillParameterCache(child, path + "/" + name);
+    }
+  }
+}
+
+std::vector<std::string> PSD2::ExpandPath(std::string path)
+{
+  // "/ch/0..31/par/X" -> "/ch/0/par/x", ..., "/ch/31/par/x"
+  std::transform(path.begin(), path.end(), path.begin(), ::tolower);
+  std::vector<std::string> paths{""};
+  size_t pos = 0;
+  while (pos < path.size()) {
+    auto next = path.find('/', pos + 1);
+    if (next == std::string::npos) next = path.size();
+    auto token = path.substr(pos, next - pos);
+    pos = next;
+
+    auto range = token.find("..");
+    if (range == std::string::npos) {
+      for (auto &p : paths) p += token;
+      continue;
+    }
+
+    auto first = std::stoi(token.substr(1, range - 1));
+    auto last = std::stoi(token.substr(range + 2));
+    std::vector<std::string> expanded;
+    for (auto &p : paths) {
+      for (auto i = first; i <= last; i++) {
+        expanded.push_back(p + "/" + std::to_string(i));
+      }
+    }
+    paths.swap(expanded);
+  }
+
+  return paths;
+}
+
+bool PSD2::IsSameValue(std::string a, std::string b)
+{
+  std::transform(a.begin(), a.end(), a.begin(), ::tolower);
+  std::transform(b.begin(), b.end(), b.begin(), ::tolower);
+  if (a == b) {
+    return true;
+  }
+
+  // The firmware may return "20.000" for "20"
+  char *endA = nullptr;
+  char *endB = nullptr;
+  auto valA = std::strtod(a.c_str(), &endA);
+  auto valB = std::strtod(b.c_str(), &endB);
+  if (endA == a.c_str() || *endA != '\0' || endB == b.c_str() ||
+      *endB != '\0') {
+    return false;
+  }
+
+  return std::fabs(valA - valB) <= 1e-9 * std::max(1., std::fabs(valA));
 }
 
 bool PSD2::StartAcquisition()
 {
   std::cout << "Start acquisition" << std::endl;
 
-  fRawToPSD2 = std::make_unique<RawToPSD2>(fNThreads);
-  std::string buf;
-  auto sampleRate = 0;
-  GetParameter("/par/ADC_SamplRate", buf);
-  sampleRate = std::stoi(buf);
-  auto timeStep = 1000 / sampleRate;
-  fRawToPSD2->SetTimeStep(timeStep);
+  // Events not taken since the last stop are dropped with the old pipeline
+  if (fRawToPSD2) {
+    std::string changed;
+    for (auto &[key, value] : GetPipelineConfig()) {
+      if (fPipelineConfig[key] != value) {
+        changed += " " + key;
+      }
+    }
+    if (changed != "") {
+      std::cout << "Rebuild the pipeline for:" << changed << std::endl;
+      ShutdownPipeline();
+    }
+  }
+  if (!fRawToPSD2) {
+    BuildPipeline();
+  }
+  ApplyRunSettings();
+  if (fListModeFile != "") {
+    OpenListModeFile();
+  }
 
-  fDataTakingFlag = true;
-  for (uint32_t i = 0; i < fNThreads; i++) {
-    fReadDataThreads.emplace_back(&PSD2::ReadDataThread, this);
+  auto status = true;
+  if (!fArmed) {
+    status &= SendCommand("/cmd/ArmAcquisition");
+    fArmed = status;
   }
 
-  fRawToPSD2->SetDumpFlag(fDebugFlag);
+  {
+    std::lock_guard<std::mutex> lock(fRunStateMutex);
+    fStopSeen = false;
+    fRunState = RunState::Running;
+    fDataTakingFlag = true;
+  }
+  fRunStateCondition.notify_all();
 
-  auto status = true;
   status &= SendCommand("/cmd/SwStartAcquisition");
   return status;
 }
@@ -150,27 +541,375 @@ bool PSD2::StartAcquisition()
 bool PSD2::StopAcquisition()
 {
   std::cout << "Stop acquisition" << std::endl;
+  if (GetRunState() == RunState::Idle) {
+    return true;
+  }
 
   auto status = SendCommand("/cmd/SwStopAcquisition");
+
+  // The Stop record is the last data of the run
+  {
+    std::unique_lock<std::mutex> lock(fRunStateMutex);
+    fRunState = RunState::Draining;
+    auto stopSeen = fRunStateCondition.wait_for(
+        lock, std::chrono::seconds(5), [this] { return fStopSeen; });
+    if (!stopSeen) {
+      std::cerr << "Stop record is not received" << std::endl;
+    }
+  }
+
+  // Park the read threads, then wait for the decoders
+  {
+    std::unique_lock<std::mutex> lock(fRunStateMutex);
+    fDataTakingFlag = false;
+    fRunStateCondition.wait(lock, [this] {
+      return fNParkedThreads == fReadDataThreads.size();
+    });
+  }
+  if (fRawToPSD2) {
+    fRawToPSD2->WaitForDrain();
+    CloseListModeFile();
+    AsyncLog::Get().Flush();
+    PrintDecodeErrors();
+    PrintFilterStats();
+  }
+
+  // Rearm at once for the next run
   status &= SendCommand("/cmd/DisarmAcquisition");
+  status &= SendCommand("/cmd/ArmAcquisition");
+  fArmed = status;
+
+  {
+    std::lock_guard<std::mutex> lock(fRunStateMutex);
+    fRunState = RunState::Idle;
+  }
+
+  return status;
+}
+
+bool PSD2::ReloadCalibration()
+{
+  if (!fRawToPSD2 || fCalibrationFile == "") {
+    return false;
+  }
+
+  auto calibration = std::make_shared<PSD2Calibration>();
+  if (!calibration->Load(fCalibrationFile)) {
+    return false;
+  }
+  fRawToPSD2->GetPolicy().SetCalibration(calibration);
+  std::cout << "Calibration loaded: " << fCalibrationFile << std::endl;
+
+  return true;
+}
 
+void PSD2::DumpFlightRecorder()
+{
+  if (fFlightRecorder) {
+    fFlightRecorder->Trigger("operator", false);
+  } else {
+    std::cerr << "Flight recorder is not enabled" << std::endl;
+  }
+}
+
+SpillStats_t PSD2::GetSpillStats()
+{
+  if (!fRawToPSD2) {
+    return SpillStats_t();
+  }
+  return fRawToPSD2->GetSpillStats();
+}
+
+LatencyStats_t PSD2::GetLatencyStats(bool reset)
+{
+  if (!fRawToPSD2) {
+    return LatencyStats_t();
+  }
+  return fRawToPSD2->GetLatencyStats(reset);
+}
+
+RawToPSD2::ScaleStats_t PSD2::GetDecodeStats()
+{
+  if (!fRawToPSD2) {
+    return RawToPSD2::ScaleStats_t();
+  }
+  return fRawToPSD2->GetScaleStats();
+}
+
+void PSD2::PrintDecodeErrors()
+{
+  // Counted since the pipeline was built
+  for (uint32_t i = 0; i < static_cast<uint32_t>(DecodeError::NumberOfErrors);
+       i++) {
+    auto error = static_cast<DecodeError>(i);
+    auto count = fRawToPSD2->GetErrorCount(error);
+    if (count > 0) {
+      std::cout << "Decode error " << RawToPSD2::GetErrorName(error) << ": "
+                << count << std::endl;
+    }
+  }
+
+  auto discarded = fRawToPSD2->GetDiscardedEvents();
+  if (discarded > 0) {
+    std::cout << "Events of channels without consumer: " << discarded
+              << std::endl;
+  }
+
+  auto spill = fRawToPSD2->GetSpillStats();
+  if (spill.nDropped > 0) {
+    std::cout << "Spill file full, dropped aggregates: " << spill.nDropped
+              << std::endl;
+  }
+}
+
+void PSD2::OpenListModeFile()
+{
+  // run.d2lm -> run_0000.d2lm, the first number without a file
+  auto dot = fListModeFile.rfind('.');
+  auto slash = fListModeFile.rfind('/');
+  if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+    dot = fListModeFile.size();
+  }
+  std::string fileName;
   while (true) {
-    if (CAEN_FELib_HasData(fReadDataHandle, 100) == CAEN_FELib_Timeout) {
+    char number[16];
+    std::snprintf(number, sizeof(number), "_%04u", fListModeRun++);
+    fileName =
+        fListModeFile.substr(0, dot) + number + fListModeFile.substr(dot);
+    if (!std::ifstream(fileName).good()) {
       break;
-    } else {
-      std::this_thread::sleep_for(std::chrono::milliseconds(1));
     }
   }
 
-  fDataTakingFlag = false;
+  auto writer = std::make_shared<ListModeWriter>(fileName, fTimeStep,
+                                                 fListModeBlockRecords);
+  if (writer->IsOpen()) {
+    std::cout << "List mode file: " << fileName << std::endl;
+  } else {
+    writer.reset();
+  }
+  std::atomic_store(&fListModeWriter, writer);
+}
+
+void PSD2::CloseListModeFile()
+{
+  // Called with the decoders drained, the writer closes the file
+  auto writer = std::atomic_exchange(&fListModeWriter,
+                                     std::shared_ptr<ListModeWriter>());
+  if (writer) {
+    std::cout << "List mode records: " << writer->GetNRecords() << std::endl;
+  }
+}
+
+void PSD2::ApplyRunSettings()
+{
+  // The decoders are idle, the next aggregate uses the new filter
+  fFilter.reset();
+  if (!fFilterRules.empty()) {
+    fFilter = std::make_shared<PSD2Filter>();
+    for (auto &rule : fFilterRules) {
+      fFilter->AddRule(rule);
+    }
+  }
+  fRawToPSD2->GetPolicy().SetFilter(fFilter);
+
+  fRawToPSD2->GetPolicy().SetWaveformWindows(fWaveformWindows);
+
+  fRawToPSD2->SetDumpFlag(fDebugFlag);
+  fRawToPSD2->SetOMPThreads(fNOMPThreads);
+  fRawToPSD2->SetSafeDecode(fSafeDecodeFlag);
+  fRawToPSD2->SetQuarantineFile(fQuarantineFile);
+  auto nDecodeThreads = (fNDecodeThreads > 0) ? fNDecodeThreads : fNThreads;
+  auto minDecodeThreads = (fMinDecodeThreads > 0)
+                              ? std::min(fMinDecodeThreads, nDecodeThreads)
+                              : nDecodeThreads;
+  fRawToPSD2->SetAutoScale(minDecodeThreads,
+                           std::chrono::microseconds(fDecodeLatencyUs));
+
+  // Low latency mode: events published in small batches, short read
+  // timeout, and the read buffers of MaxRawDataSize (changed by a
+  // Reconfigure) allocated now for the reads in flight.  The callback
+  // does not wait for more than one published batch.
+  fRawToPSD2->SetPublishEvents(fLowLatencyFlag ? fLowLatencyEvents : 0);
+  fRawToPSD2->SetLatencyReport(fLowLatencyFlag || fLatencyReportFlag);
+  constexpr int readTimeOut = 10;
+  fReadTimeOut = fLowLatencyFlag ? fLowLatencyReadTimeoutMs : readTimeOut;
+  fReadIdleSleepUs = fLowLatencyFlag ? 50 : 1000;
+  if (fLowLatencyFlag) {
+    fRawToPSD2->ReserveRawBuffers(2 * (fNThreads + nDecodeThreads),
+                                  fMaxRawDataSize);
+  }
+  fCallbackBatchEvents = fLowLatencyFlag
+                             ? std::min(fCallbackMinEvents, fLowLatencyEvents)
+                             : fCallbackMinEvents;
+}
+
+void PSD2::PrintFilterStats()
+{
+  if (!fFilter) {
+    return;
+  }
+  // Events tested by each rule, counted since the run start
+  for (auto &stats : fFilter->GetStats()) {
+    std::cout << "Filter " << stats.rule << ": accepted " << stats.nAccepted
+              << ", rejected " << stats.nRejected << std::endl;
+  }
+}
+
+RunState PSD2::GetRunState()
+{
+  std::lock_guard<std::mutex> lock(fRunStateMutex);
+  return fRunState;
+}
+
+void PSD2::BuildPipeline()
+{
+  auto nDecodeThreads = (fNDecodeThreads > 0) ? fNDecodeThreads : fNThreads;
+  fRawToPSD2 = std::make_unique<RawToPSD2>(nDecodeThreads);
+  fPipelineConfig = GetPipelineConfig();
+  std::string buf;
+  auto sampleRate = 0;
+  GetParameter("/par/ADC_SamplRate", buf);
+  sampleRate = std::stoi(buf);
+  auto timeStep = 1000 / sampleRate;
+  fTimeStep = timeStep;
+  fRawToPSD2->SetTimeStep(timeStep);
+  if (fSpillFile != "") {
+    fRawToPSD2->SetSpill(fSpillFile, fSpillFileSize, fSpillQueueSize,
+                         fSpillOutputEvents);
+  }
+  if (fCalibrationFile != "") {
+    ReloadCalibration();
+  }
+
+  if (fEventRingName != "") {
+    fEventRing = std::make_unique<EventRingWriter>(
+        fEventRingName, fEventRingSlots, fEventRingSlotSize);
+    if (fEventRing->IsOpen()) {
+      auto ring = fEventRing.get();
+      fRawToPSD2->AddBatchObserver(
+          [ring](const PSD2DataVec_t &events) { ring->Publish(events); });
+    }
+  }
+
+  // Created by the first LoadConfig with DisplayChannels, also a reload
+  fRawToPSD2->AddBatchObserver([this](const PSD2DataVec_t &events) {
+    auto monitor = std::atomic_load(&fWaveformMonitor);
+    if (monitor) {
+      monitor->Offer(events);
+    }
+  });
+
+  // The file of the current run, opened at every start
+  fRawToPSD2->AddBatchObserver([this](const PSD2DataVec_t &events) {
+    auto writer = std::atomic_load(&fListModeWriter);
+    if (writer) {
+      writer->Write(events);
+    }
+  });
+
+  if (fFlightRecorderSize > 0) {
+    fFlightRecorder = std::make_unique<FlightRecorder>(
+        fFlightRecorderSize, fFlightRecorderSeconds, fFlightRecorderDir);
+    auto recorder = fFlightRecorder.get();
+    fRawToPSD2->AddRawObserver(
+        [recorder](const RawData_t &rawData) { recorder->Record(rawData); });
+
+    std::array<bool, static_cast<uint32_t>(DecodeError::NumberOfErrors)>
+        triggers{};
+    for (auto error : fFlightRecorderTriggers) {
+      triggers[static_cast<uint32_t>(error)] = true;
+    }
+    fRawToPSD2->SetErrorCallback([recorder, triggers](DecodeError error) {
+      if (triggers[static_cast<uint32_t>(error)]) {
+        recorder->Trigger(RawToPSD2::GetErrorName(error));
+      }
+    });
+  }
+
+  if (fServerPort > 0) {
+    fEventServer = std::make_unique<EventServer>(fServerPort, fServerQueueSize,
+                                                 fServerCompress);
+    if (fEventServer->Start()) {
+      auto server = fEventServer.get();
+      if (fServerRawFlag) {
+        fRawToPSD2->AddRawObserver(
+            [server](const RawData_t &rawData) { server->PublishRaw(rawData); });
+      } else {
+        fRawToPSD2->AddBatchObserver([server](const PSD2DataVec_t &events) {
+          server->PublishEvents(events);
+        });
+      }
+    }
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(fRunStateMutex);
+    fPipelineFlag = true;
+  }
+  for (uint32_t i = 0; i < fNThreads; i++) {
+    fReadDataThreads.emplace_back(&PSD2::ReadDataThread, this);
+  }
+
+  if (fDataCallback) {
+    fCallbackThread = std::thread(&PSD2::CallbackThread, this);
+  }
+}
+
+std::map<std::string, std::string> PSD2::GetPipelineConfig()
+{
+  std::string triggers;
+  for (auto error : fFlightRecorderTriggers) {
+    triggers += RawToPSD2::GetErrorName(error) + " ";
+  }
+  return {
+      {"Threads", std::to_string(fNThreads)},
+      {"DecodeThreads", std::to_string(fNDecodeThreads)},
+      {"SpillFile", fSpillFile},
+      {"SpillFileMB", std::to_string(fSpillFileSize)},
+      {"SpillQueueMB", std::to_string(fSpillQueueSize)},
+      {"SpillOutputEvents", std::to_string(fSpillOutputEvents)},
+      {"EventRing", fEventRingName},
+      {"EventRingSlots", std::to_string(fEventRingSlots)},
+      {"EventRingSlotSize", std::to_string(fEventRingSlotSize)},
+      {"ServerPort", std::to_string(fServerPort)},
+      {"ServerData", fServerRawFlag ? "raw" : "events"},
+      {"ServerCompress", std::to_string(fServerCompress)},
+      {"ServerQueueMB", std::to_string(fServerQueueSize)},
+      {"FlightRecorderMB", std::to_string(fFlightRecorderSize)},
+      {"FlightRecorderSeconds", std::to_string(fFlightRecorderSeconds)},
+      {"FlightRecorderDir", fFlightRecorderDir},
+      {"FlightRecorderTrigger", triggers},
+  };
+}
+
+void PSD2::ShutdownPipeline()
+{
+  if (GetRunState() != RunState::Idle) {
+    StopAcquisition();
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(fRunStateMutex);
+    fPipelineFlag = false;
+    fDataTakingFlag = false;
+  }
+  fRunStateCondition.notify_all();
 
   for (auto &thread : fReadDataThreads) {
     if (thread.joinable()) {
       thread.join();
     }
   }
-
-  return status;
+  fReadDataThreads.clear();
+  if (fCallbackThread.joinable()) {
+    fCallbackThread.join();
+  }
+  fRawToPSD2.reset();
+  fEventRing.reset();
+  CloseListModeFile();
+  fEventServer.reset();
+  fFlightRecorder.reset();
 }
 
 bool PSD2::EndpointConfigure()
@@ -206,6 +945,10 @@ int PSD2::ReadDataWithLock(std::unique_ptr<RawData_t> &rawData, int timeOut)
       retCode =
           CAEN_FELib_ReadData(fReadDataHandle, timeOut, rawData->data.data(),
                               &(rawData->size), &(rawData->nEvents));
+      if (retCode == CAEN_FELib_Success) {
+        // The reads are queued in this order by AddData
+        rawData->readSeq = fRawToPSD2->NextReadSeq();
+      }
     }
     fReadDataMutex.unlock();
   }
@@ -214,34 +957,147 @@ int PSD2::ReadDataWithLock(std::unique_ptr<RawData_t> &rawData, int timeOut)
 
 void PSD2::ReadDataThread()
 {
-  auto rawData = std::make_unique<RawData_t>(fMaxRawDataSize);
-  while (fDataTakingFlag) {
-    constexpr auto timeOut = 10;
+  std::unique_ptr<RawData_t> rawData = nullptr;
+  while (true) {
+    if (!fDataTakingFlag) {
+      std::unique_lock<std::mutex> lock(fRunStateMutex);
+      fNParkedThreads++;
+      fRunStateCondition.notify_all();
+      fRunStateCondition.wait(
+          lock, [this] { return fDataTakingFlag || !fPipelineFlag; });
+      fNParkedThreads--;
+      if (!fPipelineFlag) {
+        break;
+      }
+    }
+
+    // MaxRawDataSize can be changed by Reconfigure
+    if (!rawData || rawData->data.size() < fMaxRawDataSize) {
+      rawData = fRawToPSD2->GetRawBuffer(fMaxRawDataSize);
+    }
+
+    // Shorter waits for the data in the low latency mode, more reads of
+    // smaller aggregates
+    auto timeOut = fReadTimeOut.load();
     auto err = ReadDataWithLock(rawData, timeOut);
 
     if (err == CAEN_FELib_Success) {
-      fRawToPSD2->AddData(std::move(rawData));
-      rawData = std::make_unique<RawData_t>(fMaxRawDataSize);
+      auto dataType = fRawToPSD2->AddData(std::move(rawData));
+      rawData = nullptr;
+      if (dataType == DataType::Stop) {
+        {
+          std::lock_guard<std::mutex> lock(fRunStateMutex);
+          fStopSeen = true;
+        }
+        fRunStateCondition.notify_all();
+      }
     } else if (err == CAEN_FELib_Timeout) {
-      // std::string buf;
-      // GetParameter("/ch/16/par/ChRealtimeMonitor", buf);
-      // std::cout << "Realtime monitor: " << buf << std::endl;
-      // GetParameter("/ch/16/par/ChDeadtimeMonitor", buf);
-      // std::cout << "Deadtime monitor: " << buf << std::endl;
-      // GetParameter("/ch/16/par/ChTriggerCnt", buf);
-      // std::cout << "Trigger count: " << buf << std::endl;
-      // GetParameter("/ch/16/par/ChSavedEventCnt", buf);
-      // std::cout << "Saved event count: " << buf << std::endl;
-      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      // Another thread is reading or nothing came in timeOut
+      std::this_thread::sleep_for(
+          std::chrono::microseconds(fReadIdleSleepUs.load()));
+    } else {
+      ASYNC_LOG("ReadData failed: {}", err);
     }
   }
 }
 
 std::unique_ptr<std::vector<std::unique_ptr<PSD2Data>>> PSD2::GetData()
 {
+  if (!fRawToPSD2) {
+    return std::make_unique<PSD2DataVec_t>();
+  }
   return fRawToPSD2->GetData();
 }
 
+std::unique_ptr<PSD2DataVec_t> PSD2::WaitForData(
+    std::chrono::milliseconds timeout, size_t minEvents)
+{
+  if (!fRawToPSD2) {
+    std::this_thread::sleep_for(timeout);
+    return std::make_unique<PSD2DataVec_t>();
+  }
+  return fRawToPSD2->WaitForData(timeout, minEvents);
+}
+
+std::unique_ptr<PSD2DataVec_t> PSD2::GetData(const ChannelMask_t &channels)
+{
+  if (!fRawToPSD2) {
+    return std::make_unique<PSD2DataVec_t>();
+  }
+  return fRawToPSD2->GetData(channels);
+}
+
+std::unique_ptr<PSD2DataVec_t> PSD2::WaitForData(
+    std::chrono::milliseconds timeout, size_t minEvents,
+    const ChannelMask_t &channels)
+{
+  if (!fRawToPSD2) {
+    std::this_thread::sleep_for(timeout);
+    return std::make_unique<PSD2DataVec_t>();
+  }
+  return fRawToPSD2->WaitForData(timeout, minEvents, channels);
+}
+
+void PSD2::ReturnData(std::unique_ptr<PSD2DataVec_t> data)
+{
+  if (fRawToPSD2) {
+    fRawToPSD2->ReturnData(std::move(data));
+  }
+}
+
+bool PSD2::WaitForArrowBatch(ArrowSchema *schema, ArrowArray *array,
+                             std::chrono::milliseconds timeout,
+                             size_t minEvents, bool withWaveform)
+{
+  auto data = WaitForData(timeout, minEvents);
+  auto status = !data->empty();
+  if (status) {
+    PSD2Arrow::ExportSchema(schema, withWaveform);
+    PSD2Arrow::ExportBatch(*data, array, withWaveform);
+  }
+  ReturnData(std::move(data));
+
+  return status;
+}
+
+void PSD2::SetDataCallback(DataCallback_t callback, size_t minEvents)
+{
+  if (fRawToPSD2) {
+    std::cerr << "Data callback must be set before StartAcquisition"
+              << std::endl;
+    return;
+  }
+  fDataCallback = callback;
+  fCallbackMinEvents = minEvents;
+}
+
+void PSD2::CallbackThread()
+{
+  constexpr auto timeOut = std::chrono::milliseconds(100);
+  while (true) {
+    {
+      std::lock_guard<std::mutex> lock(fRunStateMutex);
+      if (!fPipelineFlag) {
+        break;
+      }
+    }
+
+    // Set at every start
+    auto data = fRawToPSD2->WaitForData(timeOut, fCallbackBatchEvents);
+    if (!data->empty()) {
+      fDataCallback(data);
+    }
+    fRawToPSD2->ReturnData(std::move(data));
+  }
+
+  // Deliver the rest
+  auto data = fRawToPSD2->GetData();
+  if (!data->empty()) {
+    fDataCallback(data);
+  }
+  fRawToPSD2->ReturnData(std::move(data));
+}
+
 nlohmann::json PSD2::GetReadDataFormatRAW()
 {
   nlohmann::json readDataJSON;
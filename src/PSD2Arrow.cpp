@@ -0,0 +1,261 @@
+#include "PSD2Arrow.hpp"
+
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace
+{
+// Owner of everything behind one ArrowSchema
+struct SchemaPrivate {
+  std::string format;
+  std::string name;
+  std::vector<ArrowSchema *> children;
+};
+
+void ReleaseSchema(ArrowSchema *schema)
+{
+  auto priv = static_cast<SchemaPrivate *>(schema->private_data);
+  for (auto child : priv->children) {
+    if (child->release) {
+      child->release(child);
+    }
+    delete child;
+  }
+  delete priv;
+  schema->release = nullptr;
+}
+
+void FillSchema(ArrowSchema *schema, std::string format, std::string name)
+{
+  auto priv = new SchemaPrivate;
+  priv->format = format;
+  priv->name = name;
+  schema->format = priv->format.c_str();
+  schema->name = priv->name.c_str();
+  schema->metadata = nullptr;
+  schema->flags = 0;
+  schema->n_children = 0;
+  schema->children = nullptr;
+  schema->dictionary = nullptr;
+  schema->release = &ReleaseSchema;
+  schema->private_data = priv;
+}
+
+ArrowSchema *AddChildSchema(ArrowSchema *parent, std::string format,
+                            std::string name)
+{
+  auto priv = static_cast<SchemaPrivate *>(parent->private_data);
+  auto child = new ArrowSchema;
+  FillSchema(child, format, name);
+  priv->children.push_back(child);
+  parent->n_children = priv->children.size();
+  parent->children = priv->children.data();
+  return child;
+}
+
+// Owner of the buffers behind one ArrowArray
+struct ArrayPrivate {
+  std::vector<std::vector<uint8_t>> storage;
+  std::vector<const void *> buffers;
+  std::vector<ArrowArray *> children;
+};
+
+void ReleaseArray(ArrowArray *array)
+{
+  auto priv = static_cast<ArrayPrivate *>(array->private_data);
+  for (auto child : priv->children) {
+    // A moved child has release == nullptr
+    if (child->release) {
+      child->release(child);
+    }
+    delete child;
+  }
+  delete priv;
+  array->release = nullptr;
+}
+
+ArrayPrivate *FillArray(ArrowArray *array, int64_t length, int64_t nBuffers)
+{
+  auto priv = new ArrayPrivate;
+  priv->storage.resize(nBuffers);
+  priv->buffers.assign(nBuffers, nullptr);
+  array->length = length;
+  array->null_count = 0;
+  array->offset = 0;
+  array->n_buffers = nBuffers;
+  array->n_children = 0;
+  array->buffers = priv->buffers.data();
+  array->children = nullptr;
+  array->dictionary = nullptr;
+  array->release = &ReleaseArray;
+  array->private_data = priv;
+  return priv;
+}
+
+ArrowArray *AddChildArray(ArrowArray *parent, int64_t length,
+                          int64_t nBuffers)
+{
+  auto priv = static_cast<ArrayPrivate *>(parent->private_data);
+  auto child = new ArrowArray;
+  FillArray(child, length, nBuffers);
+  priv->children.push_back(child);
+  parent->n_children = priv->children.size();
+  parent->children = priv->children.data();
+  return child;
+}
+
+// Set buffer i, validity (buffer 0) stays null: no nulls
+uint8_t *AllocateBuffer(ArrowArray *array, int64_t i, size_t size)
+{
+  auto priv = static_cast<ArrayPrivate *>(array->private_data);
+  // Arrow wants non-null buffers even for length 0
+  priv->storage[i].resize(size > 0 ? size : 8);
+  priv->buffers[i] = priv->storage[i].data();
+  return priv->storage[i].data();
+}
+
+template <typename T, typename Getter>
+void AddColumn(ArrowArray *parent, const PSD2DataVec_t &events, Getter get)
+{
+  auto n = events.size();
+  auto column = AddChildArray(parent, n, 2);
+  auto values =
+      reinterpret_cast<T *>(AllocateBuffer(column, 1, n * sizeof(T)));
+  for (size_t i = 0; i < n; i++) {
+    values[i] = get(*events[i]);
+  }
+}
+
+void AddBoolColumn(ArrowArray *parent, const PSD2DataVec_t &events)
+{
+  auto n = events.size();
+  auto column = AddChildArray(parent, n, 2);
+  auto bits = AllocateBuffer(column, 1, (n + 7) / 8);
+  std::memset(bits, 0, (n + 7) / 8);
+  for (size_t i = 0; i < n; i++) {
+    if (events[i]->boardFail) {
+      bits[i / 8] |= 1 << (i % 8);
+    }
+  }
+}
+
+template <typename T, typename Getter>
+void AddListColumn(ArrowArray *parent, const PSD2DataVec_t &events,
+                   Getter get)
+{
+  auto n = events.size();
+  auto column = AddChildArray(parent, n, 2);
+  auto offsets = reinterpret_cast<int32_t *>(
+      AllocateBuffer(column, 1, (n + 1) * sizeof(int32_t)));
+  int32_t total = 0;
+  for (size_t i = 0; i < n; i++) {
+    offsets[i] = total;
+    total += get(*events[i]).size();
+  }
+  offsets[n] = total;
+
+  auto child = AddChildArray(column, total, 2);
+  auto values =
+      reinterpret_cast<T *>(AllocateBuffer(child, 1, total * sizeof(T)));
+  for (size_t i = 0; i < n; i++) {
+    auto &wave = get(*events[i]);
+    if (!wave.empty()) {
+      std::memcpy(values + offsets[i], wave.data(), wave.size() * sizeof(T));
+    }
+  }
+}
+}  // namespace
+
+void PSD2Arrow::ExportSchema(ArrowSchema *schema, bool withWaveform)
+{
+  FillSchema(schema, "+s", "");
+  AddChildSchema(schema, "L", "timeStamp");
+  AddChildSchema(schema, "g", "timeStampNs");
+  AddChildSchema(schema, "C", "channel");
+  AddChildSchema(schema, "S", "energy");
+  AddChildSchema(schema, "S", "energyShort");
+  AddChildSchema(schema, "S", "fineTimeStamp");
+  AddChildSchema(schema, "S", "flagsLowPriority");
+  AddChildSchema(schema, "S", "flagsHighPriority");
+  AddChildSchema(schema, "S", "triggerThr");
+  AddChildSchema(schema, "I", "aggregateCounter");
+  AddChildSchema(schema, "C", "timeResolution");
+  AddChildSchema(schema, "C", "downSampleFactor");
+  AddChildSchema(schema, "S", "waveformStart");
+  AddChildSchema(schema, "b", "boardFail");
+  AddChildSchema(schema, "g", "calibratedEnergy");
+  AddChildSchema(schema, "f", "psdRatio");
+  AddChildSchema(schema, "g", "correctedTimeNs");
+
+  if (withWaveform) {
+    AddChildSchema(AddChildSchema(schema, "+l", "analogProbe1"), "i", "item");
+    AddChildSchema(AddChildSchema(schema, "+l", "analogProbe2"), "i", "item");
+    AddChildSchema(AddChildSchema(schema, "+l", "digitalProbe1"), "C", "item");
+    AddChildSchema(AddChildSchema(schema, "+l", "digitalProbe2"), "C", "item");
+    AddChildSchema(AddChildSchema(schema, "+l", "digitalProbe3"), "C", "item");
+    AddChildSchema(AddChildSchema(schema, "+l", "digitalProbe4"), "C", "item");
+  }
+}
+
+void PSD2Arrow::ExportBatch(const PSD2DataVec_t &events, ArrowArray *array,
+                            bool withWaveform)
+{
+  // Struct array has only the validity buffer
+  FillArray(array, events.size(), 1);
+
+  AddColumn<uint64_t>(array, events,
+                      [](const PSD2Data_t &d) { return d.timeStamp; });
+  AddColumn<double>(array, events,
+                    [](const PSD2Data_t &d) { return d.timeStampNs; });
+  AddColumn<uint8_t>(array, events,
+                     [](const PSD2Data_t &d) { return d.channel; });
+  AddColumn<uint16_t>(array, events,
+                      [](const PSD2Data_t &d) { return d.energy; });
+  AddColumn<uint16_t>(array, events,
+                      [](const PSD2Data_t &d) { return d.energyShort; });
+  AddColumn<uint16_t>(array, events,
+                      [](const PSD2Data_t &d) { return d.fineTimeStamp; });
+  AddColumn<uint16_t>(array, events,
+                      [](const PSD2Data_t &d) { return d.flagsLowPriority; });
+  AddColumn<uint16_t>(array, events,
+                      [](const PSD2Data_t &d) { return d.flagsHighPriority; });
+  AddColumn<uint16_t>(array, events,
+                      [](const PSD2Data_t &d) { return d.triggerThr; });
+  AddColumn<uint32_t>(array, events,
+                      [](const PSD2Data_t &d) { return d.aggregateCounter; });
+  AddColumn<uint8_t>(array, events,
+                     [](const PSD2Data_t &d) { return d.timeResolution; });
+  AddColumn<uint8_t>(array, events,
+                     [](const PSD2Data_t &d) { return d.downSampleFactor; });
+  AddColumn<uint16_t>(array, events,
+                      [](const PSD2Data_t &d) { return d.waveformStart; });
+  AddBoolColumn(array, events);
+  AddColumn<double>(array, events,
+                    [](const PSD2Data_t &d) { return d.calibratedEnergy; });
+  AddColumn<float>(array, events,
+                   [](const PSD2Data_t &d) { return d.psdRatio; });
+  AddColumn<double>(array, events,
+                    [](const PSD2Data_t &d) { return d.correctedTimeNs; });
+
+  if (withWaveform) {
+    AddListColumn<int32_t>(
+        array, events,
+        [](const PSD2Data_t &d) -> auto & { return d.analogProbe1; });
+    AddListColumn<int32_t>(
+        array, events,
+        [](const PSD2Data_t &d) -> auto & { return d.analogProbe2; });
+    AddListColumn<uint8_t>(
+        array, events,
+        [](const PSD2Data_t &d) -> auto & { return d.digitalProbe1; });
+    AddListColumn<uint8_t>(
+        array, events,
+        [](const PSD2Data_t &d) -> auto & { return d.digitalProbe2; });
+    AddListColumn<uint8_t>(
+        array, events,
+        [](const PSD2Data_t &d) -> auto & { return d.digitalProbe3; });
+    AddListColumn<uint8_t>(
+        array, events,
+        [](const PSD2Data_t &d) -> auto & { return d.digitalProbe4; });
+  }
+}
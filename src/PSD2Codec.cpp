@@ -0,0 +1,143 @@
+#include "PSD2Codec.hpp"
+
+#include <cstring>
+
+namespace
+{
+size_t PaddedSize(size_t size) { return (size + 7) & ~size_t(7); }
+}  // namespace
+
+size_t PSD2Codec::EncodedSize(const PSD2Data_t &data)
+{
+  auto n = data.waveformSize;
+  return PaddedSize(sizeof(PSD2EventRecord) + n * (2 * sizeof(int32_t) + 4));
+}
+
+size_t PSD2Codec::Encode(const PSD2Data_t &data, uint8_t *dst)
+{
+  PSD2EventRecord record{};
+  record.timeStamp = data.timeStamp;
+  record.timeStampNs = data.timeStampNs;
+  record.waveformSize = static_cast<uint32_t>(data.waveformSize);
+  record.aggregateCounter = data.aggregateCounter;
+  record.fineTimeStamp = data.fineTimeStamp;
+  record.energy = data.energy;
+  record.energyShort = data.energyShort;
+  record.flagsLowPriority = data.flagsLowPriority;
+  record.flagsHighPriority = data.flagsHighPriority;
+  record.triggerThr = data.triggerThr;
+  record.channel = data.channel;
+  record.timeResolution = data.timeResolution;
+  record.analogProbe1Type = data.analogProbe1Type;
+  record.analogProbe2Type = data.analogProbe2Type;
+  record.digitalProbe1Type = data.digitalProbe1Type;
+  record.digitalProbe2Type = data.digitalProbe2Type;
+  record.digitalProbe3Type = data.digitalProbe3Type;
+  record.digitalProbe4Type = data.digitalProbe4Type;
+  record.downSampleFactor = data.downSampleFactor;
+  record.boardFail = data.boardFail;
+  record.waveformStart = static_cast<uint16_t>(data.waveformStart);
+  record.calibratedEnergy = data.calibratedEnergy;
+  record.correctedTimeNs = data.correctedTimeNs;
+  record.psdRatio = data.psdRatio;
+
+  auto p = dst;
+  std::memcpy(p, &record, sizeof(record));
+  p += sizeof(record);
+
+  auto n = data.waveformSize;
+  if (n > 0) {
+    std::memcpy(p, data.analogProbe1.data(), n * sizeof(int32_t));
+    p += n * sizeof(int32_t);
+    std::memcpy(p, data.analogProbe2.data(), n * sizeof(int32_t));
+    p += n * sizeof(int32_t);
+    std::memcpy(p, data.digitalProbe1.data(), n);
+    p += n;
+    std::memcpy(p, data.digitalProbe2.data(), n);
+    p += n;
+    std::memcpy(p, data.digitalProbe3.data(), n);
+    p += n;
+    std::memcpy(p, data.digitalProbe4.data(), n);
+    p += n;
+  }
+
+  auto size = EncodedSize(data);
+  std::memset(p, 0, dst + size - p);
+
+  return size;
+}
+
+size_t PSD2Codec::Decode(const uint8_t *src, size_t size, PSD2Data_t &data)
+{
+  if (size < sizeof(PSD2EventRecord)) {
+    return 0;
+  }
+
+  PSD2EventRecord record;
+  std::memcpy(&record, src, sizeof(record));
+  size_t n = record.waveformSize;
+  auto eventSize =
+      PaddedSize(sizeof(PSD2EventRecord) + n * (2 * sizeof(int32_t) + 4));
+  if (eventSize > size) {
+    return 0;
+  }
+
+  data.timeStamp = record.timeStamp;
+  data.timeStampNs = record.timeStampNs;
+  data.aggregateCounter = record.aggregateCounter;
+  data.fineTimeStamp = record.fineTimeStamp;
+  data.energy = record.energy;
+  data.energyShort = record.energyShort;
+  data.flagsLowPriority = record.flagsLowPriority;
+  data.flagsHighPriority = record.flagsHighPriority;
+  data.triggerThr = record.triggerThr;
+  data.channel = record.channel;
+  data.timeResolution = record.timeResolution;
+  data.analogProbe1Type = record.analogProbe1Type;
+  data.analogProbe2Type = record.analogProbe2Type;
+  data.digitalProbe1Type = record.digitalProbe1Type;
+  data.digitalProbe2Type = record.digitalProbe2Type;
+  data.digitalProbe3Type = record.digitalProbe3Type;
+  data.digitalProbe4Type = record.digitalProbe4Type;
+  data.downSampleFactor = record.downSampleFactor;
+  data.boardFail = record.boardFail;
+  data.waveformStart = record.waveformStart;
+  data.calibratedEnergy = record.calibratedEnergy;
+  data.correctedTimeNs = record.correctedTimeNs;
+  data.psdRatio = record.psdRatio;
+
+  data.Resize(n);
+  auto p = src + sizeof(record);
+  if (n > 0) {
+    std::memcpy(data.analogProbe1.data(), p, n * sizeof(int32_t));
+    p += n * sizeof(int32_t);
+    std::memcpy(data.analogProbe2.data(), p, n * sizeof(int32_t));
+    p += n * sizeof(int32_t);
+    std::memcpy(data.digitalProbe1.data(), p, n);
+    p += n;
+    std::memcpy(data.digitalProbe2.data(), p, n);
+    p += n;
+    std::memcpy(data.digitalProbe3.data(), p, n);
+    p += n;
+    std::memcpy(data.digitalProbe4.data(), p, n);
+  }
+
+  return eventSize;
+}
+
+bool PSD2Codec::DecodeAll(const uint8_t *src, size_t size,
+                          PSD2DataVec_t &events)
+{
+  size_t pos = 0;
+  while (pos < size) {
+    auto data = std::make_unique<PSD2Data_t>();
+    auto eventSize = Decode(src + pos, size - pos, *data);
+    if (eventSize == 0) {
+      return false;
+    }
+    events.push_back(std::move(data));
+    pos += eventSize;
+  }
+
+  return true;
+}
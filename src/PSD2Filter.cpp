@@ -0,0 +1,172 @@
+#include "PSD2Filter.hpp"
+
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+#include "ChannelRange.hpp"
+
+namespace
+{
+// accept[i] &= (rule does not apply || pass(i)), returns the rejected
+template <typename Pass>
+uint64_t Sweep(const uint8_t *applies, const uint8_t *channel,
+               uint8_t *accept, size_t n, Pass pass)
+{
+  uint64_t nRejected = 0;
+#pragma omp simd reduction(+ : nRejected)
+  for (size_t i = 0; i < n; i++) {
+    uint8_t keep = (applies[channel[i]] == 0) | pass(i);
+    nRejected += accept[i] & (keep ^ 1);
+    accept[i] &= keep;
+  }
+  return nRejected;
+}
+}  // namespace
+
+bool PSD2Filter::AddRule(std::string rule)
+{
+  std::istringstream tokens(rule);
+  std::string field;
+  tokens >> field;
+
+  Rule_t compiled;
+  compiled.text = rule;
+  compiled.op = Op::Range;
+  compiled.channels.fill(0);
+  std::string channels;
+
+  auto valid = true;
+  if (field == "channel") {
+    compiled.field = Field::Channel;
+    valid = static_cast<bool>(tokens >> channels);
+  } else if (field == "energy" || field == "energyShort" || field == "psd") {
+    compiled.field = (field == "energy")        ? Field::Energy
+                     : (field == "energyShort") ? Field::EnergyShort
+                                                : Field::PSD;
+    valid = static_cast<bool>(tokens >> compiled.min >> compiled.max);
+    tokens >> channels;
+  } else if (field == "flagsLow" || field == "flagsHigh") {
+    compiled.field = (field == "flagsLow") ? Field::FlagsLow : Field::FlagsHigh;
+    std::string op, mask;
+    valid = static_cast<bool>(tokens >> op >> mask);
+    if (valid && (op == "none" || op == "all")) {
+      compiled.op = (op == "none") ? Op::NoneOf : Op::AllOf;
+      try {
+        compiled.mask = std::stoul(mask, nullptr, 0);
+      } catch (const std::exception &) {
+        valid = false;
+      }
+    } else {
+      valid = false;
+    }
+    tokens >> channels;
+  } else {
+    valid = false;
+  }
+
+  if (valid) {
+    if (channels == "") {
+      compiled.channels.fill(1);
+    } else {
+      uint32_t first = 0;
+      uint32_t last = 0;
+      valid = ParseChannelRange(channels, first, last);
+      for (auto ch = first; valid && ch <= last && ch < kNChannels; ch++) {
+        compiled.channels[ch] = 1;
+      }
+    }
+  }
+  if (!valid) {
+    std::cerr << "Invalid filter rule: " << rule << std::endl;
+    return false;
+  }
+  if (compiled.field == Field::Channel) {
+    // Applied to the other channels and never passed
+    for (auto &ch : compiled.channels) {
+      ch ^= 1;
+    }
+  }
+
+  fRules.push_back(compiled);
+  fCounters.push_back(std::make_unique<Counter_t>());
+  return true;
+}
+
+void PSD2Filter::Apply(PSD2FilterBatch_t &batch) const
+{
+  const auto n = batch.channel.size();
+  auto accept = batch.accept.data();
+  std::fill(accept, accept + n, 1);
+
+  auto channel = batch.channel.data();
+  auto energy = batch.energy.data();
+  auto energyShort = batch.energyShort.data();
+  auto nKept = n;
+  for (size_t iRule = 0; iRule < fRules.size() && nKept > 0; iRule++) {
+    auto &rule = fRules[iRule];
+    auto applies = rule.channels.data();
+    auto min = rule.min;
+    auto max = rule.max;
+    auto mask = rule.mask;
+    const uint16_t *flags = (rule.field == Field::FlagsLow)
+                                ? batch.flagsLowPriority.data()
+                                : batch.flagsHighPriority.data();
+
+    uint64_t nRejected = 0;
+    switch (rule.field) {
+      case Field::Channel:
+        nRejected = Sweep(applies, channel, accept, n,
+                          [](size_t) { return uint8_t(0); });
+        break;
+      case Field::Energy:
+        nRejected = Sweep(applies, channel, accept, n, [=](size_t i) {
+          float e = energy[i];
+          return static_cast<uint8_t>((e >= min) & (e <= max));
+        });
+        break;
+      case Field::EnergyShort:
+        nRejected = Sweep(applies, channel, accept, n, [=](size_t i) {
+          float e = energyShort[i];
+          return static_cast<uint8_t>((e >= min) & (e <= max));
+        });
+        break;
+      case Field::PSD:
+        nRejected = Sweep(applies, channel, accept, n, [=](size_t i) {
+          float e = energy[i];
+          float ratio = (e > 0.f) ? (e - energyShort[i]) / e : 0.f;
+          return static_cast<uint8_t>((ratio >= min) & (ratio <= max));
+        });
+        break;
+      case Field::FlagsLow:
+      case Field::FlagsHigh:
+        if (rule.op == Op::NoneOf) {
+          nRejected = Sweep(applies, channel, accept, n, [=](size_t i) {
+            return static_cast<uint8_t>((flags[i] & mask) == 0);
+          });
+        } else {
+          nRejected = Sweep(applies, channel, accept, n, [=](size_t i) {
+            return static_cast<uint8_t>((flags[i] & mask) == mask);
+          });
+        }
+        break;
+    }
+
+    // Counted once per batch
+    fCounters[iRule]->nAccepted += nKept - nRejected;
+    fCounters[iRule]->nRejected += nRejected;
+    nKept -= nRejected;
+  }
+}
+
+std::vector<PSD2FilterStats_t> PSD2Filter::GetStats() const
+{
+  std::vector<PSD2FilterStats_t> stats(fRules.size());
+  for (size_t i = 0; i < fRules.size(); i++) {
+    stats[i].rule = fRules[i].text;
+    stats[i].nAccepted = fCounters[i]->nAccepted;
+    stats[i].nRejected = fCounters[i]->nRejected;
+  }
+  return stats;
+}
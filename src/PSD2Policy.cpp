@@ -0,0 +1,364 @@
+#include "PSD2Policy.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#include "AsyncLog.hpp"
+
+bool PSD2Policy::ScanEvent(const uint8_t *dataStart, size_t i, size_t nWords,
+                           size_t &next, DecodeError &error) const
+{
+  constexpr size_t oneWordSize = 8;
+  // First word bit 63 = 0x0
+  uint64_t firstWord = 0;
+  std::memcpy(&firstWord, dataStart + i * oneWordSize, oneWordSize);
+  if (((firstWord >> 63) & 0b1) != 0x0) {
+    error = DecodeError::BadEventHeader;
+    return false;
+  }
+
+  // Second word bit 62 = including waveform
+  uint64_t secondWord = 0;
+  std::memcpy(&secondWord, dataStart + (i + 1) * oneWordSize, oneWordSize);
+  i += 2;
+  if (((secondWord >> 62) & 0b1) == 0x1) {
+    if (i + 2 > nWords) {
+      error = DecodeError::Truncated;
+      return false;
+    }
+    // Waveform header bit 63 = 0x1, bit [60:62] = 0x0
+    uint64_t waveformHeader = 0;
+    std::memcpy(&waveformHeader, dataStart + i * oneWordSize, oneWordSize);
+    if (((waveformHeader >> 63) & 0b1) != 0x1 ||
+        ((waveformHeader >> 60) & 0x7) != 0x0) {
+      error = DecodeError::BadWaveformHeader;
+      return false;
+    }
+    // bit [0:11] = number of words
+    uint64_t nWordsWaveform = 0;
+    std::memcpy(&nWordsWaveform, dataStart + (i + 1) * oneWordSize,
+                oneWordSize);
+    i += 2 + (nWordsWaveform & 0xFFF);
+  }
+
+  if (i > nWords) {
+    error = DecodeError::Truncated;
+    return false;
+  }
+  next = i;
+  return true;
+}
+
+void PSD2Policy::FilterEvents(const uint8_t *dataStart,
+                              std::vector<size_t> &eventIndex) const
+{
+  auto filter = std::atomic_load(&fFilter);
+  if (!filter || filter->GetNRules() == 0 || eventIndex.empty()) {
+    return;
+  }
+
+  // Columns of the event words, reused by every decode thread
+  constexpr size_t oneWordSize = 8;
+  thread_local PSD2FilterBatch_t batch;
+  const auto n = eventIndex.size();
+  batch.Resize(n);
+  for (size_t iEvent = 0; iEvent < n; iEvent++) {
+    uint64_t firstWord = 0;
+    uint64_t secondWord = 0;
+    auto event = dataStart + eventIndex[iEvent] * oneWordSize;
+    std::memcpy(&firstWord, event, sizeof(uint64_t));
+    std::memcpy(&secondWord, event + oneWordSize, sizeof(uint64_t));
+    batch.channel[iEvent] = (firstWord >> 56) & 0x7F;
+    batch.flagsLowPriority[iEvent] = (secondWord >> 50) & 0x7FF;
+    batch.flagsHighPriority[iEvent] = (secondWord >> 42) & 0xFF;
+    batch.energyShort[iEvent] = (secondWord >> 26) & 0xFFFF;
+    batch.energy[iEvent] = secondWord & 0xFFFF;
+  }
+
+  filter->Apply(batch);
+
+  // Keep the order
+  size_t nKept = 0;
+  for (size_t iEvent = 0; iEvent < n; iEvent++) {
+    eventIndex[nKept] = eventIndex[iEvent];
+    nKept += batch.accept[iEvent];
+  }
+  eventIndex.resize(nKept);
+}
+
+void PSD2Policy::SetWaveformWindows(const WaveformWindows_t &windows)
+{
+  auto current = fWaveformWindows.load();
+  auto &next = (current == &fWaveformTables[0]) ? fWaveformTables[1]
+                                                : fWaveformTables[0];
+  next = windows;
+  for (auto &window : next) {
+    window.decimation = std::max<uint8_t>(1, window.decimation);
+  }
+  fWaveformWindows.store(&next, std::memory_order_release);
+}
+
+void PSD2Policy::DecodeEvent(const uint8_t *dataStart, size_t i,
+                             size_t nWords, PSD2Data_t &psd2Data) const
+{
+  constexpr size_t oneWordSize = 8;
+  uint64_t firstWord = 0;
+  std::memcpy(&firstWord, dataStart + i * oneWordSize, sizeof(uint64_t));
+  i++;  // Go to the next word
+  uint64_t secondWord = 0;
+  std::memcpy(&secondWord, dataStart + i * oneWordSize, sizeof(uint64_t));
+
+  // First word
+  // bit 63 = 0x0
+  auto firstWordCheck = ((firstWord >> 63) & 0b1) == 0x0;
+  if (fDumpFlag) {
+    ASYNC_LOG("First word check: {}", firstWordCheck);
+  }
+
+  // bit[56:62] = channel
+  psd2Data.channel = ((firstWord >> 56) & 0x7F);
+  if (fDumpFlag) {
+    ASYNC_LOG("Channel: {}", psd2Data.channel);
+  }
+  // bit[0:47] = time stamp
+  psd2Data.timeStamp = static_cast<uint64_t>(firstWord & 0xFFFFFFFFFFFF);
+  psd2Data.timeStamp = psd2Data.timeStamp * fTimeStep;
+  if (fDumpFlag) {
+    ASYNC_LOG("Time stamp: {}", psd2Data.timeStamp);
+  }
+
+  // Second word
+  // bit 63 = last word
+  auto lastWord = ((secondWord >> 63) & 0b1) == 0x1;
+  if (lastWord) {
+    // Check it is really the last word
+  }
+
+  // bit 62 = including waveform
+  auto withWaveformFlag = ((secondWord >> 62) & 0b1) == 0x1;
+
+  // bit[50:61] = low priority flags
+  psd2Data.flagsLowPriority =
+      static_cast<uint16_t>((secondWord >> 50) & 0x7FF);
+  if (fDumpFlag) {
+    ASYNC_LOG("Low priority flags: {}", psd2Data.flagsLowPriority);
+  }
+  // bit[42:49] = high priority flags
+  psd2Data.flagsHighPriority =
+      static_cast<uint16_t>((secondWord >> 42) & 0xFF);
+  if (fDumpFlag) {
+    ASYNC_LOG("High priority flags: {}", psd2Data.flagsHighPriority);
+  }
+  // bit[26:41] = short gate
+  psd2Data.energyShort = ((secondWord >> 26) & 0xFFFF);
+  if (fDumpFlag) {
+    ASYNC_LOG("Short gate: {}", psd2Data.energyShort);
+  }
+  // bit [16:25] = fine time stamp
+  auto fineTSbuf = ((secondWord >> 16) & 0x3FF);
+  psd2Data.fineTimeStamp = static_cast<uint16_t>(fineTSbuf);
+  psd2Data.timeStampNs =
+      psd2Data.timeStamp + (fineTSbuf / 1024.0 * fTimeStep);
+  if (fDumpFlag) {
+    ASYNC_LOG("Fine time stamp: {}", psd2Data.timeStampNs);
+  }
+  // bit[0:15] = energy
+  psd2Data.energy = static_cast<uint16_t>(secondWord & 0xFFFF);
+  if (fDumpFlag) {
+    ASYNC_LOG("Energy: {}", psd2Data.energy);
+  }
+
+  if (withWaveformFlag && i + 2 < nWords) {
+    i++;  // Go to the next word
+    uint64_t waveformHeader = 0;
+    std::memcpy(&waveformHeader, dataStart + i * oneWordSize,
+                sizeof(uint64_t));
+    // bit 63 = 0x1, bit [60:62] = 0x0 are checked by ScanEvent
+    // bit [44:45] = time resolution
+    auto timeResolution = ((waveformHeader >> 44) & 0x3);
+    if (timeResolution == 0x0) {
+      psd2Data.downSampleFactor = 1;
+    } else if (timeResolution == 0x1) {
+      psd2Data.downSampleFactor = 2;
+    } else if (timeResolution == 0x2) {
+      psd2Data.downSampleFactor = 4;
+    } else if (timeResolution == 0x3) {
+      psd2Data.downSampleFactor = 8;
+    }
+
+    // bit [28:43] = trigger threshold
+    psd2Data.triggerThr =
+        static_cast<uint16_t>((waveformHeader >> 28) & 0xFFFF);
+
+    // bit [24:27] = digital probe 4 information
+    psd2Data.digitalProbe4Type =
+        static_cast<uint8_t>((waveformHeader >> 24) & 0xF);
+
+    // bit [20:23] = digital probe 3 information
+    psd2Data.digitalProbe3Type =
+        static_cast<uint8_t>((waveformHeader >> 20) & 0xF);
+
+    // bit [16:19] = digital probe 2 information
+    psd2Data.digitalProbe2Type =
+        static_cast<uint8_t>((waveformHeader >> 16) & 0xF);
+
+    // bit [12:15] = digital probe 1 information
+    psd2Data.digitalProbe1Type =
+        static_cast<uint8_t>((waveformHeader >> 12) & 0xF);
+
+    // bit [6:8] = analog probe 2 information
+    psd2Data.analogProbe2Type =
+        static_cast<uint8_t>((waveformHeader >> 6) & 0x7);
+    // bit 9 = isSigned
+    bool ap2IsSigned = ((waveformHeader >> 9) & 0b1) == 0x1;
+    // bit [10:11] = multiplication factor
+    auto ap2MulFactor = ((waveformHeader >> 10) & 0x3);
+    if (ap2MulFactor == 0x0) {
+      ap2MulFactor = 1;
+    } else if (ap2MulFactor == 0x1) {
+      ap2MulFactor = 4;
+    } else if (ap2MulFactor == 0x2) {
+      ap2MulFactor = 8;
+    } else if (ap2MulFactor == 0x3) {
+      ap2MulFactor = 16;
+    }
+
+    // bit [0:2] = analog probe 0 information
+    psd2Data.analogProbe1Type =
+        static_cast<uint8_t>((waveformHeader >> 0) & 0x7);
+    // bit 3 = isSigned
+    bool ap1IsSigned = ((waveformHeader >> 3) & 0b1) == 0x1;
+    // bit [4:5] = multiplication factor
+    auto ap1MulFactor = ((waveformHeader >> 4) & 0x3);
+    if (ap1MulFactor == 0x0) {
+      ap1MulFactor = 1;
+    } else if (ap1MulFactor == 0x1) {
+      ap1MulFactor = 4;
+    } else if (ap1MulFactor == 0x2) {
+      ap1MulFactor = 8;
+    } else if (ap1MulFactor == 0x3) {
+      ap1MulFactor = 16;
+    }
+
+    i++;  // Go to the next word
+          // bit [0:11] = number of words
+    uint64_t nWordsWaveform = 0;
+    std::memcpy(&nWordsWaveform, dataStart + i * oneWordSize,
+                sizeof(uint64_t));
+    nWordsWaveform = nWordsWaveform & 0xFFF;
+    // Do not read over the aggregate
+    nWordsWaveform = std::min<uint64_t>(nWordsWaveform, nWords - i - 1);
+    auto waveform = dataStart + (i + 1) * oneWordSize;
+    auto nSamples = nWordsWaveform * 2;  // 1 word has 2 data points
+
+    // Window of the record to keep
+    auto windows = fWaveformWindows.load(std::memory_order_acquire);
+    auto &window = (*windows)[psd2Data.channel];
+    uint64_t first = 0;
+    uint64_t last = nSamples;
+    uint64_t step = window.decimation;
+    if (window.pre > 0 || window.post > 0) {
+      uint64_t reference = window.trigger;
+      if (window.probe >= 1 && window.probe <= 4) {
+        // Only the probe bit is tested, up to the first set sample
+        constexpr uint32_t probeBits[] = {14, 15, 30, 31};
+        auto bit = probeBits[window.probe - 1];
+        for (size_t j = 0; j < nWordsWaveform; j++) {
+          uint64_t buf = 0;
+          std::memcpy(&buf, waveform + j * oneWordSize, sizeof(uint64_t));
+          if ((buf >> bit) & 0b1) {
+            reference = j * 2;
+            break;
+          } else if ((buf >> (bit + 32)) & 0b1) {
+            reference = j * 2 + 1;
+            break;
+          }
+        }
+      }
+      reference = std::min(reference, nSamples);
+      first = reference - std::min<uint64_t>(reference, window.pre);
+      last = std::min(nSamples, reference + window.post);
+    }
+    psd2Data.Resize((last - first + step - 1) / step);
+    psd2Data.waveformStart = first;
+    psd2Data.downSampleFactor *= step;
+
+    // analog probe #1 = bit [0:13]
+    // digital probe #1 = bit 14
+    // digital probe #2 = bit 15
+    // analog probe #2 = bit [16:29]
+    // digital probe #3 = bit 30
+    // digital probe #4 = bit 31
+    auto decodePoint = [&](uint32_t point, size_t nData) {
+      // analog probe #1
+      if (ap1IsSigned) {
+        psd2Data.analogProbe1[nData] =
+            static_cast<int32_t>((point >> 0) & 0x3FFF) * ap1MulFactor;
+      } else {
+        psd2Data.analogProbe1[nData] =
+            static_cast<uint32_t>((point >> 0) & 0x3FFF) * ap1MulFactor;
+      }
+      // analog probe #2
+      if (ap2IsSigned) {
+        psd2Data.analogProbe2[nData] =
+            static_cast<int32_t>((point >> 16) & 0x3FFF) * ap2MulFactor;
+      } else {
+        psd2Data.analogProbe2[nData] =
+            static_cast<uint32_t>((point >> 16) & 0x3FFF) * ap2MulFactor;
+      }
+
+      // digital probe #1
+      psd2Data.digitalProbe1[nData] =
+          static_cast<uint8_t>((point >> 14) & 0b1);
+      // digital probe #2
+      psd2Data.digitalProbe2[nData] =
+          static_cast<uint8_t>((point >> 15) & 0b1);
+      // digital probe #3
+      psd2Data.digitalProbe3[nData] =
+          static_cast<uint8_t>((point >> 30) & 0b1);
+      // digital probe #4
+      psd2Data.digitalProbe4[nData] =
+          static_cast<uint8_t>((point >> 31) & 0b1);
+    };
+
+    if (step == 1) {
+      // Both points of the words in the window
+      for (size_t j = first / 2; j < (last + 1) / 2; j++) {
+        uint64_t buf = 0;
+        std::memcpy(&buf, waveform + j * oneWordSize, sizeof(uint64_t));
+        auto sample = j * 2;
+        if (sample >= first) {
+          decodePoint(static_cast<uint32_t>(buf & 0xFFFFFFFF), sample - first);
+        }
+        if (sample + 1 < last) {
+          decodePoint(static_cast<uint32_t>((buf >> 32) & 0xFFFFFFFF),
+                      sample + 1 - first);
+        }
+      }
+    } else {
+      // Only the kept points
+      size_t nData = 0;
+      for (auto sample = first; sample < last; sample += step) {
+        uint64_t buf = 0;
+        std::memcpy(&buf, waveform + (sample / 2) * oneWordSize,
+                    sizeof(uint64_t));
+        decodePoint(static_cast<uint32_t>(buf >> ((sample % 2) * 32)),
+                    nData++);
+      }
+    }
+  } else {
+    // No waveform
+    psd2Data.Resize(0);
+    psd2Data.waveformStart = 0;
+  }
+
+  psd2Data.timeResolution = fTimeStep;
+}
+
+void PSD2Policy::FinishBatch(PSD2DataVec_t &psd2DataVec) const
+{
+  auto calibration = std::atomic_load(&fCalibration);
+  if (calibration) {
+    calibration->Apply(psd2DataVec);
+  }
+}
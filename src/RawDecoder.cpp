@@ -0,0 +1,985 @@
+#include "RawDecoder.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+#include "AsyncLog.hpp"
+#include "PSD2Policy.hpp"
+
+namespace
+{
+uint64_t SteadyTimeNs()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+}  // namespace
+
+template <typename Policy>
+RawDecoder<Policy>::RawDecoder(uint32_t nThreads)
+{
+  if (nThreads < 1) {
+    nThreads = 1;
+  }
+  fDecodeFlag = true;
+  fNActive = nThreads;
+  for (uint32_t i = 0; i < nThreads; i++) {
+    fDecodeThreads.emplace_back(&RawDecoder::DecodeThread, this, i);
+  }
+}
+
+template <typename Policy>
+RawDecoder<Policy>::~RawDecoder()
+{
+  {
+    std::lock_guard<std::mutex> lock(fScaleMutex);
+    std::lock_guard<std::mutex> rawLock(fRawDataMutex);
+    fDecodeFlag = false;
+  }
+  fScaleCondition.notify_all();
+  if (fScaleThread.joinable()) {
+    fScaleThread.join();
+  }
+  fParkCondition.notify_all();
+  fRawDataCondition.notify_all();
+  {
+    std::lock_guard<std::mutex> lock(fWaitMutex);
+  }
+  fDataCondition.notify_all();
+  for (auto &thread : fDecodeThreads) {
+    if (thread.joinable()) {
+      thread.join();
+    }
+  }
+
+  // Not replayed without WaitForDrain
+  if (fSpill && fSpill->GetNRecords() > 0) {
+    std::cerr << "Spill: " << fSpill->GetNRecords()
+              << " aggregates discarded" << std::endl;
+  }
+}
+
+template <typename Policy>
+std::unique_ptr<typename RawDecoder<Policy>::DataVec_t>
+RawDecoder<Policy>::GetData()
+{
+  return GetData(ChannelMask_t().set());
+}
+
+template <typename Policy>
+std::unique_ptr<typename RawDecoder<Policy>::DataVec_t>
+RawDecoder<Policy>::GetData(const ChannelMask_t &channels)
+{
+  // No lock when nothing has arrived
+  if (fNData == 0) {
+    return GetContainer();
+  }
+
+  return TakeData(channels);
+}
+
+template <typename Policy>
+std::unique_ptr<typename RawDecoder<Policy>::DataVec_t>
+RawDecoder<Policy>::WaitForData(std::chrono::milliseconds timeout,
+                                size_t minEvents)
+{
+  return WaitForData(timeout, minEvents, ChannelMask_t().set());
+}
+
+template <typename Policy>
+std::unique_ptr<typename RawDecoder<Policy>::DataVec_t>
+RawDecoder<Policy>::WaitForData(std::chrono::milliseconds timeout,
+                                size_t minEvents,
+                                const ChannelMask_t &channels)
+{
+  if (minEvents < 1) {
+    minEvents = 1;
+  }
+
+  if (CountData(channels) < minEvents) {
+    std::unique_lock<std::mutex> lock(fWaitMutex);
+    fNWaiters++;
+    fDataCondition.wait_for(lock, timeout, [this, minEvents, &channels] {
+      return CountData(channels) >= minEvents || !fDecodeFlag;
+    });
+    fNWaiters--;
+  }
+
+  // Give what we have at timeout
+  return TakeData(channels);
+}
+
+template <typename Policy>
+size_t RawDecoder<Policy>::CountData(const ChannelMask_t &channels)
+{
+  if (channels.all()) {
+    return fNData;
+  }
+
+  size_t count = 0;
+  for (uint32_t i = 0; i < kNChannelShards; i++) {
+    if (channels[i]) {
+      count += fShards[i].size;
+    }
+  }
+  return count;
+}
+
+template <typename Policy>
+std::unique_ptr<typename RawDecoder<Policy>::DataVec_t>
+RawDecoder<Policy>::TakeData(const ChannelMask_t &channels)
+{
+  Subscribe(channels);
+
+  auto data = GetContainer();
+  // Without a mask the shards are merged back to the time order
+  const bool merge = channels.all();
+  thread_local std::vector<DataVec_t> runs(kNChannelShards);
+  uint32_t nRuns = 0;
+  for (uint32_t i = 0; i < kNChannelShards; i++) {
+    auto &shard = fShards[i];
+    if (shard.size == 0 || (!channels[i] && IsSubscribed(i))) {
+      continue;
+    }
+
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    if (!channels[i]) {
+      // Merged before the first subscription, kept for nobody
+      fNDiscarded += shard.data.size();
+      fNData -= shard.data.size();
+      shard.data.clear();
+      shard.size = 0;
+      continue;
+    }
+    if (merge) {
+      runs[nRuns++].swap(shard.data);
+    } else if (data->empty()) {
+      // Keep the capacity on both sides
+      data->swap(shard.data);
+    } else {
+      data->insert(data->end(), std::make_move_iterator(shard.data.begin()),
+                   std::make_move_iterator(shard.data.end()));
+      shard.data.clear();
+    }
+    fNData -= shard.size;
+    shard.size = 0;
+  }
+  // A shard is in time order with one decode worker, with more the
+  // aggregates can be merged to it out of order
+  auto byTime = [](const std::unique_ptr<Data_t> &a,
+                   const std::unique_ptr<Data_t> &b) {
+    return a->timeStamp < b->timeStamp;
+  };
+  for (uint32_t i = 0; i < nRuns; i++) {
+    if (!std::is_sorted(runs[i].begin(), runs[i].end(), byTime)) {
+      std::stable_sort(runs[i].begin(), runs[i].end(), byTime);
+    }
+  }
+  if (nRuns == 1) {
+    data->swap(runs[0]);
+  } else if (nRuns > 1) {
+    MergeRuns(runs, nRuns, *data);
+  }
+
+  if (fLatencyFlag && !data->empty()) {
+    thread_local LatencyHistogram::Counts_t counts{};
+    auto now = SteadyTimeNs();
+    uint64_t max = 0;
+    for (auto &event : *data) {
+      auto latency = now - event->readTimeNs;
+      counts[LatencyHistogram::Bin(latency)]++;
+      max = std::max(max, latency);
+    }
+    fLatency.Add(counts, max);
+  }
+
+  // Room for the spilled data
+  if (fSpill && fSpill->GetNRecords() > 0) {
+    {
+      std::lock_guard<std::mutex> lock(fRawDataMutex);
+    }
+    fRawDataCondition.notify_all();
+  }
+
+  return data;
+}
+
+template <typename Policy>
+void RawDecoder<Policy>::MergeRuns(std::vector<DataVec_t> &runs, uint32_t nRuns,
+                                   DataVec_t &data)
+{
+  // k-way merge by time stamp, every run is in time order
+  typedef std::pair<uint64_t, uint32_t> Head_t;  // Time stamp, run
+  thread_local std::vector<Head_t> heads;
+  thread_local std::vector<size_t> next;
+  heads.clear();
+  next.assign(nRuns, 0);
+  size_t total = 0;
+  for (uint32_t i = 0; i < nRuns; i++) {
+    heads.emplace_back(runs[i][0]->timeStamp, i);
+    total += runs[i].size();
+  }
+  std::make_heap(heads.begin(), heads.end(), std::greater<Head_t>());
+  data.reserve(data.size() + total);
+
+  while (!heads.empty()) {
+    std::pop_heap(heads.begin(), heads.end(), std::greater<Head_t>());
+    auto i = heads.back().second;
+    heads.pop_back();
+    auto &run = runs[i];
+    data.push_back(std::move(run[next[i]++]));
+    if (next[i] < run.size()) {
+      heads.emplace_back(run[next[i]]->timeStamp, i);
+      std::push_heap(heads.begin(), heads.end(), std::greater<Head_t>());
+    }
+  }
+  for (uint32_t i = 0; i < nRuns; i++) {
+    runs[i].clear();
+  }
+}
+
+template <typename Policy>
+void RawDecoder<Policy>::MergeData(DataVec_t &dataVec)
+{
+  // Bucket by channel first to lock each shard once
+  thread_local std::array<DataVec_t, kNChannelShards> buckets;
+  for (auto &data : dataVec) {
+    buckets[data->channel % kNChannelShards].push_back(std::move(data));
+  }
+
+  for (uint32_t i = 0; i < kNChannelShards; i++) {
+    auto &bucket = buckets[i];
+    if (bucket.empty()) {
+      continue;
+    }
+    if (!IsSubscribed(i)) {
+      fNDiscarded += bucket.size();
+      bucket.clear();
+      continue;
+    }
+
+    auto &shard = fShards[i];
+    {
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      shard.data.insert(shard.data.end(),
+                        std::make_move_iterator(bucket.begin()),
+                        std::make_move_iterator(bucket.end()));
+      shard.size = shard.data.size();
+      fNData += bucket.size();
+    }
+    bucket.clear();
+  }
+
+  if (fNWaiters > 0) {
+    {
+      std::lock_guard<std::mutex> lock(fWaitMutex);
+    }
+    fDataCondition.notify_all();
+  }
+}
+
+template <typename Policy>
+void RawDecoder<Policy>::Subscribe(const ChannelMask_t &channels)
+{
+  auto added = false;
+  for (uint32_t w = 0; w < fSubscribed.size(); w++) {
+    uint64_t bits =
+        ((channels >> (64 * w)) & ChannelMask_t(~uint64_t(0))).to_ullong();
+    if ((fSubscribed[w] & bits) != bits) {
+      fSubscribed[w] |= bits;
+      added = true;
+    }
+  }
+  if (added) {
+    fSubscribedFlag = true;
+  }
+}
+
+template <typename Policy>
+void RawDecoder<Policy>::ReturnData(std::unique_ptr<DataVec_t> data)
+{
+  if (!data) {
+    return;
+  }
+  data->clear();
+
+  constexpr size_t maxPoolSize = 8;
+  std::lock_guard<std::mutex> lock(fContainerMutex);
+  if (fContainerPool.size() < maxPoolSize) {
+    fContainerPool.push_back(std::move(data));
+  }
+}
+
+template <typename Policy>
+std::unique_ptr<typename RawDecoder<Policy>::DataVec_t>
+RawDecoder<Policy>::GetContainer()
+{
+  {
+    std::lock_guard<std::mutex> lock(fContainerMutex);
+    if (!fContainerPool.empty()) {
+      auto data = std::move(fContainerPool.back());
+      fContainerPool.pop_back();
+      return data;
+    }
+  }
+  return std::make_unique<DataVec_t>();
+}
+
+template <typename Policy>
+void RawDecoder<Policy>::DecodeThread(uint32_t index)
+{
+  while (true) {
+    std::unique_ptr<RawData_t> rawData = nullptr;
+    {
+      std::unique_lock<std::mutex> lock(fRawDataMutex);
+      while (true) {
+        fParkCondition.wait(
+            lock, [this, index] { return !fDecodeFlag || index < fNActive; });
+        fRawDataCondition.wait(lock, [this, index] {
+          return !fDecodeFlag || index >= fNActive || !fRawDataQueue.empty() ||
+                 CanReplay();
+        });
+        if (fDecodeFlag && index >= fNActive) {
+          // Parked now, the wake up may have been for an active worker
+          fRawDataCondition.notify_one();
+          continue;
+        }
+        break;
+      }
+      // The queue is older than the spill file
+      if (!fRawDataQueue.empty()) {
+        rawData = std::move(fRawDataQueue.front());
+        fRawDataQueue.pop_front();
+        fRawQueueBytes -= rawData->size;
+      } else if (fDecodeFlag && CanReplay()) {
+        rawData = GetRawBuffer(0);
+        fSpill->Pop(*rawData);  // CanReplay checked the record is ready
+        rawData->queueTimeNs = SteadyTimeNs();
+      } else {
+        break;  // fDecodeFlag is false and nothing left
+      }
+      fNDecoding++;
+    }
+
+    auto start = SteadyTimeNs();
+    DecodeData(rawData);
+    auto end = SteadyTimeNs();
+    auto latency = end - rawData->queueTimeNs;
+    fBusyNs += end - start;
+    fLatencySumNs += latency;
+    fNDecoded++;
+    auto maxLatency = fLatencyMaxNs.load();
+    while (latency > maxLatency &&
+           !fLatencyMaxNs.compare_exchange_weak(maxLatency, latency)) {
+    }
+    ReturnRawBuffer(std::move(rawData));
+
+    {
+      std::lock_guard<std::mutex> lock(fRawDataMutex);
+      fNDecoding--;
+      if (IsDrained()) {
+        fDrainCondition.notify_all();
+      }
+    }
+  }
+}
+
+template <typename Policy>
+void RawDecoder<Policy>::WaitForDrain()
+{
+  std::unique_lock<std::mutex> lock(fRawDataMutex);
+  // Replay the spill without waiting for room in the output
+  fDrainFlag = true;
+  fRawDataCondition.notify_all();
+  fDrainCondition.wait(lock, [this] { return IsDrained(); });
+  fDrainFlag = false;
+}
+
+template <typename Policy>
+bool RawDecoder<Policy>::IsDrained()
+{
+  return fNDecoding == 0 && fRawDataQueue.empty() &&
+         (!fSpill || fSpill->GetNRecords() == 0);
+}
+
+template <typename Policy>
+void RawDecoder<Policy>::SetAutoScale(uint32_t minThreads,
+                                      std::chrono::microseconds targetLatency)
+{
+  {
+    std::lock_guard<std::mutex> lock(fRawDataMutex);
+    fMinActive = std::clamp<uint32_t>(minThreads, 1, fDecodeThreads.size());
+    fTargetLatencyNs = std::max<uint64_t>(
+        1, std::chrono::duration_cast<std::chrono::nanoseconds>(targetLatency)
+               .count());
+    fNActive = fMinActive;
+  }
+  fParkCondition.notify_all();
+  fRawDataCondition.notify_all();
+
+  // With fMinActive at the maximum the thread only keeps all active
+  if (!fScaleThread.joinable() && fMinActive < fDecodeThreads.size()) {
+    fScaleThread = std::thread(&RawDecoder::ScaleThread, this);
+  }
+}
+
+template <typename Policy>
+typename RawDecoder<Policy>::ScaleStats_t RawDecoder<Policy>::GetScaleStats()
+{
+  std::lock_guard<std::mutex> lock(fScaleMutex);
+  auto stats = fScaleStats;
+  stats.nActive = fNActive;
+  stats.nThreads = fDecodeThreads.size();
+  return stats;
+}
+
+template <typename Policy>
+void RawDecoder<Policy>::ScaleThread()
+{
+  constexpr auto period = std::chrono::milliseconds(100);
+  constexpr uint32_t idlePeriods = 10;  // Before shrinking
+  constexpr double lowLoad = 0.3;
+  const uint32_t maxActive = fDecodeThreads.size();
+  uint32_t nIdle = 0;
+  auto last = SteadyTimeNs();
+
+  std::unique_lock<std::mutex> lock(fScaleMutex);
+  while (!fScaleCondition.wait_for(lock, period,
+                                   [this] { return !fDecodeFlag; })) {
+    auto now = SteadyTimeNs();
+    auto elapsed = std::max<uint64_t>(1, now - last);
+    last = now;
+    auto nDecoded = fNDecoded.exchange(0);
+    auto latencySum = fLatencySumNs.exchange(0);
+    auto busy = fBusyNs.exchange(0);
+    fScaleStats.maxLatencyNs = fLatencyMaxNs.exchange(0);
+    fScaleStats.meanLatencyNs = (nDecoded > 0) ? latencySum / nDecoded : 0;
+
+    std::unique_lock<std::mutex> rawLock(fRawDataMutex);
+    uint32_t nActive = fNActive;
+    fScaleStats.queueDepth = fRawDataQueue.size();
+    fScaleStats.load = double(busy) / (double(elapsed) * nActive);
+
+    auto newActive = nActive;
+    if (fScaleStats.queueDepth > nActive ||
+        fScaleStats.meanLatencyNs > fTargetLatencyNs) {
+      // Burst, double at once
+      newActive = std::min(maxActive, nActive * 2);
+      nIdle = 0;
+    } else if (fScaleStats.queueDepth == 0 && fScaleStats.load < lowLoad &&
+               fScaleStats.meanLatencyNs < fTargetLatencyNs / 2) {
+      if (++nIdle >= idlePeriods) {
+        newActive = std::max(fMinActive, nActive - 1);
+        nIdle = 0;
+      }
+    } else {
+      nIdle = 0;
+    }
+    if (newActive == nActive) {
+      continue;
+    }
+
+    fNActive = newActive;
+    rawLock.unlock();
+    if (newActive > nActive) {
+      fScaleStats.nGrow++;
+      fParkCondition.notify_all();
+    } else {
+      fScaleStats.nShrink++;
+      fRawDataCondition.notify_all();
+    }
+    ASYNC_LOG("Decode threads {} -> {} (queue {}, latency {} us, load {}%)",
+              nActive, newActive, fScaleStats.queueDepth,
+              fScaleStats.meanLatencyNs / 1000, int(fScaleStats.load * 100));
+  }
+}
+
+template <typename Policy>
+void RawDecoder<Policy>::SetSpill(std::string fileName, size_t maxFileBytes,
+                                  size_t maxQueueBytes, size_t maxOutputEvents)
+{
+  auto spill = std::make_unique<SpillBuffer>(fileName, maxFileBytes);
+  if (!spill->IsOpen()) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(fRawDataMutex);
+  fSpill = std::move(spill);
+  fSpillQueueBytes = maxQueueBytes;
+  fSpillOutputEvents = std::max<size_t>(2, maxOutputEvents);
+}
+
+template <typename Policy>
+SpillStats_t RawDecoder<Policy>::GetSpillStats()
+{
+  std::lock_guard<std::mutex> lock(fRawDataMutex);
+  if (fSpill) {
+    return fSpill->GetStats();
+  }
+  return SpillStats_t();
+}
+
+template <typename Policy>
+bool RawDecoder<Policy>::NeedSpill(size_t size)
+{
+  return fSpill->GetNRecords() > 0 ||
+         fRawQueueBytes + size > fSpillQueueBytes ||
+         fNData > fSpillOutputEvents;
+}
+
+template <typename Policy>
+bool RawDecoder<Policy>::CanReplay()
+{
+  return fSpill && (fDrainFlag || fNData < fSpillOutputEvents / 2) &&
+         fSpill->CanPop();
+}
+
+template <typename Policy>
+std::unique_ptr<RawData_t> RawDecoder<Policy>::GetRawBuffer(size_t size)
+{
+  std::unique_ptr<RawData_t> rawData = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(fRawBufferMutex);
+    if (!fRawBufferPool.empty()) {
+      rawData = std::move(fRawBufferPool.back());
+      fRawBufferPool.pop_back();
+    }
+  }
+
+  if (!rawData) {
+    rawData = std::make_unique<RawData_t>(size);
+  } else if (rawData->data.size() < size) {
+    rawData->data.resize(size);
+  }
+  rawData->size = 0;
+  rawData->nEvents = 0;
+  rawData->readSeq = 0;
+
+  return rawData;
+}
+
+template <typename Policy>
+void RawDecoder<Policy>::ReserveRawBuffers(size_t count, size_t size)
+{
+  std::lock_guard<std::mutex> lock(fRawBufferMutex);
+  fMaxRawBuffers = std::max(fMaxRawBuffers, count);
+  fRawBufferPool.erase(
+      std::remove_if(fRawBufferPool.begin(), fRawBufferPool.end(),
+                     [size](const std::unique_ptr<RawData_t> &rawData) {
+                       return rawData->data.size() < size;
+                     }),
+      fRawBufferPool.end());
+  while (fRawBufferPool.size() < count) {
+    fRawBufferPool.push_back(std::make_unique<RawData_t>(size));
+  }
+}
+
+template <typename Policy>
+void RawDecoder<Policy>::ReturnRawBuffer(std::unique_ptr<RawData_t> rawData)
+{
+  std::lock_guard<std::mutex> lock(fRawBufferMutex);
+  if (fRawBufferPool.size() < fMaxRawBuffers) {
+    fRawBufferPool.push_back(std::move(rawData));
+  }
+}
+
+template <typename Policy>
+void RawDecoder<Policy>::DecodeData(std::unique_ptr<RawData_t> &rawData)
+{
+  constexpr size_t oneWordSize = 8;
+  uint64_t buf = 0;
+  if (fDumpFlag) {
+    ASYNC_DUMP("Data size: {}", rawData->data.data(), rawData->size);
+  }
+
+  // Check header
+  // bit[60:63] = 0x2
+  auto nRawWords = rawData->size / oneWordSize;
+  auto dataStart = rawData->data.data();
+  std::memcpy(&buf, dataStart, sizeof(uint64_t));
+  auto check = ((buf >> 60) & 0xF) == 0x2;
+  // The aggregate is quarantined once, with its first error, in both modes
+  DecodeError firstError = DecodeError::NumberOfErrors;
+  if (!check) {
+    CountError(DecodeError::InvalidHeader);
+    firstError = DecodeError::InvalidHeader;
+    if (!fSafeDecodeFlag) {
+      Quarantine(*rawData, firstError);
+      return;
+    }
+
+    // Resynchronize at the next word which looks like an aggregate header
+    size_t first = 1;
+    for (; first < nRawWords; first++) {
+      std::memcpy(&buf, dataStart + first * oneWordSize, sizeof(uint64_t));
+      auto size = buf & 0xFFFFFFFF;
+      if (((buf >> 60) & 0xF) == 0x2 && size > 1 &&
+          first + size <= nRawWords) {
+        break;
+      }
+    }
+    CountError(DecodeError::SkippedWords, first);
+    if (first >= nRawWords) {
+      Quarantine(*rawData, firstError);
+      return;
+    }
+    dataStart += first * oneWordSize;
+    nRawWords -= first;
+  }
+
+  // bit 56 = fail check
+  auto failCheck = ((buf >> 56) & 0b1) == 0x1;
+  if (failCheck) {
+    CountError(DecodeError::BoardFail);
+  }
+
+  // bit[32:55] = aggregate counter, checked by AddData in the read order
+
+  // bit[0:31] = tota size
+  auto totalSize = static_cast<uint32_t>(buf & 0xFFFFFFFF);
+  if (totalSize != nRawWords) {
+    CountError(DecodeError::SizeMismatch);
+  }
+
+  // Phase 1: index of the event start words, no decoding.
+  // Never read over the smaller of the header size and the read size.
+  auto nWords = std::min<size_t>(totalSize, nRawWords);
+  std::vector<size_t> eventIndex;
+  eventIndex.reserve(rawData->nEvents);
+  auto resync = false;
+  uint64_t nSkipped = 0;
+  for (size_t i = 1; i + 1 < nWords;) {
+    size_t next = 0;
+    DecodeError error;
+    if (fPolicy.ScanEvent(dataStart, i, nWords, next, error) &&
+        (!resync || CheckEventChain(dataStart, next, nWords))) {
+      eventIndex.push_back(i);
+      i = next;
+      resync = false;
+      continue;
+    }
+
+    // Count once for every broken part
+    if (!resync) {
+      CountError(error);
+      if (firstError == DecodeError::NumberOfErrors) {
+        firstError = error;
+      }
+    }
+    if (!fSafeDecodeFlag) {
+      break;  // Drop the rest of the aggregate
+    }
+    // Resynchronize at the next valid event header
+    resync = true;
+    nSkipped++;
+    i++;
+  }
+  // Once per aggregate, the error callback is not called for every word
+  if (nSkipped > 0) {
+    CountError(DecodeError::SkippedWords, nSkipped);
+  }
+  if (firstError != DecodeError::NumberOfErrors) {
+    Quarantine(*rawData, firstError);
+  }
+
+  // Rejected events are neither allocated nor decoded
+  fPolicy.FilterEvents(dataStart, eventIndex);
+
+  // Phase 2: decode the events into their own slots.  Large aggregates are
+  // shared by the OpenMP threads, the order is kept.  In the low latency
+  // mode every part of fPublishEvents is published before the next one.
+  const auto nEvents = eventIndex.size();
+  const auto readTimeNs = rawData->readTimeNs;
+  const size_t nPublish = (fPublishEvents > 0) ? fPublishEvents : nEvents;
+  DataVec_t dataVec;
+  for (size_t first = 0; first < nEvents; first += nPublish) {
+    const auto n = std::min(nPublish, nEvents - first);
+    dataVec.resize(n);
+    constexpr size_t minEventsPerThread = 64;
+    const bool parallel = (fNOMPThreads > 1) &&
+                          (n >= minEventsPerThread * fNOMPThreads);
+#pragma omp parallel for if (parallel) num_threads(fNOMPThreads) \
+    schedule(static)
+    for (size_t iEvent = 0; iEvent < n; iEvent++) {
+      auto data = std::make_unique<Data_t>();
+      fPolicy.DecodeEvent(dataStart, eventIndex[first + iEvent], nWords,
+                          *data);
+      data->readTimeNs = readTimeNs;
+      dataVec[iEvent] = std::move(data);
+    }
+
+    fPolicy.FinishBatch(dataVec);
+
+    for (auto &observer : fBatchObservers) {
+      observer(dataVec);
+    }
+
+    MergeData(dataVec);
+  }
+}
+
+template <typename Policy>
+bool RawDecoder<Policy>::CheckEventChain(const uint8_t *dataStart, size_t i,
+                                         size_t nWords)
+{
+  // Waveform words can look like an event header.  A resync candidate is
+  // accepted when the following events are also valid.
+  constexpr uint32_t nCheckEvents = 16;
+  for (uint32_t n = 0; n < nCheckEvents; n++) {
+    if (i + 1 >= nWords) {
+      return i == nWords;  // Must end at the aggregate end
+    }
+    size_t next = 0;
+    DecodeError error;
+    if (!fPolicy.ScanEvent(dataStart, i, nWords, next, error)) {
+      return false;
+    }
+    i = next;
+  }
+  return true;
+}
+
+template <typename Policy>
+DataType RawDecoder<Policy>::AddData(std::unique_ptr<RawData_t> rawData)
+{
+  constexpr uint32_t oneWordSize = 8;
+  const auto readSeq = rawData->readSeq;
+  auto dataType = DataType::Unknown;
+  if (rawData->size % oneWordSize == 0 &&
+      rawData->size <= rawData->data.size()) {
+    rawData->readTimeNs = SteadyTimeNs();
+
+    // change big endian to little endian
+    for (size_t i = 0; i < rawData->size; i += oneWordSize) {
+      std::reverse(rawData->data.begin() + i,
+                   rawData->data.begin() + i + oneWordSize);
+    }
+
+    dataType = CheckDataType(rawData);
+  }
+
+  if (dataType == DataType::Event) {
+    for (auto &observer : fRawObservers) {
+      observer(*rawData);
+    }
+  }
+
+  auto spilled = false;
+  auto spillOffset = SpillBuffer::kNoRecord;
+  {
+    std::unique_lock<std::mutex> lock(fRawDataMutex);
+    // The readers swap in parallel, the counter check and the queue follow
+    // the read order
+    fReadOrderCondition.wait(lock, [this, readSeq] {
+      return readSeq == 0 || readSeq == fLastReadSeq + 1;
+    });
+    if (dataType == DataType::Event) {
+      CheckCounter(*rawData);
+      if (fSpill && NeedSpill(rawData->size)) {
+        // Only the slot is reserved here, the copy is done without lock
+        spillOffset = fSpill->Reserve(*rawData);
+        spilled = true;
+      } else {
+        rawData->queueTimeNs = SteadyTimeNs();
+        fRawQueueBytes += rawData->size;
+        fRawDataQueue.push_back(std::move(rawData));
+      }
+    } else if (dataType == DataType::Start) {
+      // Aggregate counter restarts at every run
+      fLastCounter = 0;
+    }
+    if (readSeq != 0) {
+      fLastReadSeq = readSeq;
+    }
+  }
+  if (readSeq != 0) {
+    fReadOrderCondition.notify_all();
+  }
+
+  if (dataType == DataType::Event) {
+    if (spilled && spillOffset != SpillBuffer::kNoRecord) {
+      fSpill->Commit(spillOffset, *rawData);
+      // A worker tests CanReplay (the ready flag) with fRawDataMutex locked.
+      // Taking it here puts the notify after that test or before it, not
+      // between the test and the wait.
+      {
+        std::lock_guard<std::mutex> lock(fRawDataMutex);
+      }
+    }
+    if (spilled) {
+      ReturnRawBuffer(std::move(rawData));
+    }
+    fRawDataCondition.notify_one();
+  } else if (dataType == DataType::Unknown) {
+    // Bad size or too small for anything, keep the run going
+    CountError(DecodeError::BadBufferSize);
+    Quarantine(*rawData, DecodeError::BadBufferSize);
+    ReturnRawBuffer(std::move(rawData));
+  } else {
+    ReturnRawBuffer(std::move(rawData));
+  }
+
+  return dataType;
+}
+
+template <typename Policy>
+void RawDecoder<Policy>::CheckCounter(const RawData_t &rawData)
+{
+  // Before the queue, the decode workers may finish in any order
+  uint64_t buf = 0;
+  std::memcpy(&buf, rawData.data.data(), sizeof(uint64_t));
+  if (((buf >> 60) & 0xF) != 0x2) {
+    return;  // Counted by DecodeData
+  }
+  // bit[32:55] = aggregate counter
+  auto aggregateCounter = (buf >> 32) & 0xFFFFFF;
+  if ((aggregateCounter != 0) && (aggregateCounter != fLastCounter + 1)) {
+    CountError(DecodeError::CounterGap);
+  }
+  fLastCounter = aggregateCounter;
+}
+
+template <typename Policy>
+void RawDecoder<Policy>::Quarantine(const RawData_t &rawData,
+                                    DecodeError error)
+{
+  // Record: magic "D2QA", error class, time [ns], size [bytes], data.
+  // The data words are already byte swapped (little endian).
+  constexpr uint32_t magic = 0x41513244;
+  constexpr uint64_t maxQuarantineSize = 1024 * 1024 * 1024;
+  uint64_t size = std::min(rawData.size, rawData.data.size());
+  uint32_t errorClass = static_cast<uint32_t>(error);
+  uint64_t timeNs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::system_clock::now().time_since_epoch())
+                        .count();
+
+  std::lock_guard<std::mutex> lock(fQuarantineMutex);
+  if (fQuarantineFile == "" || fQuarantineSize + size > maxQuarantineSize) {
+    return;
+  }
+  // Opened at the first broken aggregate of the run
+  auto &file = fQuarantineStream;
+  if (!file.is_open()) {
+    file.open(fQuarantineFile, std::ios::binary | std::ios::app);
+    if (!file) {
+      ASYNC_LOG("Failed to open the quarantine file");
+      fQuarantineFile = "";
+      return;
+    }
+  }
+  file.write(reinterpret_cast<const char *>(&magic), sizeof(magic));
+  file.write(reinterpret_cast<const char *>(&errorClass), sizeof(errorClass));
+  file.write(reinterpret_cast<const char *>(&timeNs), sizeof(timeNs));
+  file.write(reinterpret_cast<const char *>(&size), sizeof(size));
+  file.write(reinterpret_cast<const char *>(rawData.data.data()), size);
+  file.flush();
+  fQuarantineSize += size;
+}
+
+template <typename Policy>
+std::string RawDecoder<Policy>::GetErrorName(DecodeError error)
+{
+  switch (error) {
+    case DecodeError::InvalidHeader:
+      return "InvalidHeader";
+    case DecodeError::BoardFail:
+      return "BoardFail";
+    case DecodeError::CounterGap:
+      return "CounterGap";
+    case DecodeError::SizeMismatch:
+      return "SizeMismatch";
+    case DecodeError::BadEventHeader:
+      return "BadEventHeader";
+    case DecodeError::BadWaveformHeader:
+      return "BadWaveformHeader";
+    case DecodeError::Truncated:
+      return "Truncated";
+    case DecodeError::BadBufferSize:
+      return "BadBufferSize";
+    case DecodeError::SkippedWords:
+      return "SkippedWords";
+    default:
+      return "Unknown";
+  }
+}
+
+template <typename Policy>
+DataType RawDecoder<Policy>::CheckDataType(std::unique_ptr<RawData_t> &rawData)
+{
+  constexpr size_t oneWordSize = 8;
+  if (rawData->size < 3 * oneWordSize) {
+    return DataType::Unknown;
+  } else if (rawData->size == 3 * oneWordSize) {
+    if (CheckStop(rawData)) {
+      return DataType::Stop;
+    }
+  } else if (rawData->size == 4 * oneWordSize) {
+    if (CheckStart(rawData)) {
+      return DataType::Start;
+    }
+  }
+
+  return DataType::Event;
+}
+
+template <typename Policy>
+bool RawDecoder<Policy>::CheckStop(std::unique_ptr<RawData_t> &rawData)
+{
+  uint64_t buf = 0;
+  // The first word bit[60:63] = 0x3
+  // The first word bit[56:59] = 0x2
+  std::memcpy(&buf, &(*(rawData->data.begin())), sizeof(uint64_t));
+  auto firstCondition =
+      ((buf >> 60) & 0xF) == 0x3 && ((buf >> 56) & 0xF) == 0x2;
+
+  // The second word bit[56:63] = 0x0
+  std::memcpy(&buf, &(*(rawData->data.begin() + 8)), sizeof(uint64_t));
+  auto secondCondition = ((buf >> 56) & 0xF) == 0x0;
+
+  // The third word bit[56:63] = 0x1
+  std::memcpy(&buf, &(*(rawData->data.begin() + 16)), sizeof(uint64_t));
+  auto thirdCondition = ((buf >> 56) & 0xF) == 0x1;
+
+  if (firstCondition && secondCondition && thirdCondition) {
+    // The third word bit[0:31] = dead time
+    // auto deadTime = static_cast<uint32_t>(buf & 0xFFFFFFFF);
+    // std::cout << "Dead time: " << deadTime * 8 << " ns" << std::endl;
+    return true;
+  }
+
+  return false;
+}
+
+template <typename Policy>
+bool RawDecoder<Policy>::CheckStart(std::unique_ptr<RawData_t> &rawData)
+{
+  uint64_t buf = 0;
+  // The first word bit[60:63] = 0x3
+  // The first word bit[56:59] = 0x0
+  std::memcpy(&buf, &(*(rawData->data.begin())), sizeof(uint64_t));
+  auto firstCondition =
+      ((buf >> 60) & 0xF) == 0x3 && ((buf >> 56) & 0xF) == 0x0;
+
+  // The second word bit[56:63] = 0x2
+  std::memcpy(&buf, &(*(rawData->data.begin() + 8)), sizeof(uint64_t));
+  auto secondCondition = ((buf >> 56) & 0xF) == 0x2;
+
+  // The third word bit[56:63] = 0x1
+  std::memcpy(&buf, &(*(rawData->data.begin() + 16)), sizeof(uint64_t));
+  auto thirdCondition = ((buf >> 56) & 0xF) == 0x1;
+
+  // The fourth word bit[56:63] = 0x1
+  std::memcpy(&buf, &(*(rawData->data.begin() + 24)), sizeof(uint64_t));
+  auto fourthCondition = ((buf >> 56) & 0xF) == 0x1;
+
+  if (firstCondition && secondCondition && thirdCondition && fourthCondition) {
+    return true;
+  }
+
+  return false;
+}
+
+// Firmware policies
+template class RawDecoder<PSD2Policy>;
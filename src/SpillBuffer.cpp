@@ -0,0 +1,181 @@
+#include "SpillBuffer.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+SpillBuffer::SpillBuffer(std::string fileName, size_t maxBytes)
+    : fFileName(fileName)
+{
+  fPageSize = sysconf(_SC_PAGESIZE);
+  fMaxBytes = (maxBytes + fPageSize - 1) / fPageSize * fPageSize;
+
+  auto fd = open(fFileName.c_str(), O_CREAT | O_RDWR | O_TRUNC, 0644);
+  if (fd < 0) {
+    std::cerr << "Failed to open spill file " << fFileName << std::endl;
+    return;
+  }
+  // Sparse file, the disk is used only when spilling
+  if (ftruncate(fd, fMaxBytes) != 0) {
+    std::cerr << "Failed to resize spill file " << fFileName << std::endl;
+    close(fd);
+    unlink(fFileName.c_str());
+    return;
+  }
+  auto memory =
+      mmap(nullptr, fMaxBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (memory == MAP_FAILED) {
+    std::cerr << "Failed to map spill file " << fFileName << std::endl;
+    unlink(fFileName.c_str());
+    return;
+  }
+  fMemory = static_cast<uint8_t *>(memory);
+}
+
+SpillBuffer::~SpillBuffer()
+{
+  if (fMemory) {
+    munmap(fMemory, fMaxBytes);
+    unlink(fFileName.c_str());
+  }
+}
+
+bool SpillBuffer::Push(const RawData_t &rawData)
+{
+  auto offset = Reserve(rawData);
+  if (offset == kNoRecord) {
+    return false;
+  }
+  Commit(offset, rawData);
+  return true;
+}
+
+size_t SpillBuffer::Reserve(const RawData_t &rawData)
+{
+  auto size = std::min(rawData.size, rawData.data.size());
+  auto need = sizeof(RecordHeader) + ((size + 7) & ~size_t(7));
+
+  std::lock_guard<std::mutex> lock(fMutex);
+  if (!fMemory || need > fMaxBytes) {
+    fNDropped++;
+    return kNoRecord;
+  }
+  if (fNRecords == 0) {
+    // All consumed, the page of the last record included
+    fWrapAt = SIZE_MAX;
+    Release((fTail + fPageSize - 1) / fPageSize * fPageSize);
+    fHead = fTail = fReleased = 0;
+    fWrapAt = SIZE_MAX;
+  }
+
+  // Head never reaches tail with records left, head == tail is empty
+  if (fHead >= fTail && fHead + need > fMaxBytes) {
+    if (need >= fTail) {
+      fNDropped++;
+      return kNoRecord;
+    }
+    fWrapAt = fHead;
+    fHead = 0;
+  } else if (fHead < fTail && fHead + need >= fTail) {
+    fNDropped++;
+    return kNoRecord;
+  }
+
+  auto offset = fHead;
+  RecordHeader header{size, rawData.nEvents, 0, rawData.readTimeNs};
+  std::memcpy(fMemory + offset, &header, sizeof(header));
+  fHead += need;
+  fNRecords++;
+  fUsedBytes += need;
+  fWrittenBytes += need;
+
+  return offset;
+}
+
+void SpillBuffer::Commit(size_t offset, const RawData_t &rawData)
+{
+  auto header = reinterpret_cast<RecordHeader *>(fMemory + offset);
+  std::memcpy(fMemory + offset + sizeof(RecordHeader), rawData.data.data(),
+              header->size);
+  __atomic_store_n(&header->ready, 1, __ATOMIC_RELEASE);
+}
+
+bool SpillBuffer::CanPop()
+{
+  std::lock_guard<std::mutex> lock(fMutex);
+  if (fNRecords == 0) {
+    return false;
+  }
+  auto tail = (fTail == fWrapAt) ? 0 : fTail;
+  auto header = reinterpret_cast<RecordHeader *>(fMemory + tail);
+  return __atomic_load_n(&header->ready, __ATOMIC_ACQUIRE) != 0;
+}
+
+bool SpillBuffer::Pop(RawData_t &rawData)
+{
+  std::lock_guard<std::mutex> lock(fMutex);
+  if (fNRecords == 0) {
+    return false;
+  }
+  auto tail = (fTail == fWrapAt) ? 0 : fTail;
+  auto header = reinterpret_cast<RecordHeader *>(fMemory + tail);
+  if (__atomic_load_n(&header->ready, __ATOMIC_ACQUIRE) == 0) {
+    return false;
+  }
+  if (fTail == fWrapAt) {
+    Release(fMaxBytes);
+    fTail = fReleased = 0;
+    fWrapAt = SIZE_MAX;
+  }
+
+  auto size = header->size;
+  if (rawData.data.size() < size) {
+    rawData.data.resize(size);
+  }
+  std::memcpy(rawData.data.data(), fMemory + fTail + sizeof(RecordHeader),
+              size);
+  rawData.size = size;
+  rawData.nEvents = header->nEvents;
+  rawData.readTimeNs = header->readTimeNs;
+
+  auto need = sizeof(RecordHeader) + ((size + 7) & ~size_t(7));
+  fTail += need;
+  // The page of the next record is kept
+  Release(fTail);
+  fNRecords--;
+  fUsedBytes -= need;
+  fReadBytes += need;
+
+  return true;
+}
+
+void SpillBuffer::Release(size_t end)
+{
+  end = end / fPageSize * fPageSize;
+  // After the writer wrapped, its records are in [0, fHead)
+  auto start = fReleased;
+  if (fWrapAt != SIZE_MAX) {
+    start = std::max(start, (fHead + fPageSize - 1) / fPageSize * fPageSize);
+  }
+  if (end > start) {
+    madvise(fMemory + start, end - start, MADV_REMOVE);
+  }
+  fReleased = std::max(fReleased, end);
+}
+
+SpillStats_t SpillBuffer::GetStats()
+{
+  SpillStats_t stats;
+  stats.maxBytes = fMaxBytes;
+  stats.usedBytes = fUsedBytes;
+  stats.nRecords = fNRecords;
+  stats.writtenBytes = fWrittenBytes;
+  stats.readBytes = fReadBytes;
+  stats.nDropped = fNDropped;
+  return stats;
+}
@@ -0,0 +1,105 @@
+#include "WaveformMonitor.hpp"
+
+#include <chrono>
+
+WaveformMonitor::WaveformMonitor(uint32_t intervalMs)
+    : fSlots(new Slot_t[kNChannelShards])
+{
+  SetInterval(intervalMs);
+  for (auto &bits : fChannelBits) {
+    bits.store(0);
+  }
+}
+
+void WaveformMonitor::SetInterval(uint32_t intervalMs)
+{
+  fIntervalNs.store(uint64_t(intervalMs) * 1000000,
+                    std::memory_order_relaxed);
+}
+
+void WaveformMonitor::SetChannels(const ChannelMask_t &channels)
+{
+  for (uint32_t i = 0; i < fChannelBits.size(); i++) {
+    uint64_t bits = 0;
+    for (uint32_t j = 0; j < 64; j++) {
+      if (channels[i * 64 + j]) {
+        bits |= uint64_t(1) << j;
+      }
+    }
+    fChannelBits[i].store(bits, std::memory_order_relaxed);
+  }
+}
+
+ChannelMask_t WaveformMonitor::GetChannels()
+{
+  ChannelMask_t channels;
+  for (uint32_t i = 0; i < fChannelBits.size(); i++) {
+    auto bits = fChannelBits[i].load(std::memory_order_relaxed);
+    for (uint32_t j = 0; j < 64; j++) {
+      channels[i * 64 + j] = (bits >> j) & 0x1;
+    }
+  }
+  return channels;
+}
+
+void WaveformMonitor::Offer(const PSD2DataVec_t &events)
+{
+  std::array<uint64_t, kNChannelShards / 64> mask;
+  auto any = false;
+  for (uint32_t i = 0; i < mask.size(); i++) {
+    mask[i] = fChannelBits[i].load(std::memory_order_relaxed);
+    any |= mask[i] != 0;
+  }
+  if (!any) {
+    return;
+  }
+
+  uint64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                     std::chrono::steady_clock::now().time_since_epoch())
+                     .count();
+  auto interval = fIntervalNs.load(std::memory_order_relaxed);
+
+  for (auto &event : events) {
+    auto ch = event->channel % kNChannelShards;
+    if (((mask[ch / 64] >> (ch % 64)) & 0x1) == 0 ||
+        event->waveformSize == 0) {
+      continue;
+    }
+    auto &slot = fSlots[ch];
+    auto next = slot.nextTimeNs.load(std::memory_order_relaxed);
+    if (now < next) {
+      continue;
+    }
+    if (!slot.nextTimeNs.compare_exchange_strong(next, now + interval,
+                                                 std::memory_order_relaxed)) {
+      continue;  // Other thread took this interval
+    }
+    if (slot.writing.test_and_set(std::memory_order_acquire)) {
+      continue;
+    }
+
+    // Buffers keep their capacity, no allocation after the first events
+    slot.buffers[slot.back] = *event;
+    auto previous =
+        slot.middle.exchange(slot.back | kDirty, std::memory_order_acq_rel);
+    slot.back = previous & 0x3;
+
+    slot.writing.clear(std::memory_order_release);
+  }
+}
+
+bool WaveformMonitor::GetLatest(uint32_t channel, PSD2Data_t &data)
+{
+  if (channel >= kNChannelShards) {
+    return false;
+  }
+  auto &slot = fSlots[channel];
+  if ((slot.middle.load(std::memory_order_acquire) & kDirty) == 0) {
+    return false;
+  }
+  auto previous = slot.middle.exchange(slot.front, std::memory_order_acq_rel);
+  slot.front = previous & 0x3;
+  data = slot.buffers[slot.front];
+
+  return true;
+}
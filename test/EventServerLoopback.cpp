@@ -0,0 +1,151 @@
+// Loopback check of the event server: frames published by several threads
+// arrive in seq order, and frames dropped for a slow client are seen as
+// lost by the client.
+
+#include <chrono>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "EventServer.hpp"
+#include "PSD2Codec.hpp"
+
+namespace
+{
+constexpr uint16_t kPort = 24713;
+
+PSD2DataVec_t MakeEvents(uint32_t first, uint32_t n)
+{
+  PSD2DataVec_t events;
+  for (uint32_t i = 0; i < n; i++) {
+    auto event = std::make_unique<PSD2Data_t>(4);
+    event->timeStamp = first + i;
+    event->channel = (first + i) % 16;
+    event->energy = 100 + i;
+    events.push_back(std::move(event));
+  }
+  return events;
+}
+
+bool WaitForClient(EventServer &server)
+{
+  for (int i = 0; i < 50; i++) {
+    if (server.GetClientStats().size() == 1) {
+      return true;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  }
+  std::cerr << "Client is not accepted" << std::endl;
+  return false;
+}
+
+// nThreads publish nFrames each of nEvents events
+void Publish(EventServer &server, uint32_t nThreads, uint32_t nFrames,
+             uint32_t nEvents)
+{
+  std::vector<std::thread> threads;
+  for (uint32_t t = 0; t < nThreads; t++) {
+    threads.emplace_back([&server, t, nFrames, nEvents] {
+      for (uint32_t i = 0; i < nFrames; i++) {
+        server.PublishEvents(MakeEvents((t * nFrames + i) * nEvents, nEvents));
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+}
+
+bool CheckOrder(bool compress)
+{
+  constexpr uint32_t nThreads = 4;
+  constexpr uint32_t nFrames = 250;
+  constexpr uint32_t nEvents = 8;
+
+  EventServer server(kPort, 256 * 1024 * 1024, compress);
+  EventClient client;
+  if (!server.Start() || !client.Connect("127.0.0.1", kPort) ||
+      !WaitForClient(server)) {
+    return false;
+  }
+
+  Publish(server, nThreads, nFrames, nEvents);
+
+  EventFrameHeader header;
+  std::vector<uint8_t> payload;
+  for (uint64_t seq = 0; seq < nThreads * nFrames; seq++) {
+    if (!client.Receive(header, payload)) {
+      std::cerr << "Receive failed at frame " << seq << std::endl;
+      return false;
+    }
+    PSD2DataVec_t events;
+    if (header.seq != seq ||
+        !PSD2Codec::DecodeAll(payload.data(), payload.size(), events) ||
+        events.size() != nEvents) {
+      std::cerr << "Frame " << seq << ": seq " << header.seq << ", "
+                << events.size() << " events" << std::endl;
+      return false;
+    }
+  }
+  if (client.GetLostFrames() != 0 || client.GetReorderedFrames() != 0) {
+    std::cerr << "Lost " << client.GetLostFrames() << ", reordered "
+              << client.GetReorderedFrames() << std::endl;
+    return false;
+  }
+  return true;
+}
+
+bool CheckLost()
+{
+  // The client reads only after the publishing, more than the socket
+  // buffers can hold is published
+  constexpr uint32_t nFrames = 4000;
+  constexpr uint32_t nEvents = 64;
+  EventServer server(kPort, 64 * 1024);
+  EventClient client;
+  if (!server.Start() || !client.Connect("127.0.0.1", kPort) ||
+      !WaitForClient(server)) {
+    return false;
+  }
+
+  Publish(server, 1, nFrames, nEvents);
+  auto dropped = server.GetClientStats()[0].droppedFrames;
+
+  EventFrameHeader header;
+  std::vector<uint8_t> payload;
+  for (uint64_t i = 0; i + dropped < nFrames; i++) {
+    if (!client.Receive(header, payload)) {
+      std::cerr << "Receive failed" << std::endl;
+      return false;
+    }
+  }
+  // The gap is seen with the next frame
+  server.PublishEvents(MakeEvents(0, nEvents));
+  if (!client.Receive(header, payload)) {
+    std::cerr << "Receive failed" << std::endl;
+    return false;
+  }
+
+  if (dropped == 0 || header.seq != nFrames ||
+      client.GetLostFrames() != dropped) {
+    std::cerr << "Dropped " << dropped << ", lost "
+              << client.GetLostFrames() << ", last seq " << header.seq
+              << std::endl;
+    return false;
+  }
+  return true;
+}
+}  // namespace
+
+int main()
+{
+  auto status = true;
+  status &= CheckOrder(false);
+#ifdef USE_LZ4
+  status &= CheckOrder(true);
+#endif
+  status &= CheckLost();
+
+  std::cout << (status ? "Loopback OK" : "Loopback FAILED") << std::endl;
+  return status ? 0 : 1;
+}
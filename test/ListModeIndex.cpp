@@ -0,0 +1,160 @@
+// Block index of the list mode file: FindBlocks gives every block which
+// can hold events of the range, and no more for time ordered blocks, also
+// when some events of a batch are out of order.
+
+#include <atomic>
+#include <cstdio>
+#include <iostream>
+#include <string>
+
+#include "ListMode.hpp"
+
+namespace
+{
+const std::string kFileName = "ListModeIndex.lmd";
+constexpr uint32_t kBlockRecords = 100;
+constexpr uint64_t kTimeStep = 10;
+
+bool Fail(const std::string &message)
+{
+  std::cerr << message << std::endl;
+  return false;
+}
+
+// Event i at i * kTimeStep, with every 50th event late by 3 steps
+uint64_t TimeOf(uint64_t i)
+{
+  return (i + (i % 50 == 49 ? 3 : 0)) * kTimeStep;
+}
+
+bool WriteFile(uint64_t nEvents)
+{
+  ListModeWriter writer(kFileName, 2., kBlockRecords);
+  if (!writer.IsOpen()) {
+    return Fail("Failed to open " + kFileName);
+  }
+  // Batches do not follow the blocks
+  constexpr uint64_t batchSize = 37;
+  for (uint64_t first = 0; first < nEvents; first += batchSize) {
+    PSD2DataVec_t events;
+    for (auto i = first; i < std::min(nEvents, first + batchSize); i++) {
+      auto event = std::make_unique<PSD2Data_t>();
+      event->timeStamp = TimeOf(i);
+      event->aggregateCounter = i;
+      event->fineTimeStamp = 0;
+      event->energy = i % 1000;
+      event->energyShort = 0;
+      event->flagsLowPriority = event->flagsHighPriority = 0;
+      event->channel = i % 4;
+      event->boardFail = false;
+      events.push_back(std::move(event));
+    }
+    writer.Write(events);
+  }
+  writer.Close();
+  return writer.GetNRecords() == nEvents;
+}
+
+// Blocks outside [first, last) must not have events in [start, end]
+bool CheckRange(ListModeReader &reader, uint64_t start, uint64_t end)
+{
+  uint64_t first, last;
+  reader.FindBlocks(start, end, first, last);
+  auto name = "[" + std::to_string(start) + ", " + std::to_string(end) + "]";
+  auto status = true;
+  uint64_t nInRange = 0;
+  for (uint64_t i = 0; i < reader.GetNBlocks(); i++) {
+    auto records = reader.GetBlock(i);
+    for (uint64_t j = 0; j < reader.GetBlockIndex(i).nRecords; j++) {
+      if (records[j].timeStamp >= start && records[j].timeStamp <= end) {
+        nInRange++;
+        if (i < first || i >= last) {
+          status = Fail("Block " + std::to_string(i) + " missed for " + name);
+          break;
+        }
+      }
+    }
+  }
+
+  std::atomic<uint64_t> nFound{0};
+  reader.ForEach(start, end, [&nFound](const ListModeRecord &) {
+    nFound++;
+  });
+  if (nFound != nInRange) {
+    status = Fail("ForEach found " + std::to_string(nFound) + " of " +
+                  std::to_string(nInRange) + " events in " + name);
+  }
+  return status;
+}
+
+bool CheckIndex()
+{
+  constexpr uint64_t nEvents = 1050;
+  if (!WriteFile(nEvents)) {
+    return Fail("Bad number of written records");
+  }
+  ListModeReader reader(kFileName);
+  if (!reader.IsOpen()) {
+    return Fail("Failed to read " + kFileName);
+  }
+
+  auto status = true;
+  if (reader.GetNRecords() != nEvents ||
+      reader.GetNBlocks() != (nEvents + kBlockRecords - 1) / kBlockRecords) {
+    status = Fail("Bad number of records or blocks");
+  }
+  for (uint64_t i = 0; i < reader.GetNBlocks(); i++) {
+    auto &index = reader.GetBlockIndex(i);
+    auto first = i * kBlockRecords;
+    if (index.minTimeStamp != TimeOf(first) ||
+        index.nRecords != std::min<uint64_t>(kBlockRecords, nEvents - first)) {
+      status = Fail("Bad index of block " + std::to_string(i));
+    }
+  }
+
+  // Inside one block only
+  uint64_t first, last;
+  reader.FindBlocks(TimeOf(210), TimeOf(220), first, last);
+  if (first != 2 || last != 3) {
+    status = Fail("Too many blocks for one block range");
+  }
+  // The late event of block 1 reaches block 2
+  reader.FindBlocks(TimeOf(200), TimeOf(201), first, last);
+  if (first != 1 || last != 3) {
+    status = Fail("Late event is not found");
+  }
+  reader.FindBlocks(nEvents * kTimeStep * 2, UINT64_MAX, first, last);
+  if (first != last) {
+    status = Fail("Blocks after the last event");
+  }
+
+  for (auto [start, end] : {std::pair<uint64_t, uint64_t>{0, UINT64_MAX},
+                            {0, 0},
+                            {TimeOf(199), TimeOf(205)},
+                            {TimeOf(333), TimeOf(777)},
+                            {TimeOf(1000), TimeOf(1049)}}) {
+    status &= CheckRange(reader, start, end);
+  }
+
+  // Channel 1 events 1, 5 .. 397, the late ones included
+  auto spectrum = reader.EnergySpectrum(1, 0, 399 * kTimeStep);
+  uint64_t nCounts = 0;
+  for (auto count : spectrum) {
+    nCounts += count;
+  }
+  if (nCounts != 100) {
+    status = Fail("Bad energy spectrum");
+  }
+  return status;
+}
+}  // namespace
+
+int main()
+{
+  auto status = CheckIndex();
+  std::remove(kFileName.c_str());
+
+  std::cout << (status ? "List mode index OK" : "List mode index FAILED")
+            << std::endl;
+  return status ? 0 : 1;
+}
@@ -0,0 +1,194 @@
+// Round trip of a batch through the Arrow export: schema and column
+// buffers hold the event values, and the release callbacks free the parent
+// and a moved child independently.
+
+#include <cstring>
+#include <iostream>
+#include <string>
+
+#include "PSD2Arrow.hpp"
+
+namespace
+{
+constexpr int64_t kNScalarColumns = 17;
+constexpr int64_t kNWaveformColumns = 6;
+
+PSD2DataVec_t MakeEvents(uint32_t n)
+{
+  PSD2DataVec_t events;
+  for (uint32_t i = 0; i < n; i++) {
+    auto event = std::make_unique<PSD2Data_t>(i);
+    event->timeStamp = 1000 + i;
+    event->channel = i % 4;
+    event->energy = 100 + i;
+    event->boardFail = (i == 3);
+    event->psdRatio = 0.25f * i;
+    for (uint32_t j = 0; j < i; j++) {
+      event->analogProbe1[j] = 10 * i + j;
+      event->digitalProbe2[j] = j % 2;
+    }
+    events.push_back(std::move(event));
+  }
+  return events;
+}
+
+bool Fail(const std::string &message)
+{
+  std::cerr << message << std::endl;
+  return false;
+}
+
+// Index of the column in the schema, -1 when missing
+int64_t FindColumn(const ArrowSchema &schema, const std::string &name)
+{
+  for (int64_t i = 0; i < schema.n_children; i++) {
+    if (name == schema.children[i]->name) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+bool CheckSchema()
+{
+  ArrowSchema schema;
+  PSD2Arrow::ExportSchema(&schema);
+  auto status = true;
+  if (std::string(schema.format) != "+s" ||
+      schema.n_children != kNScalarColumns + kNWaveformColumns) {
+    status = Fail("Bad struct schema");
+  }
+  auto wave = FindColumn(schema, "analogProbe1");
+  if (wave < 0 || std::string(schema.children[wave]->format) != "+l" ||
+      schema.children[wave]->n_children != 1 ||
+      std::string(schema.children[wave]->children[0]->format) != "i") {
+    status = Fail("Bad list schema");
+  }
+  schema.release(&schema);
+  if (schema.release != nullptr) {
+    status = Fail("Schema is not released");
+  }
+
+  PSD2Arrow::ExportSchema(&schema, false);
+  if (schema.n_children != kNScalarColumns) {
+    status = Fail("Waveform columns without waveform");
+  }
+  schema.release(&schema);
+  return status;
+}
+
+bool CheckBatch()
+{
+  constexpr uint32_t nEvents = 5;
+  auto events = MakeEvents(nEvents);
+  ArrowSchema schema;
+  ArrowArray array;
+  PSD2Arrow::ExportSchema(&schema);
+  PSD2Arrow::ExportBatch(events, &array);
+
+  auto status = true;
+  if (array.length != nEvents || array.n_children != schema.n_children) {
+    status = Fail("Bad struct array");
+  }
+  for (int64_t i = 0; i < array.n_children; i++) {
+    auto child = array.children[i];
+    if (child->length != nEvents || child->buffers[1] == nullptr ||
+        child->release == nullptr) {
+      status = Fail(std::string("Bad column ") + schema.children[i]->name);
+    }
+  }
+
+  auto timeStamp = static_cast<const uint64_t *>(
+      array.children[FindColumn(schema, "timeStamp")]->buffers[1]);
+  auto energy = static_cast<const uint16_t *>(
+      array.children[FindColumn(schema, "energy")]->buffers[1]);
+  auto psdRatio = static_cast<const float *>(
+      array.children[FindColumn(schema, "psdRatio")]->buffers[1]);
+  auto boardFail = static_cast<const uint8_t *>(
+      array.children[FindColumn(schema, "boardFail")]->buffers[1]);
+  for (uint32_t i = 0; i < nEvents; i++) {
+    if (timeStamp[i] != events[i]->timeStamp ||
+        energy[i] != events[i]->energy ||
+        psdRatio[i] != events[i]->psdRatio ||
+        ((boardFail[i / 8] >> (i % 8)) & 1) != events[i]->boardFail) {
+      status = Fail("Bad value of event " + std::to_string(i));
+    }
+  }
+
+  // List column: offsets in buffer 1, values in the child
+  for (auto name : {"analogProbe1", "digitalProbe2"}) {
+    auto column = array.children[FindColumn(schema, name)];
+    auto offsets = static_cast<const int32_t *>(column->buffers[1]);
+    auto values = column->children[0]->buffers[1];
+    for (uint32_t i = 0; i < nEvents; i++) {
+      auto &event = *events[i];
+      if (offsets[i + 1] - offsets[i] != int32_t(event.waveformSize)) {
+        status = Fail(std::string("Bad offsets of ") + name);
+        continue;
+      }
+      if (event.waveformSize == 0) {
+        continue;
+      }
+      auto same =
+          (std::string(name) == "analogProbe1")
+              ? std::memcmp(static_cast<const int32_t *>(values) + offsets[i],
+                            event.analogProbe1.data(),
+                            event.waveformSize * sizeof(int32_t)) == 0
+              : std::memcmp(static_cast<const uint8_t *>(values) + offsets[i],
+                            event.digitalProbe2.data(),
+                            event.waveformSize) == 0;
+      if (!same) {
+        status = Fail(std::string("Bad samples of ") + name);
+      }
+    }
+  }
+
+  // A consumer may move a child out and release it after the parent
+  auto energyIndex = FindColumn(schema, "energy");
+  ArrowArray moved = *array.children[energyIndex];
+  array.children[energyIndex]->release = nullptr;
+  array.release(&array);
+  if (array.release != nullptr) {
+    status = Fail("Array is not released");
+  }
+  if (static_cast<const uint16_t *>(moved.buffers[1])[2] != 102) {
+    status = Fail("Moved child is freed with the parent");
+  }
+  moved.release(&moved);
+  if (moved.release != nullptr) {
+    status = Fail("Moved child is not released");
+  }
+  schema.release(&schema);
+  return status;
+}
+
+bool CheckEmpty()
+{
+  PSD2DataVec_t events;
+  ArrowArray array;
+  PSD2Arrow::ExportBatch(events, &array, false);
+  auto status = true;
+  if (array.length != 0 || array.n_children != kNScalarColumns) {
+    status = Fail("Bad empty array");
+  }
+  for (int64_t i = 0; i < array.n_children; i++) {
+    if (array.children[i]->buffers[1] == nullptr) {
+      status = Fail("Null buffer in the empty array");
+    }
+  }
+  array.release(&array);
+  return status;
+}
+}  // namespace
+
+int main()
+{
+  auto status = true;
+  status &= CheckSchema();
+  status &= CheckBatch();
+  status &= CheckEmpty();
+
+  std::cout << (status ? "Arrow export OK" : "Arrow export FAILED")
+            << std::endl;
+  return status ? 0 : 1;
+}
@@ -0,0 +1,105 @@
+// Calibration file and batch: the coefficients of the listed channels are
+// applied, the others keep the identity, and broken files are refused.
+
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+#include "PSD2Calibration.hpp"
+
+namespace
+{
+const std::string kFileName = "PSD2CalibrationApply.cal";
+
+bool Fail(const std::string &message)
+{
+  std::cerr << message << std::endl;
+  return false;
+}
+
+bool WriteFile(const std::string &text)
+{
+  std::ofstream file(kFileName);
+  file << text;
+  return file.good();
+}
+
+std::unique_ptr<PSD2Data_t> MakeEvent(uint8_t channel, uint16_t energy,
+                                      uint16_t energyShort, double timeNs)
+{
+  auto event = std::make_unique<PSD2Data_t>();
+  event->channel = channel;
+  event->energy = energy;
+  event->energyShort = energyShort;
+  event->timeStampNs = timeNs;
+  return event;
+}
+
+bool Near(double a, double b) { return std::fabs(a - b) < 1e-6; }
+
+bool CheckApply()
+{
+  if (!WriteFile("# ch c0 c1 c2 timeOffsetNs\n"
+                 "0..3 1.0 2.0 0.5 -10\n"
+                 "\n"
+                 "5 0 1 0 2.5\n")) {
+    return Fail("Failed to write " + kFileName);
+  }
+  PSD2Calibration calibration;
+  if (!calibration.Load(kFileName)) {
+    return Fail("Valid file refused");
+  }
+
+  PSD2DataVec_t events;
+  events.push_back(MakeEvent(0, 10, 4, 100.));
+  events.push_back(MakeEvent(5, 100, 25, 200.));
+  events.push_back(MakeEvent(4, 7, 7, 300.));  // Not in the file
+  events.push_back(MakeEvent(3, 0, 0, 400.));
+  calibration.Apply(events);
+
+  // calibratedEnergy, psdRatio, correctedTimeNs
+  const double expected[][3] = {
+      {71., 0.6, 90.}, {100., 0.75, 202.5}, {7., 0., 300.}, {1., 0., 390.}};
+  auto status = true;
+  for (size_t i = 0; i < events.size(); i++) {
+    auto &event = *events[i];
+    if (!Near(event.calibratedEnergy, expected[i][0]) ||
+        !Near(event.psdRatio, expected[i][1]) ||
+        !Near(event.correctedTimeNs, expected[i][2])) {
+      status = Fail("Bad calibration of event " + std::to_string(i));
+    }
+  }
+  return status;
+}
+
+bool CheckInvalid()
+{
+  auto status = true;
+  PSD2Calibration calibration;
+  std::remove(kFileName.c_str());
+  if (calibration.Load(kFileName)) {
+    status = Fail("Missing file accepted");
+  }
+  for (auto text : {"0 1.0 2.0\n", "x 0 1 0 0\n", "3..1 0 1 0 0\n"}) {
+    WriteFile(text);
+    if (calibration.Load(kFileName)) {
+      status = Fail(std::string("Invalid line accepted: ") + text);
+    }
+  }
+  std::remove(kFileName.c_str());
+  return status;
+}
+}  // namespace
+
+int main()
+{
+  auto status = true;
+  status &= CheckApply();
+  status &= CheckInvalid();
+
+  std::cout << (status ? "Calibration OK" : "Calibration FAILED")
+            << std::endl;
+  return status ? 0 : 1;
+}
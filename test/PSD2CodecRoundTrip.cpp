@@ -0,0 +1,163 @@
+// Event records of the ring and the server: encoded events decode to the
+// same values, waveforms and calibration columns included, and truncated
+// buffers are refused instead of read over.
+
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "PSD2Codec.hpp"
+
+namespace
+{
+PSD2DataVec_t MakeEvents(uint32_t n)
+{
+  PSD2DataVec_t events;
+  for (uint32_t i = 0; i < n; i++) {
+    auto event = std::make_unique<PSD2Data_t>(3 * i);
+    event->timeStamp = 1000000 + i;
+    event->timeStampNs = 8. * event->timeStamp;
+    event->aggregateCounter = i / 2;
+    event->fineTimeStamp = 7 * i;
+    event->energy = 100 + i;
+    event->energyShort = 50 + i;
+    event->flagsLowPriority = i;
+    event->flagsHighPriority = 2 * i;
+    event->triggerThr = 300;
+    event->channel = i % 64;
+    event->timeResolution = 2;
+    event->analogProbe1Type = 1;
+    event->analogProbe2Type = 2;
+    event->digitalProbe1Type = 3;
+    event->digitalProbe2Type = 4;
+    event->digitalProbe3Type = 5;
+    event->digitalProbe4Type = 6;
+    event->downSampleFactor = 1;
+    event->boardFail = (i == 1);
+    event->waveformStart = i;
+    event->calibratedEnergy = 1.5 * event->energy;
+    event->correctedTimeNs = event->timeStampNs - 2.5;
+    event->psdRatio = 0.125f * i;
+    for (uint32_t j = 0; j < event->waveformSize; j++) {
+      event->analogProbe1[j] = -int32_t(j);
+      event->analogProbe2[j] = 1000 * i + j;
+      event->digitalProbe1[j] = j % 2;
+      event->digitalProbe2[j] = (j + 1) % 2;
+      event->digitalProbe3[j] = j % 3;
+      event->digitalProbe4[j] = i;
+    }
+    events.push_back(std::move(event));
+  }
+  return events;
+}
+
+bool Fail(const std::string &message)
+{
+  std::cerr << message << std::endl;
+  return false;
+}
+
+bool Same(const PSD2Data_t &a, const PSD2Data_t &b)
+{
+  return a.timeStamp == b.timeStamp && a.timeStampNs == b.timeStampNs &&
+         a.waveformSize == b.waveformSize &&
+         a.aggregateCounter == b.aggregateCounter &&
+         a.fineTimeStamp == b.fineTimeStamp && a.energy == b.energy &&
+         a.energyShort == b.energyShort &&
+         a.flagsLowPriority == b.flagsLowPriority &&
+         a.flagsHighPriority == b.flagsHighPriority &&
+         a.triggerThr == b.triggerThr && a.channel == b.channel &&
+         a.timeResolution == b.timeResolution &&
+         a.analogProbe1Type == b.analogProbe1Type &&
+         a.analogProbe2Type == b.analogProbe2Type &&
+         a.digitalProbe1Type == b.digitalProbe1Type &&
+         a.digitalProbe2Type == b.digitalProbe2Type &&
+         a.digitalProbe3Type == b.digitalProbe3Type &&
+         a.digitalProbe4Type == b.digitalProbe4Type &&
+         a.downSampleFactor == b.downSampleFactor &&
+         a.boardFail == b.boardFail && a.waveformStart == b.waveformStart &&
+         a.calibratedEnergy == b.calibratedEnergy &&
+         a.correctedTimeNs == b.correctedTimeNs &&
+         a.psdRatio == b.psdRatio && a.analogProbe1 == b.analogProbe1 &&
+         a.analogProbe2 == b.analogProbe2 &&
+         a.digitalProbe1 == b.digitalProbe1 &&
+         a.digitalProbe2 == b.digitalProbe2 &&
+         a.digitalProbe3 == b.digitalProbe3 &&
+         a.digitalProbe4 == b.digitalProbe4;
+}
+
+std::vector<uint8_t> EncodeAll(const PSD2DataVec_t &events, bool &status)
+{
+  std::vector<uint8_t> buffer;
+  for (auto &event : events) {
+    auto size = PSD2Codec::EncodedSize(*event);
+    if (size % 8 != 0) {
+      status = Fail("Encoded size is not padded");
+    }
+    auto pos = buffer.size();
+    buffer.resize(pos + size);
+    if (PSD2Codec::Encode(*event, buffer.data() + pos) != size) {
+      status = Fail("Encode does not match EncodedSize");
+    }
+  }
+  return buffer;
+}
+
+bool CheckRoundTrip()
+{
+  auto status = true;
+  auto events = MakeEvents(6);
+  auto buffer = EncodeAll(events, status);
+
+  PSD2DataVec_t decoded;
+  if (!PSD2Codec::DecodeAll(buffer.data(), buffer.size(), decoded) ||
+      decoded.size() != events.size()) {
+    return Fail("DecodeAll failed");
+  }
+  for (size_t i = 0; i < events.size(); i++) {
+    if (!Same(*events[i], *decoded[i])) {
+      status = Fail("Bad round trip of event " + std::to_string(i));
+    }
+  }
+  return status;
+}
+
+bool CheckBroken()
+{
+  auto status = true;
+  auto events = MakeEvents(3);
+  auto buffer = EncodeAll(events, status);
+
+  PSD2Data_t data;
+  if (PSD2Codec::Decode(buffer.data(), sizeof(PSD2EventRecord) - 1, data) !=
+      0) {
+    status = Fail("Short record decoded");
+  }
+  // The waveform of the last event is cut
+  PSD2DataVec_t decoded;
+  if (PSD2Codec::DecodeAll(buffer.data(), buffer.size() - 8, decoded)) {
+    status = Fail("Truncated buffer decoded");
+  }
+  // A waveform size larger than the buffer
+  PSD2EventRecord record;
+  std::memcpy(&record, buffer.data(), sizeof(record));
+  record.waveformSize = 0xFFFFFFF;
+  std::memcpy(buffer.data(), &record, sizeof(record));
+  if (PSD2Codec::Decode(buffer.data(), buffer.size(), data) != 0) {
+    status = Fail("Oversized waveform decoded");
+  }
+  return status;
+}
+}  // namespace
+
+int main()
+{
+  auto status = true;
+  status &= CheckRoundTrip();
+  status &= CheckBroken();
+
+  std::cout << (status ? "Codec round trip OK" : "Codec round trip FAILED")
+            << std::endl;
+  return status ? 0 : 1;
+}
@@ -0,0 +1,121 @@
+// Software filter rules: invalid rules are refused, the rules are applied
+// in order to their channels only, and every rule counts what it rejected
+// among the events kept by the rules before it.
+
+#include <iostream>
+#include <string>
+
+#include "PSD2Filter.hpp"
+
+namespace
+{
+struct TestEvent {
+  uint8_t channel;
+  uint16_t energy;
+  uint16_t energyShort;
+  uint16_t flagsLowPriority;
+  uint8_t accept;  // Expected
+};
+
+bool Fail(const std::string &message)
+{
+  std::cerr << message << std::endl;
+  return false;
+}
+
+bool CheckInvalid()
+{
+  auto status = true;
+  for (auto rule : {"energy 100", "psd", "flagsLow some 0x4",
+                    "flagsHigh all zz", "channel", "energy 0 10 x",
+                    "timeStamp 0 10"}) {
+    PSD2Filter filter;
+    if (filter.AddRule(rule) || filter.GetNRules() != 0) {
+      status = Fail(std::string("Invalid rule accepted: ") + rule);
+    }
+  }
+  return status;
+}
+
+bool CheckRules()
+{
+  PSD2Filter filter;
+  auto status = true;
+  for (auto rule : {"channel 0..3", "energy 100 1000", "psd 0.1 0.5 2",
+                    "flagsLow none 0x4"}) {
+    if (!filter.AddRule(rule)) {
+      status = Fail(std::string("Valid rule refused: ") + rule);
+    }
+  }
+
+  const TestEvent events[] = {
+      {0, 500, 400, 0x0, 1},    // PSD of another channel
+      {1, 50, 0, 0x0, 0},       // Low energy
+      {2, 500, 100, 0x0, 0},    // PSD 0.8
+      {2, 500, 300, 0x0, 1},    // PSD 0.4
+      {3, 500, 0, 0x4, 0},      // Flag
+      {4, 500, 0, 0x0, 0},      // Channel
+      {3, 2000, 0, 0x0, 0},     // High energy
+      {1, 1000, 999, 0x2, 1},   // Energy limit included, other flag
+  };
+  constexpr size_t n = sizeof(events) / sizeof(events[0]);
+  PSD2FilterBatch_t batch;
+  batch.Resize(n);
+  for (size_t i = 0; i < n; i++) {
+    batch.channel[i] = events[i].channel;
+    batch.energy[i] = events[i].energy;
+    batch.energyShort[i] = events[i].energyShort;
+    batch.flagsLowPriority[i] = events[i].flagsLowPriority;
+    batch.flagsHighPriority[i] = 0;
+  }
+  filter.Apply(batch);
+  for (size_t i = 0; i < n; i++) {
+    if (batch.accept[i] != events[i].accept) {
+      status = Fail("Bad filter result of event " + std::to_string(i));
+    }
+  }
+
+  // Accepted and rejected of every rule
+  const uint64_t expected[][2] = {{7, 1}, {5, 2}, {4, 1}, {3, 1}};
+  auto stats = filter.GetStats();
+  for (size_t i = 0; i < stats.size(); i++) {
+    if (stats[i].nAccepted != expected[i][0] ||
+        stats[i].nRejected != expected[i][1]) {
+      status = Fail("Bad counters of rule " + stats[i].rule);
+    }
+  }
+  return status;
+}
+
+bool CheckFlagsAll()
+{
+  PSD2Filter filter;
+  filter.AddRule("flagsHigh all 0x3 5");
+  PSD2FilterBatch_t batch;
+  batch.Resize(3);
+  const uint16_t flags[] = {0x3, 0x1, 0x1};
+  const uint8_t channels[] = {5, 5, 6};
+  for (size_t i = 0; i < 3; i++) {
+    batch.channel[i] = channels[i];
+    batch.energy[i] = batch.energyShort[i] = batch.flagsLowPriority[i] = 0;
+    batch.flagsHighPriority[i] = flags[i];
+  }
+  filter.Apply(batch);
+  if (batch.accept[0] != 1 || batch.accept[1] != 0 || batch.accept[2] != 1) {
+    return Fail("Bad flagsHigh all result");
+  }
+  return true;
+}
+}  // namespace
+
+int main()
+{
+  auto status = true;
+  status &= CheckInvalid();
+  status &= CheckRules();
+  status &= CheckFlagsAll();
+
+  std::cout << (status ? "Filter rules OK" : "Filter rules FAILED")
+            << std::endl;
+  return status ? 0 : 1;
+}
@@ -0,0 +1,308 @@
+// Index pass of the decoder with synthetic aggregates: events are found
+// inside the bounds of the aggregate, broken parts are counted once, the
+// hardened mode resynchronizes, and the unmasked output is in time order.
+
+#include <algorithm>
+#include <iostream>
+#include <string>
+
+#include "RawToPSD2.hpp"
+
+namespace
+{
+// Aggregate as read from the RAW endpoint, big endian 64 bit words
+class Aggregate
+{
+ public:
+  void AddEvent(uint8_t channel, uint64_t timeStamp, uint16_t energy,
+                uint32_t nWaveformWords = 0)
+  {
+    fWords.push_back((uint64_t(channel & 0x7F) << 56) |
+                     (timeStamp & 0xFFFFFFFFFFFF));
+    fWords.push_back((uint64_t(nWaveformWords > 0) << 62) | energy);
+    if (nWaveformWords > 0) {
+      fWords.push_back(uint64_t(1) << 63);  // Waveform header
+      fWords.push_back(nWaveformWords);
+      for (uint32_t i = 0; i < nWaveformWords; i++) {
+        fWords.push_back(0);
+      }
+    }
+  }
+  void AddWord(uint64_t word) { fWords.push_back(word); }
+  size_t GetNWords() { return fWords.size() + 1; }
+
+  // headerSize 0 is the real size, garbage words go before the header
+  std::unique_ptr<RawData_t> Build(uint32_t counter, uint64_t headerSize = 0,
+                                   uint32_t nGarbage = 0)
+  {
+    if (headerSize == 0) {
+      headerSize = GetNWords();
+    }
+    std::vector<uint64_t> words(nGarbage, 0x0123456789ABCDEF);
+    words.push_back((uint64_t(0x2) << 60) | (uint64_t(counter) << 32) |
+                    headerSize);
+    words.insert(words.end(), fWords.begin(), fWords.end());
+
+    auto rawData = std::make_unique<RawData_t>();
+    for (auto word : words) {
+      for (int i = 7; i >= 0; i--) {
+        rawData->data.push_back((word >> (8 * i)) & 0xFF);
+      }
+    }
+    rawData->size = rawData->data.size();
+    rawData->nEvents = 0;
+    return rawData;
+  }
+
+ private:
+  std::vector<uint64_t> fWords;
+};
+
+std::unique_ptr<PSD2DataVec_t> Decode(RawToPSD2 &decoder,
+                                      std::unique_ptr<RawData_t> rawData)
+{
+  decoder.AddData(std::move(rawData));
+  decoder.WaitForDrain();
+  return decoder.GetData();
+}
+
+// Expected and counted errors, false and printed when they differ
+bool CheckErrors(RawToPSD2 &decoder, const std::string &name,
+                 std::vector<std::pair<DecodeError, uint64_t>> expected)
+{
+  auto status = true;
+  for (uint32_t i = 0; i < static_cast<uint32_t>(DecodeError::NumberOfErrors);
+       i++) {
+    auto error = static_cast<DecodeError>(i);
+    uint64_t count = 0;
+    for (auto &[e, n] : expected) {
+      if (e == error) count = n;
+    }
+    if (decoder.GetErrorCount(error) != count) {
+      std::cerr << name << ": " << RawToPSD2::GetErrorName(error) << " "
+                << decoder.GetErrorCount(error) << ", expected " << count
+                << std::endl;
+      status = false;
+    }
+  }
+  return status;
+}
+
+bool CheckSize(const std::string &name, size_t size, size_t expected)
+{
+  if (size != expected) {
+    std::cerr << name << ": " << size << " events, expected " << expected
+              << std::endl;
+    return false;
+  }
+  return true;
+}
+
+bool CheckClean()
+{
+  Aggregate aggregate;
+  aggregate.AddEvent(3, 100, 1000);
+  aggregate.AddEvent(5, 200, 2000, 4);
+  aggregate.AddEvent(7, 300, 3000);
+  RawToPSD2 decoder;
+  auto data = Decode(decoder, aggregate.Build(1));
+
+  auto status = CheckSize("Clean", data->size(), 3);
+  status &= CheckErrors(decoder, "Clean", {});
+  if (status && ((*data)[1]->channel != 5 || (*data)[1]->timeStamp != 200 ||
+                 (*data)[1]->energy != 2000 ||
+                 (*data)[1]->waveformSize != 8)) {
+    std::cerr << "Clean: bad event fields" << std::endl;
+    status = false;
+  }
+  return status;
+}
+
+bool CheckTruncated()
+{
+  // The waveform of the last event goes over the aggregate end
+  Aggregate aggregate;
+  aggregate.AddEvent(0, 100, 1000);
+  aggregate.AddEvent(0, 200, 1000);
+  aggregate.AddWord(300);
+  aggregate.AddWord(uint64_t(1) << 62);  // With a waveform
+  aggregate.AddWord(uint64_t(1) << 63);
+  aggregate.AddWord(100);  // Only 2 of 100 words are in the aggregate
+  aggregate.AddWord(0);
+  aggregate.AddWord(0);
+  RawToPSD2 decoder;
+  auto data = Decode(decoder, aggregate.Build(1));
+
+  auto status = CheckSize("Truncated", data->size(), 2);
+  status &= CheckErrors(decoder, "Truncated", {{DecodeError::Truncated, 1}});
+  return status;
+}
+
+bool CheckSizeMismatch()
+{
+  // The header claims more words than read, only the read ones are used
+  Aggregate aggregate;
+  aggregate.AddEvent(0, 100, 1000);
+  aggregate.AddEvent(0, 200, 1000, 3);
+  RawToPSD2 decoder;
+  auto data =
+      Decode(decoder, aggregate.Build(1, aggregate.GetNWords() + 100));
+
+  auto status = CheckSize("SizeMismatch", data->size(), 2);
+  status &= CheckErrors(decoder, "SizeMismatch",
+                        {{DecodeError::SizeMismatch, 1}});
+  return status;
+}
+
+Aggregate BrokenEventAggregate()
+{
+  Aggregate aggregate;
+  aggregate.AddEvent(0, 100, 1000);
+  aggregate.AddEvent(0, 200, 1000, 2);
+  for (int i = 0; i < 3; i++) {
+    aggregate.AddWord(uint64_t(0x8) << 60);  // Bit 63 set
+  }
+  aggregate.AddEvent(0, 300, 1000);
+  aggregate.AddEvent(0, 400, 1000, 2);
+  aggregate.AddEvent(0, 500, 1000);
+  return aggregate;
+}
+
+bool CheckEventResync()
+{
+  auto status = true;
+  {
+    // Strict: the rest of the aggregate is dropped
+    RawToPSD2 decoder;
+    auto data = Decode(decoder, BrokenEventAggregate().Build(1));
+    status &= CheckSize("Strict event", data->size(), 2);
+    status &= CheckErrors(decoder, "Strict event",
+                          {{DecodeError::BadEventHeader, 1}});
+  }
+  {
+    // Hardened: the 3 words are skipped, counted once
+    RawToPSD2 decoder;
+    decoder.SetSafeDecode(true);
+    uint64_t nCallbacks = 0;
+    decoder.SetErrorCallback([&nCallbacks](DecodeError error) {
+      if (error == DecodeError::SkippedWords) nCallbacks++;
+    });
+    auto data = Decode(decoder, BrokenEventAggregate().Build(1));
+    status &= CheckSize("Safe event", data->size(), 5);
+    status &= CheckErrors(decoder, "Safe event",
+                          {{DecodeError::BadEventHeader, 1},
+                           {DecodeError::SkippedWords, 3}});
+    if (nCallbacks != 1) {
+      std::cerr << "Safe event: " << nCallbacks << " SkippedWords callbacks"
+                << std::endl;
+      status = false;
+    }
+  }
+  return status;
+}
+
+bool CheckHeaderResync()
+{
+  Aggregate aggregate;
+  aggregate.AddEvent(1, 100, 1000);
+  aggregate.AddEvent(2, 200, 1000);
+  auto status = true;
+  {
+    RawToPSD2 decoder;
+    auto data = Decode(decoder, aggregate.Build(1, 0, 2));
+    status &= CheckSize("Strict header", data->size(), 0);
+    status &= CheckErrors(decoder, "Strict header",
+                          {{DecodeError::InvalidHeader, 1}});
+  }
+  {
+    RawToPSD2 decoder;
+    decoder.SetSafeDecode(true);
+    auto data = Decode(decoder, aggregate.Build(1, 0, 2));
+    status &= CheckSize("Safe header", data->size(), 2);
+    status &= CheckErrors(decoder, "Safe header",
+                          {{DecodeError::InvalidHeader, 1},
+                           {DecodeError::SkippedWords, 2}});
+  }
+  return status;
+}
+
+bool CheckBufferSize()
+{
+  Aggregate aggregate;
+  aggregate.AddEvent(0, 100, 1000);
+  aggregate.AddEvent(0, 200, 1000);
+  auto rawData = aggregate.Build(1);
+  rawData->size -= 3;
+  RawToPSD2 decoder;
+  auto status = true;
+  if (decoder.AddData(std::move(rawData)) != DataType::Unknown) {
+    std::cerr << "BufferSize: not Unknown" << std::endl;
+    status = false;
+  }
+  decoder.WaitForDrain();
+  status &= CheckSize("BufferSize", decoder.GetData()->size(), 0);
+  status &= CheckErrors(decoder, "BufferSize",
+                        {{DecodeError::BadBufferSize, 1}});
+  return status;
+}
+
+bool CheckCounterGap()
+{
+  RawToPSD2 decoder;
+  for (uint32_t counter : {1, 2, 4, 5}) {
+    Aggregate aggregate;
+    aggregate.AddEvent(0, counter * 10, 1000);
+    aggregate.AddEvent(0, counter * 10 + 1, 1000);
+    decoder.AddData(aggregate.Build(counter));
+  }
+  decoder.WaitForDrain();
+  return CheckErrors(decoder, "CounterGap", {{DecodeError::CounterGap, 1}});
+}
+
+bool CheckTimeOrder()
+{
+  // Several workers merge aggregates to the shards out of order
+  constexpr uint32_t nAggregates = 400;
+  constexpr uint32_t nEvents = 32;
+  RawToPSD2 decoder(4);
+  for (uint32_t a = 0; a < nAggregates; a++) {
+    Aggregate aggregate;
+    for (uint32_t i = 0; i < nEvents; i++) {
+      aggregate.AddEvent(i % 4, a * nEvents + i, 1000, (i % 8 == 0) ? 2 : 0);
+    }
+    decoder.AddData(aggregate.Build(a + 1));
+  }
+  decoder.WaitForDrain();
+  auto data = decoder.GetData();
+
+  auto status = CheckSize("TimeOrder", data->size(), nAggregates * nEvents);
+  auto sorted = std::is_sorted(
+      data->begin(), data->end(),
+      [](const std::unique_ptr<PSD2Data_t> &a,
+         const std::unique_ptr<PSD2Data_t> &b) {
+        return a->timeStamp < b->timeStamp;
+      });
+  if (!sorted) {
+    std::cerr << "TimeOrder: not sorted" << std::endl;
+    status = false;
+  }
+  return status;
+}
+}  // namespace
+
+int main()
+{
+  auto status = true;
+  status &= CheckClean();
+  status &= CheckTruncated();
+  status &= CheckSizeMismatch();
+  status &= CheckEventResync();
+  status &= CheckHeaderResync();
+  status &= CheckBufferSize();
+  status &= CheckCounterGap();
+  status &= CheckTimeOrder();
+
+  std::cout << (status ? "Decoder index OK" : "Decoder index FAILED")
+            << std::endl;
+  return status ? 0 : 1;
+}
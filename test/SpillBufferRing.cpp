@@ -0,0 +1,225 @@
+// Ring of the spill file: records come back in the push order with their
+// data across the wrap to the file start, a full file drops and counts,
+// uncommitted records are not popped, and consumed pages leave the disk.
+
+#include <fcntl.h>
+#include <linux/falloc.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <deque>
+#include <iostream>
+#include <random>
+#include <string>
+
+#include "SpillBuffer.hpp"
+
+namespace
+{
+const std::string kFileName = "SpillBufferRing.spill";
+
+RawData_t MakeRecord(uint32_t id, size_t size)
+{
+  RawData_t rawData(size);
+  rawData.size = size;
+  rawData.nEvents = id;
+  rawData.readTimeNs = 1000 + id;
+  for (size_t i = 0; i < size; i++) {
+    rawData.data[i] = (id + i) & 0xFF;
+  }
+  return rawData;
+}
+
+bool Fail(const std::string &message)
+{
+  std::cerr << message << std::endl;
+  return false;
+}
+
+bool CheckRecord(const RawData_t &rawData, uint32_t id, size_t size)
+{
+  if (rawData.size != size || rawData.nEvents != id ||
+      rawData.readTimeNs != 1000 + id) {
+    return Fail("Bad header of record " + std::to_string(id));
+  }
+  for (size_t i = 0; i < size; i++) {
+    if (rawData.data[i] != ((id + i) & 0xFF)) {
+      return Fail("Bad data of record " + std::to_string(id));
+    }
+  }
+  return true;
+}
+
+// Bytes of the file on the disk
+uint64_t GetDiskBytes()
+{
+  struct stat st;
+  if (stat(kFileName.c_str(), &st) != 0) {
+    return 0;
+  }
+  return uint64_t(st.st_blocks) * 512;
+}
+
+// MADV_REMOVE needs hole punching, not every file system has it
+bool CanPunch()
+{
+  auto fileName = kFileName + ".probe";
+  auto fd = open(fileName.c_str(), O_CREAT | O_RDWR | O_TRUNC, 0644);
+  if (fd < 0) {
+    return false;
+  }
+  auto status = ftruncate(fd, 1 << 16) == 0 &&
+                fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 0,
+                          1 << 16) == 0;
+  close(fd);
+  unlink(fileName.c_str());
+  return status;
+}
+
+bool CheckFifo()
+{
+  // Random pushes and pops on a small file, the writer wraps many times
+  SpillBuffer spill(kFileName, 16 * 1024);
+  if (!spill.IsOpen()) {
+    return Fail("Spill file is not open");
+  }
+  std::mt19937 random(1);
+  std::deque<std::pair<uint32_t, size_t>> expected;
+  uint32_t nextId = 0;
+  uint64_t nDropped = 0;
+  auto status = true;
+  RawData_t rawData;
+  for (int step = 0; step < 20000 && status; step++) {
+    if (random() % 2 == 0) {
+      size_t size = 1 + random() % 2000;
+      if (spill.Push(MakeRecord(nextId, size))) {
+        expected.emplace_back(nextId, size);
+      } else {
+        nDropped++;
+      }
+      nextId++;
+    } else if (expected.empty()) {
+      if (spill.Pop(rawData)) {
+        status = Fail("Pop from an empty file");
+      }
+    } else if (!spill.Pop(rawData)) {
+      status = Fail("Pop failed with records");
+    } else {
+      status = CheckRecord(rawData, expected.front().first,
+                           expected.front().second);
+      expected.pop_front();
+    }
+    if (spill.GetNRecords() != expected.size()) {
+      status = Fail("Bad number of records");
+    }
+  }
+
+  auto stats = spill.GetStats();
+  if (stats.nDropped != nDropped) {
+    status = Fail("Dropped records are not counted");
+  }
+  if (stats.writtenBytes < 10 * stats.maxBytes) {
+    status = Fail("The writer did not wrap");
+  }
+  return status;
+}
+
+bool CheckFull()
+{
+  SpillBuffer spill(kFileName, 4096);
+  constexpr size_t size = 800;
+  uint32_t n = 0;
+  while (spill.Push(MakeRecord(n, size))) {
+    n++;
+  }
+  auto status = true;
+  auto stats = spill.GetStats();
+  if (n == 0 || stats.usedBytes > stats.maxBytes || stats.nDropped != 1 ||
+      stats.nRecords != n) {
+    status = Fail("Bad full file");
+  }
+  // Larger than the file, never stored
+  if (spill.Push(MakeRecord(n, 2 * stats.maxBytes)) ||
+      spill.GetStats().nDropped != 2) {
+    status = Fail("Record larger than the file");
+  }
+  RawData_t rawData;
+  for (uint32_t i = 0; i < n; i++) {
+    status &= spill.Pop(rawData) && CheckRecord(rawData, i, size);
+  }
+  return status;
+}
+
+bool CheckCommit()
+{
+  SpillBuffer spill(kFileName, 4096);
+  auto first = MakeRecord(1, 100);
+  auto second = MakeRecord(2, 200);
+  auto firstOffset = spill.Reserve(first);
+  auto secondOffset = spill.Reserve(second);
+  if (firstOffset == SpillBuffer::kNoRecord ||
+      secondOffset == SpillBuffer::kNoRecord) {
+    return Fail("Reserve failed");
+  }
+
+  auto status = true;
+  RawData_t rawData;
+  // The oldest record is not ready, the later one must wait
+  spill.Commit(secondOffset, second);
+  if (spill.CanPop() || spill.Pop(rawData)) {
+    status = Fail("Pop before Commit");
+  }
+  spill.Commit(firstOffset, first);
+  if (!spill.CanPop()) {
+    status = Fail("No pop after Commit");
+  }
+  status &= spill.Pop(rawData) && CheckRecord(rawData, 1, 100);
+  status &= spill.Pop(rawData) && CheckRecord(rawData, 2, 200);
+  return status;
+}
+
+bool CheckPunch()
+{
+  if (!CanPunch()) {
+    std::cout << "No hole punching on this file system, skipped"
+              << std::endl;
+    return true;
+  }
+  constexpr size_t maxBytes = 4 * 1024 * 1024;
+  SpillBuffer spill(kFileName, maxBytes);
+  uint32_t n = 0;
+  while (spill.GetStats().usedBytes < maxBytes / 2 &&
+         spill.Push(MakeRecord(n, 10000))) {
+    n++;
+  }
+  auto status = true;
+  auto used = GetDiskBytes();
+  if (used < maxBytes / 4) {
+    status = Fail("Spilled data are not on the disk");
+  }
+  RawData_t rawData;
+  for (uint32_t i = 0; i < n; i++) {
+    spill.Pop(rawData);
+  }
+  // Only the page of the next record is kept
+  auto left = GetDiskBytes();
+  if (left > 2 * uint64_t(sysconf(_SC_PAGESIZE))) {
+    status = Fail("Consumed pages are kept: " + std::to_string(left) + " of " +
+                  std::to_string(used) + " bytes");
+  }
+  return status;
+}
+}  // namespace
+
+int main()
+{
+  auto status = true;
+  status &= CheckFifo();
+  status &= CheckFull();
+  status &= CheckCommit();
+  status &= CheckPunch();
+
+  std::cout << (status ? "Spill buffer OK" : "Spill buffer FAILED")
+            << std::endl;
+  return status ? 0 : 1;
+}